@@ -91,12 +91,24 @@ mnemonics = {
 	#OP_LOADI  = 0x020, // Load an imm value
 	#OP_PUSHF  = 0x021, // Push flags to stack
 	#OP_POPF   = 0x022, // Pop flags from stack
+	#OP_LOAD8  = 0x023, // Load from linear memory, zero extended
+	#OP_LOAD16 = 0x024,
+	#OP_LOAD32 = 0x025,
+	#OP_STORE8 = 0x026, // Store to linear memory
+	#OP_STORE16= 0x027,
+	#OP_STORE32= 0x028,
 	
 	'HALT':   0x01E,
 	'INT':    0x01F,
 	'LOADI':  0x020,
 	'PUSHF':  0x021,
 	'POPF':   0x022,
+	'LOAD8':  0x023,
+	'LOAD16': 0x024,
+	'LOAD32': 0x025,
+	'STORE8': 0x026,
+	'STORE16':0x027,
+	'STORE32':0x028,
 	
         #OP_DMP    = 0xA00, // Dump all registers to terminal
         #OP_PRNT   = 0xA01 // Dump specific register to the terminal
@@ -109,6 +121,17 @@ pc = 0       # Our program counter (used for jump positions and such)
 lc = 0       # Our line counter
 program = [] # Our program (compiled)
 labels = {}  # dict of labels and their locations.
+rodata = bytearray() # read-only data for modules
+datalabels = {}      # dict of data labels and their offsets in rodata
+memory = None        # linear memory size from .memory, if any
+
+# Module file layout, see module.h
+MODULE_MAGIC = b'PVMMODUL'
+MODULE_VERSION = 1
+MODULE_HEADER = struct.Struct('<8sIIIIII8Q')
+MODULE_FEATURE_MEMORY = 1 << 0
+MODULE_FEATURE_WIDE = 1 << 1
+SYMBOL_LABEL, SYMBOL_ENTRY, SYMBOL_DATA = 0, 1, 2
 
 def lookupMnemonic(mstr):
 	try:
@@ -117,13 +140,38 @@ def lookupMnemonic(mstr):
 		# Fail the compile
 		raise CompilationError('Unknown mnemonic on line %d: \"%s\"' % (lc, mstr))
 
+# Set in the opcode word of the wide form, see program_t in vm.h
+OP_WIDE = 1 << 30
+
 def compileMnemonic(instr, r0, r1, r2, r3, r4, imm, is_static):
 	# This needs to be modified to allow all registers to be used.
-	return [instr, ((int(is_static) << 16) | (r0 << 12) | (r1 << 8) | (r2 << 4) | imm)]
+	fields = (int(is_static) << 16) | (r0 << 12) | (r1 << 8)
+	if 0 <= imm <= 0xFF:
+		return [instr, fields | (r2 << 4) | imm]
+	
+	# Anything bigger takes the whole operands word and the registers
+	# move up into the opcode word
+	if imm < -(1 << 31) or imm >= (1 << 32):
+		raise CompilationError('Constant %d on line %d doesn\'t fit in 32 bits' % (imm, lc))
+	if imm >= (1 << 31):
+		imm -= 1 << 32
+	return [OP_WIDE | (fields << 8) | instr, imm]
+
+# Split on sep, except where it's inside a "string"
+def splitOutsideQuotes(line, sep):
+	parts, start, quoted = [], 0, False
+	for n, c in enumerate(line):
+		if c == '"':
+			quoted = not quoted
+		elif c == sep and not quoted:
+			parts.append(line[start:n])
+			start = n + 1
+	parts.append(line[start:])
+	return parts
 
 # Parse a single line of assembly
 def parseMnemonic(line):
-	global pc, lc, program, labels
+	global pc, lc, program, labels, memory
 	
 	# Our registers
 	regs = {}
@@ -137,9 +185,8 @@ def parseMnemonic(line):
 	# Parsed a line so lets count it.
 	lc += 1
 	
-	# Remove comments from line
-	if line.find(';') != -1:
-		line = line[:line.find(';')]
+	# Remove comments from line, a ; in a string isn't one
+	line = splitOutsideQuotes(line, ';')[0]
 	
 	# Normalize the strings
 	line = line.strip().replace('  ', ' ')
@@ -154,6 +201,29 @@ def parseMnemonic(line):
 	
 	print("Parsing line[%d]: \"%s\"" % (pc, line))
 	
+	# Read-only data: .data name value, ... where the values are
+	# numbers (stored as 4 byte words) or "strings" (NUL terminated)
+	if line.startswith('.data'):
+		parts = line.split(' ', maxsplit=2)
+		if len(parts) < 3:
+			raise CompilationError('.data needs a name and values on line %d' % lc)
+		datalabels[parts[1]] = len(rodata)
+		for value in splitOutsideQuotes(parts[2], ','):
+			value = value.strip()
+			if value.startswith('"') and value.endswith('"') and len(value) > 1:
+				rodata.extend(value[1:-1].encode() + b'\0')
+			else:
+				rodata.extend(struct.pack('<i', int(value, 0)))
+		return False
+	
+	# Linear memory: .memory bytes
+	if line.startswith('.memory'):
+		parts = line.split()
+		if len(parts) != 2:
+			raise CompilationError('.memory needs a size on line %d' % lc)
+		memory = int(parts[1], 0)
+		return False
+	
 	# make sure our line isn't a label
 	if line[len(line)-1] == ':':
 		print('Label: "%s"' % (line[:-1]))
@@ -189,12 +259,22 @@ def parseMnemonic(line):
 				imm = int(i[1:])
 				is_static = True
 			elif i[0] == '$':
-				# label
-				imm = labels[i[1:]]+1
+				# label, or a .data name which is its address in memory
+				if i[1:] in labels:
+					imm = labels[i[1:]]
+				elif i[1:] in datalabels:
+					imm = datalabels[i[1:]]
+				else:
+					raise CompilationError('Unknown label "%s" on line %d' % (i[1:], lc))
 				is_static = True
 			else:
 				raise CompilationError("Unknown operand \"%s\" for mnemonic \"%s\" on line %d" % (i, opcode, lc))
 		
+		# Memory operands with a base register are the register form
+		# even with an offset
+		if len(regs) == 2 and opcode.strip().upper() in ('LEA', 'LOAD8', 'LOAD16', 'LOAD32', 'STORE8', 'STORE16', 'STORE32'):
+			is_static = False
+		
 	
 	# Compile the assmebly
 	program += compileMnemonic(
@@ -211,8 +291,50 @@ def parseMnemonic(line):
 	return True
 	
 
+def align8(data):
+	data.extend(b'\0' * (-len(data) % 8))
+
+# FNV-1a (32 bit), what the loader checks the module against
+def checksum(data):
+	h = 2166136261
+	for b in data:
+		h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+	return h
+
+# Write the program out as a module: header, code, read-only data,
+# symbols and their names, see module.h
+def writeModule(fd2):
+	body = bytearray()
+	code = len(body) + MODULE_HEADER.size
+	for i in program:
+		body.extend(struct.pack('<i', i))
+	align8(body)
+	data = len(body) + MODULE_HEADER.size
+	body.extend(rodata)
+	align8(body)
+	
+	# Execution starts at _start if there is one
+	symbols = [(name, SYMBOL_ENTRY if name == '_start' else SYMBOL_LABEL, value) for name, value in labels.items()]
+	symbols += [(name, SYMBOL_DATA, value) for name, value in datalabels.items()]
+	strings = bytearray()
+	symtab = len(body) + MODULE_HEADER.size
+	for name, kind, value in symbols:
+		body.extend(struct.pack('<IIII', len(strings), kind, value, 0))
+		strings.extend(name.encode() + b'\0')
+	strtab = len(body) + MODULE_HEADER.size
+	body.extend(strings)
+	align8(body)
+	
+	fd2.write(MODULE_HEADER.pack(MODULE_MAGIC, MODULE_VERSION,
+		(MODULE_FEATURE_MEMORY if memory is not None else 0) |
+		(MODULE_FEATURE_WIDE if any(w & OP_WIDE for w in program[0::2]) else 0), MODULE_HEADER.size,
+		checksum(body), labels.get('_start', 0), memory or 0,
+		code, len(program) // 2, data, len(rodata),
+		symtab, len(symbols), strtab, len(strings)))
+	fd2.write(body)
+
 # Make it a function that we can import
-def Assemble(filename, compiledfile):
+def Assemble(filename, compiledfile, module=False):
 	""" Our format for assembly is pretty simple.
 	    We'll have the syntax look like this:
 	    
@@ -244,9 +366,12 @@ def Assemble(filename, compiledfile):
 			print("Program: ", program)
 		else:
 			fd2 = open(compiledfile, 'wb')
-			for i in program:
-				# Write the program out as 4-byte integers
-				fd2.write(struct.pack('i', i))
+			if module:
+				writeModule(fd2)
+			else:
+				for i in program:
+					# Write the program out as 4-byte integers
+					fd2.write(struct.pack('i', i))
 			fd2.close()
 	fd.close()
 
@@ -257,6 +382,8 @@ if __name__ == "__main__":
 		print("USAGE: %s [options] source [...] object\n" % sys.argv[0])
 		print("OPTIONS:")
 		print(" -h, --help          This message")
+		print(" -m, --module        Write a module with symbols and data instead of bare instructions")
 		sys.exit(1)
 	
-	Assemble(sys.argv[1], sys.argv[2])
+	args = [a for a in sys.argv[1:] if a.lower() not in ('-m', '--module')]
+	Assemble(args[0], args[1], len(args) != len(sys.argv) - 1)
@@ -0,0 +1,697 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Assembler for the example.asm syntax built into the vm, so a program
+// can go from source to running without Assembler2.py:
+//
+//   label:                  a label for the next instruction
+//   .data name value, ...   read-only data, numbers are stored as 4 byte
+//                           words and "strings" NUL terminated
+//   .memory bytes           how much linear memory the program wants
+//   mnemonic r0, r1         registers, the first is r0 and the second r1
+//   mnemonic r0, #imm       a constant, anything past 255 (or negative)
+//                           is assembled into the wide form
+//   mnemonic $label         a label's address, which can come later on
+//   load32 r0, r1, #4       memory at r1 + 4, without r1 memory at 4
+//   ; comment
+//
+// The output is always a module (see module.h) with the labels as its
+// symbols and _start, if there is one, as the entry point. The data is
+// at the start of linear memory so a data label is its address. Assembling
+// the same source twice is pointless so modules are cached by a hash of
+// their source, a cache hit is just mapping the module in.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Bump this whenever the assembler's output changes so the cache isn't
+// used for anything an older version assembled.
+#define ASM_VERSION 4
+
+static const struct
+{
+	const char *name;
+	int32_t opcode;
+} Mnemonics[] = {
+	{ "unused", OP_UNUSED }, { "nop",  OP_NOP },  { "add",  OP_ADD },
+	{ "sub",  OP_SUB },  { "mul",  OP_MUL },  { "div",   OP_DIV },
+	{ "xor",  OP_XOR },  { "or",   OP_OR },   { "not",   OP_NOT },
+	{ "and",  OP_AND },  { "shr",  OP_SHR },  { "shl",   OP_SHL },
+	{ "inc",  OP_INC },  { "dec",  OP_DEC },  { "mov",   OP_MOV },
+	{ "cmp",  OP_CMP },  { "call", OP_CALL }, { "ret",   OP_RET },
+	{ "push", OP_PUSH }, { "pop",  OP_POP },  { "lea",   OP_LEA },
+	{ "jmp",  OP_JMP },  { "jnz",  OP_JNZ },  { "jz",    OP_JZ },
+	{ "js",   OP_JS },   { "jns",  OP_JNS },  { "jgt",   OP_JGT },
+	{ "jlt",  OP_JLT },  { "jpe",  OP_JPE },  { "jpo",   OP_JPO },
+	{ "halt", OP_HALT }, { "int",  OP_INT },  { "loadi", OP_LOADI },
+	{ "pushf", OP_PUSHF }, { "popf", OP_POPF },
+	{ "load8", OP_LOAD8 }, { "load16", OP_LOAD16 }, { "load32", OP_LOAD32 },
+	{ "store8", OP_STORE8 }, { "store16", OP_STORE16 }, { "store32", OP_STORE32 },
+	{ "dmp",  OP_DMP },  { "prnt", OP_PRNT },
+};
+
+typedef struct
+{
+	char *name;
+	uint32_t type;
+	uint32_t value;
+} asm_symbol_t;
+
+// A $label operand waiting for the label to turn up
+typedef struct
+{
+	char *label;
+	size_t instruction;
+	size_t line;
+} fixup_t;
+
+typedef struct
+{
+	const char *name;
+	size_t line;
+	
+	program_t *code;
+	size_t codeCount, codeCap;
+	unsigned char *rodata;
+	size_t rodataSize, rodataCap;
+	// From .memory, memory is set if there was one
+	int memory;
+	uint32_t memorySize;
+	asm_symbol_t *symbols;
+	size_t symbolCount, symbolCap;
+	fixup_t *fixups;
+	size_t fixupCount, fixupCap;
+} assembler_t;
+
+// Make room for one more of something in a growable array
+#define GROW(arr, count, cap) do { \
+	if ((count) == (cap)) \
+	{ \
+		size_t ncap_ = (cap) ? (cap) * 2 : 64; \
+		void *narr_ = realloc((arr), ncap_ * sizeof(*(arr))); \
+		if (!narr_) \
+		{ \
+			fprintf(stderr, "failed allocating %zu bytes: %s\n", ncap_ * sizeof(*(arr)), strerror(errno)); \
+			exit(1); \
+		} \
+		(arr) = narr_; \
+		(cap) = ncap_; \
+	} \
+} while(0)
+
+static void Error(const assembler_t *a, const char *fmt, const char *what)
+{
+	fprintf(stderr, "%s:%zu: ", a->name, a->line);
+	fprintf(stderr, fmt, what);
+	fputc('\n', stderr);
+}
+
+static char *Trim(char *str)
+{
+	while (isspace((unsigned char)*str))
+		str++;
+	char *end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return str;
+}
+
+static int IsIdentifier(const char *str)
+{
+	if (!*str || isdigit((unsigned char)*str))
+		return 0;
+	for (; *str; ++str)
+		if (!isalnum((unsigned char)*str) && *str != '_' && *str != '.')
+			return 0;
+	return 1;
+}
+
+static asm_symbol_t *Symbol(assembler_t *a, const char *name)
+{
+	for (size_t i = 0; i < a->symbolCount; ++i)
+		if (!strcmp(a->symbols[i].name, name))
+			return &a->symbols[i];
+	return NULL;
+}
+
+static int AddSymbol(assembler_t *a, const char *name, uint32_t type, uint32_t value)
+{
+	if (!IsIdentifier(name))
+	{
+		Error(a, "\"%s\" isn't a valid label", name);
+		return -1;
+	}
+	if (Symbol(a, name))
+	{
+		Error(a, "\"%s\" is defined twice", name);
+		return -1;
+	}
+	GROW(a->symbols, a->symbolCount, a->symbolCap);
+	a->symbols[a->symbolCount++] = (asm_symbol_t){ strdup(name), type, value };
+	return 0;
+}
+
+static int ParseNumber(assembler_t *a, const char *str, long *out)
+{
+	char *end;
+	errno = 0;
+	*out = strtol(str, &end, 0);
+	if (!*str || *end || errno)
+	{
+		Error(a, "\"%s\" isn't a number", str);
+		return -1;
+	}
+	return 0;
+}
+
+// .memory bytes
+static int ParseMemory(assembler_t *a, char *args)
+{
+	long size;
+	if (ParseNumber(a, Trim(args), &size) != 0)
+		return -1;
+	if (size < 0 || (unsigned long)size > UINT32_MAX)
+	{
+		Error(a, "can't have %s bytes of memory", Trim(args));
+		return -1;
+	}
+	a->memory = 1;
+	a->memorySize = (uint32_t)size;
+	return 0;
+}
+
+// .data name value, ...
+static int ParseData(assembler_t *a, char *args)
+{
+	char *name = Trim(args);
+	char *values = name;
+	while (*values && !isspace((unsigned char)*values))
+		values++;
+	if (*values)
+		*values++ = '\0';
+	values = Trim(values);
+	if (!*values)
+	{
+		Error(a, "%s needs a name and some values", ".data");
+		return -1;
+	}
+	if (AddSymbol(a, name, SYMBOL_DATA, (uint32_t)a->rodataSize) != 0)
+		return -1;
+	
+	while (*values)
+	{
+		char *next;
+		if (*values == '"')
+		{
+			char *close = strchr(values + 1, '"');
+			if (!close)
+			{
+				Error(a, "unterminated string %s", values);
+				return -1;
+			}
+			// The string and its NUL
+			for (char *c = values + 1; c <= close; ++c)
+			{
+				GROW(a->rodata, a->rodataSize, a->rodataCap);
+				a->rodata[a->rodataSize++] = c == close ? '\0' : *c;
+			}
+			next = Trim(close + 1);
+			if (*next && *next != ',')
+			{
+				Error(a, "expected a comma after a string, not \"%s\"", next);
+				return -1;
+			}
+			if (*next)
+				next++;
+		}
+		else
+		{
+			char *comma = strchr(values, ',');
+			next = comma ? comma + 1 : values + strlen(values);
+			if (comma)
+				*comma = '\0';
+			
+			long number;
+			if (ParseNumber(a, Trim(values), &number) != 0)
+				return -1;
+			uint32_t word = (uint32_t)number;
+			for (int i = 0; i < 4; ++i)
+			{
+				GROW(a->rodata, a->rodataSize, a->rodataCap);
+				a->rodata[a->rodataSize++] = (word >> (8 * i)) & 0xFF;
+			}
+		}
+		values = Trim(next);
+	}
+	return 0;
+}
+
+static int ParseInstruction(assembler_t *a, char *line)
+{
+	char *operands = line;
+	while (*operands && !isspace((unsigned char)*operands))
+		operands++;
+	if (*operands)
+		*operands++ = '\0';
+	
+	int32_t opcode = -1;
+	for (size_t i = 0; i < sizeof(Mnemonics) / sizeof(*Mnemonics); ++i)
+		if (!strcasecmp(Mnemonics[i].name, line))
+			opcode = Mnemonics[i].opcode;
+	if (opcode == -1)
+	{
+		Error(a, "unknown mnemonic \"%s\"", line);
+		return -1;
+	}
+	
+	int regs[2] = { 0, 0 }, nregs = 0, immediate = 0;
+	long imm = 0;
+	
+	for (char *op = operands, *next; op; op = next)
+	{
+		if ((next = strchr(op, ',')))
+			*next++ = '\0';
+		op = Trim(op);
+		if (op[0] == 'r' || op[0] == 'R')
+		{
+			long reg;
+			if (ParseNumber(a, op + 1, &reg) != 0)
+				return -1;
+			if (reg < 0 || reg >= NUM_REGS || nregs == 2)
+			{
+				Error(a, "bad register operand \"%s\"", op);
+				return -1;
+			}
+			regs[nregs++] = (int)reg;
+		}
+		else if (op[0] == '#' || op[0] == '$')
+		{
+			if (immediate)
+			{
+				Error(a, "more than one constant in \"%s\"", op);
+				return -1;
+			}
+			immediate = 1;
+			
+			if (op[0] == '#')
+			{
+				if (ParseNumber(a, op + 1, &imm) != 0)
+					return -1;
+				// Either signed or unsigned, it's the same 32 bits
+				if (imm < INT32_MIN || imm > (long)UINT32_MAX)
+				{
+					Error(a, "constant %s doesn't fit in 32 bits", op);
+					return -1;
+				}
+			}
+			else
+			{
+				// Worked out once every label is known
+				GROW(a->fixups, a->fixupCount, a->fixupCap);
+				a->fixups[a->fixupCount++] = (fixup_t){ strdup(op + 1), a->codeCount, a->line };
+			}
+		}
+		else if (*op)
+		{
+			Error(a, "unknown operand \"%s\"", op);
+			return -1;
+		}
+	}
+	
+	GROW(a->code, a->codeCount, a->codeCap);
+	// Memory operands are a base register plus an offset, they're only
+	// the immediate form when there's no base register
+	if (nregs == 2 && (opcode == OP_LEA || (opcode >= OP_LOAD8 && opcode <= OP_STORE32)))
+		immediate = 0;
+	
+	EncodeInstruction(&a->code[a->codeCount], opcode, immediate ? OP_FLAG_IMMEDIATE : OP_FLAG_REGISTER,
+		regs[0], regs[1], (int32_t)(uint32_t)imm);
+	a->codeCount++;
+	return 0;
+}
+
+static int ParseLine(assembler_t *a, char *line)
+{
+	// Comments, the ; in a string isn't one
+	int quoted = 0;
+	for (char *c = line; *c; ++c)
+	{
+		if (*c == '"')
+			quoted = !quoted;
+		else if (*c == ';' && !quoted)
+		{
+			*c = '\0';
+			break;
+		}
+	}
+	line = Trim(line);
+	
+	// Any number of labels in front of whatever else is on the line
+	for (;;)
+	{
+		size_t n = 0;
+		while (isalnum((unsigned char)line[n]) || line[n] == '_' || line[n] == '.')
+			n++;
+		if (!n || line[n] != ':')
+			break;
+		
+		line[n] = '\0';
+		if (AddSymbol(a, line, !strcmp(line, "_start") ? SYMBOL_ENTRY : SYMBOL_LABEL, (uint32_t)a->codeCount) != 0)
+			return -1;
+		line = Trim(line + n + 1);
+	}
+	
+	if (!*line)
+		return 0;
+	if (!strncasecmp(line, ".data", 5) && (!line[5] || isspace((unsigned char)line[5])))
+		return ParseData(a, line + 5);
+	if (!strncasecmp(line, ".memory", 7) && (!line[7] || isspace((unsigned char)line[7])))
+		return ParseMemory(a, line + 7);
+	return ParseInstruction(a, line);
+}
+
+static int ResolveFixups(assembler_t *a)
+{
+	for (size_t i = 0; i < a->fixupCount; ++i)
+	{
+		const fixup_t *f = &a->fixups[i];
+		const asm_symbol_t *sym = Symbol(a, f->label);
+		a->line = f->line;
+		if (!sym)
+		{
+			Error(a, "undefined label \"%s\"", f->label);
+			return -1;
+		}
+		
+		// Labels past 255 need the wide form, which is still one
+		// instruction so nothing after this one moves
+		program_t *pr = &a->code[f->instruction];
+		instruction_t ins;
+		DecodeInstruction(&ins, pr);
+		EncodeInstruction(pr, ins.opcode, ins.type, ins.r0, ins.r1, (int32_t)sym->value);
+	}
+	return 0;
+}
+
+static size_t Align8(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+// 64 bit FNV-1a of the source, for the cache
+static uint64_t SourceHash(const char *source, size_t len)
+{
+	uint64_t hash = 14695981039346656037ull ^ ASM_VERSION;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ (unsigned char)source[i]) * 1099511628211ull;
+	return hash;
+}
+
+// Lay the module out in an anonymous mapping, so it can be handed to
+// LoadModule() which unmaps it like any other.
+static void *BuildModule(const assembler_t *a, const char *source, size_t len, size_t *size)
+{
+	size_t strings = 0;
+	for (size_t i = 0; i < a->symbolCount; ++i)
+		strings += strlen(a->symbols[i].name) + 1;
+	
+	module_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MODULE_MAGIC, 8);
+	h.version = MODULE_VERSION;
+	h.features = MODULE_FEATURE_SOURCE;
+	h.headerSize = sizeof(module_header_t);
+	h.codeOffset = Align8(sizeof(module_header_t));
+	h.codeCount = a->codeCount;
+	h.rodataOffset = Align8(h.codeOffset + a->codeCount * sizeof(program_t));
+	h.rodataSize = a->rodataSize;
+	if (a->memory)
+	{
+		h.features |= MODULE_FEATURE_MEMORY;
+		h.memorySize = a->memorySize;
+	}
+	for (size_t i = 0; i < a->codeCount; ++i)
+		if (a->code[i].opcode & OP_WIDE)
+			h.features |= MODULE_FEATURE_WIDE;
+	h.symbolsOffset = Align8(h.rodataOffset + a->rodataSize);
+	h.symbolCount = a->symbolCount;
+	h.stringsOffset = h.symbolsOffset + a->symbolCount * sizeof(module_symbol_t);
+	h.stringsSize = strings;
+	h.sourceHash = SourceHash(source, len);
+	h.sourceSize = len;
+	*size = Align8(h.stringsOffset + strings);
+	
+	const asm_symbol_t *start = NULL;
+	for (size_t i = 0; i < a->symbolCount; ++i)
+		if (a->symbols[i].type == SYMBOL_ENTRY)
+			start = &a->symbols[i];
+	h.entry = start && start->value < a->codeCount ? start->value : 0;
+	
+	unsigned char *image = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (image == MAP_FAILED)
+	{
+		fprintf(stderr, "failed mapping %zu bytes: %s\n", *size, strerror(errno));
+		exit(1);
+	}
+	
+	if (a->codeCount)
+		memcpy(image + h.codeOffset, a->code, a->codeCount * sizeof(program_t));
+	if (a->rodataSize)
+		memcpy(image + h.rodataOffset, a->rodata, a->rodataSize);
+	
+	module_symbol_t *symbols = (module_symbol_t*)(image + h.symbolsOffset);
+	char *names = (char*)image + h.stringsOffset;
+	size_t at = 0;
+	for (size_t i = 0; i < a->symbolCount; ++i)
+	{
+		symbols[i] = (module_symbol_t){ (uint32_t)at, a->symbols[i].type, a->symbols[i].value, 0 };
+		strcpy(names + at, a->symbols[i].name);
+		at += strlen(a->symbols[i].name) + 1;
+	}
+	
+	h.checksum = ModuleChecksum(image + h.headerSize, *size - h.headerSize);
+	memcpy(image, &h, sizeof(h));
+	return image;
+}
+
+static void FreeAssembler(assembler_t *a)
+{
+	for (size_t i = 0; i < a->symbolCount; ++i)
+		free(a->symbols[i].name);
+	for (size_t i = 0; i < a->fixupCount; ++i)
+		free(a->fixups[i].label);
+	free(a->code);
+	free(a->rodata);
+	free(a->symbols);
+	free(a->fixups);
+}
+
+// Assemble source into a module. Returns an anonymous mapping of size
+// bytes, or NULL after saying what's wrong with the source. name is
+// only used for the error messages.
+void *AssembleModule(const char *name, const char *source, size_t len, size_t *size)
+{
+	assembler_t a;
+	memset(&a, 0, sizeof(a));
+	a.name = name;
+	
+	char *text = malloc(len + 1);
+	if (!text)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", len + 1, strerror(errno));
+		exit(1);
+	}
+	memcpy(text, source, len);
+	text[len] = '\0';
+	
+	void *image = NULL;
+	for (char *line = text, *next; line; line = next)
+	{
+		a.line++;
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		if (ParseLine(&a, line) != 0)
+			goto out;
+	}
+	
+	if (ResolveFixups(&a) == 0)
+		image = BuildModule(&a, source, len, size);
+	
+out:
+	free(text);
+	FreeAssembler(&a);
+	return image;
+}
+
+// Where assembled modules are kept: $PLAYVM_CACHE, otherwise playvm in
+// $XDG_CACHE_HOME or ~/.cache. Returns 0 if there's nowhere to put them.
+static int CacheDir(char *buf, size_t size)
+{
+	const char *dir = getenv("PLAYVM_CACHE"), *base;
+	if (dir && *dir)
+		snprintf(buf, size, "%s", dir);
+	else if ((base = getenv("XDG_CACHE_HOME")) && *base)
+		snprintf(buf, size, "%s/playvm", base);
+	else if ((base = getenv("HOME")) && *base)
+	{
+		snprintf(buf, size, "%s/.cache", base);
+		mkdir(buf, 0755);
+		snprintf(buf, size, "%s/.cache/playvm", base);
+	}
+	else
+		return 0;
+	
+	return mkdir(buf, 0755) == 0 || errno == EEXIST;
+}
+
+// Write the module to the cache. It's written under a temporary name
+// first so nobody else ever maps half of it.
+static void CacheModule(const char *path, const void *image, size_t size)
+{
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+	
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return;
+	
+	const char *data = image;
+	for (size_t done = 0; done < size;)
+	{
+		ssize_t n = write(fd, data + done, size - done);
+		if (n <= 0)
+		{
+			close(fd);
+			unlink(tmp);
+			return;
+		}
+		done += n;
+	}
+	
+	if (close(fd) != 0 || rename(tmp, path) != 0)
+		unlink(tmp);
+}
+
+// Load the cached module for a source, if it's intact and really was
+// assembled from that source. Returns -1 if it can't be used.
+static int LoadCached(vm_t *vm, const char *path, uint64_t hash, size_t len)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+	
+	size_t size = st.st_size;
+	const module_header_t *h = data;
+	if (IsModule(data, size) && size >= sizeof(module_header_t) &&
+	    (h->features & MODULE_FEATURE_SOURCE) && h->sourceHash == hash && h->sourceSize == len &&
+	    LoadModule(vm, data, size, 1) == 0)
+		return 0;
+	
+	munmap(data, size);
+	return -1;
+}
+
+// Load an assembly source file into the vm, out of the cache if it's
+// been assembled before (--asm).
+int LoadAssembly(vm_t *vm, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Failed to open %s: %s. Skipping.\n", path, strerror(errno));
+		return -1;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	size_t len = st.st_size;
+	void *source = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (source == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	
+	char cache[4096];
+	int cached = CacheDir(cache, sizeof(cache));
+	if (cached)
+	{
+		size_t used = strlen(cache);
+		uint64_t hash = SourceHash(source, len);
+		snprintf(cache + used, sizeof(cache) - used, "/%016" PRIx64 ".pvm", hash);
+		if (LoadCached(vm, cache, hash, len) == 0)
+		{
+			if (source)
+				munmap(source, len);
+			return 0;
+		}
+		// Whatever's there is no good, it's rewritten below
+		unlink(cache);
+	}
+	
+	size_t size;
+	void *image = AssembleModule(path, source, len, &size);
+	if (source)
+		munmap(source, len);
+	if (!image)
+		return -1;
+	
+	if (cached)
+		CacheModule(cache, image, size);
+	
+	if (LoadModule(vm, image, size, 0) != 0)
+	{
+		munmap(image, size);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Lockstep batch execution for parameter sweeps: up to BATCH_LANES vms
+// all loaded with the same program run as one. Their registers and lazy
+// flags are kept structure-of-arrays in vector registers so every ALU op
+// and flag computation is done for all of the lanes at once (GCC vector
+// extensions, SSE or AVX2 depending on what the build targets).
+//
+// The lanes stay together as long as they agree on where to go next.
+// When a conditional or computed jump splits them the bigger half keeps
+// going in lockstep and the rest are written back to their vms and
+// finished by the normal interpreter. Anything the batch engine doesn't
+// handle itself (HALT aside, the debug opcodes, the END sentinel, ...)
+// hands all of the remaining lanes over the same way, so the result is
+// always exactly what running each vm on its own gives.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__GNUC__) && !defined(VM_TRACE) && !defined(VM_PROFILE)
+
+typedef int32_t lanes_t __attribute__((vector_size(BATCH_LANES * sizeof(int32_t))));
+typedef uint32_t ulanes_t __attribute__((vector_size(BATCH_LANES * sizeof(int32_t))));
+
+#define ALL_LANES ((1u << BATCH_LANES) - 1)
+
+typedef struct group_s
+{
+	lanes_t regs[NUM_REGS];
+	// Lazy flags, lazyOp is the same for every lane since they all
+	// ran the same instruction.
+	uint8_t lazyOp;
+	lanes_t lazyResult;
+	lanes_t lazyA;
+	lanes_t lazyB;
+	
+	// The lanes still running in lockstep and where they are
+	unsigned mask;
+	size_t ip;
+	vm_t *vms[BATCH_LANES];
+	
+	// Fuel is charged for the whole group, fuel is what the lane with
+	// the least had to start with and spent goes on every lane's
+	// account when it leaves.
+	uint64_t fuel;
+	uint64_t spent;
+	
+	// BaseHandler() of every instruction in the program
+	const uint8_t *base;
+	
+	// Whether the verifier bounded the stack of every lane, otherwise
+	// the interpreter does the stack ops so they're checked
+	int stackVerified;
+} group_t;
+
+#define EACH_LANE(g, l) \
+	for (unsigned l = 0; l < BATCH_LANES; ++l) \
+		if ((g)->mask & (1u << l))
+
+// Turn a vector comparison into a bitmask of the lanes where it's true
+static unsigned LaneMask(const lanes_t *cond)
+{
+	unsigned mask = 0;
+	for (unsigned l = 0; l < BATCH_LANES; ++l)
+		if ((*cond)[l])
+			mask |= 1u << l;
+	return mask;
+}
+
+// The vector version of ComputeFlags(), always works out all of them.
+// Vectors are passed around by pointer, passing them by value depends
+// on which vector extensions the build has enabled.
+static void ComputeLaneFlags(const group_t *g, lanes_t *out)
+{
+	lanes_t res = g->lazyResult, a = g->lazyA, b = g->lazyB;
+	lanes_t flags = ((res == 0) & FLAG_ZERO) | ((res < 0) & FLAG_SIGN);
+	
+	// Fold the parity of all 32 bits down into bit 0
+	ulanes_t p = (ulanes_t)res;
+	p ^= p >> 16;
+	p ^= p >> 8;
+	p ^= p >> 4;
+	p ^= p >> 2;
+	p ^= p >> 1;
+	flags |= ((lanes_t)(p & 1) == 0) & FLAG_PARITY;
+	
+	switch(g->lazyOp)
+	{
+		case LAZY_ADD:
+			flags |= ((ulanes_t)res < (ulanes_t)a) & FLAG_CARRY;
+			flags |= (((a ^ res) & (b ^ res)) < 0) & FLAG_OVERFLOW;
+			break;
+		case LAZY_SUB:
+			flags |= ((ulanes_t)a < (ulanes_t)b) & FLAG_CARRY;
+			flags |= (((a ^ b) & (a ^ res)) < 0) & FLAG_OVERFLOW;
+			break;
+		case LAZY_MUL:
+			// No 32x32->64 multiply in the vector extensions
+			for (unsigned l = 0; l < BATCH_LANES; ++l)
+				if ((int64_t)a[l] * b[l] != res[l])
+					flags[l] |= FLAG_CARRY | FLAG_OVERFLOW;
+			break;
+		default:
+			break;
+	}
+	
+	*out = flags;
+}
+
+static void LaneFlags(const group_t *g, lanes_t *out)
+{
+	if (g->lazyOp == LAZY_NONE)
+		*out = g->regs[4] & FLAG_MASK;
+	else
+		ComputeLaneFlags(g, out);
+}
+
+static void MaterializeLaneFlags(group_t *g)
+{
+	if (g->lazyOp == LAZY_NONE)
+		return;
+	lanes_t flags;
+	ComputeLaneFlags(g, &flags);
+	g->regs[4] = (g->regs[4] & ~FLAG_MASK) | flags;
+	g->lazyOp = LAZY_NONE;
+}
+
+#define FLAGS(op, res, a, b) do { \
+	g->lazyOp = (op); \
+	g->lazyResult = (res); \
+	g->lazyA = (a); \
+	g->lazyB = (b); \
+} while(0)
+
+// Write a lane back into its vm, stopped in front of instruction ip
+static void StoreLane(group_t *g, unsigned l, size_t ip)
+{
+	vm_t *vm = g->vms[l];
+	for (int r = 0; r < NUM_REGS; ++r)
+		vm->regs[r] = g->regs[r][l];
+	vm->lazyOp = g->lazyOp;
+	vm->lazyResult = g->lazyResult[l];
+	vm->lazyA = g->lazyA[l];
+	vm->lazyB = g->lazyB[l];
+	vm->ip = ip;
+	vm->fuel -= g->spent;
+	vm->retired += g->spent;
+}
+
+// Take lanes out of the group and finish them in the interpreter. With
+// charge set they've just made a computed jump into ip which still has
+// to be paid for, marking them yielded gets ResumeFuel() to do that
+// exactly like JUMP_INDIRECT() would have.
+static void DropToScalar(group_t *g, unsigned lanes, size_t ip, int charge)
+{
+	for (unsigned l = 0; l < BATCH_LANES; ++l)
+	{
+		if (!(lanes & (1u << l)))
+			continue;
+		StoreLane(g, l, ip);
+		g->vms[l]->yielded = charge;
+		RunVM(g->vms[l]);
+	}
+	g->mask &= ~lanes;
+}
+
+// Pay for a block in every lane. Returns 0 if any of them can't, the
+// interpreter sorts those out.
+static int ChargeLanes(group_t *g, uint16_t left)
+{
+	if (g->fuel < left)
+		return 0;
+	g->fuel -= left;
+	g->spent += left;
+	return 1;
+}
+
+// Go to ip in every lane in taken and to next in the rest. Whichever
+// side has more lanes stays in the group.
+static void Branch(group_t *g, unsigned taken, size_t ip, size_t next)
+{
+	taken &= g->mask;
+	unsigned other = g->mask & ~taken;
+	
+	if (__builtin_popcount(taken) >= __builtin_popcount(other))
+	{
+		DropToScalar(g, other, next, 0);
+		g->ip = ip;
+	}
+	else
+	{
+		DropToScalar(g, taken, ip, 0);
+		g->ip = next;
+	}
+}
+
+// Lanes in mask make a computed jump and leave the group
+static void DropToScalarIndirect(group_t *g, unsigned lanes, const lanes_t *target)
+{
+	size_t len = g->vms[0]->programLength;
+	for (unsigned l = 0; l < BATCH_LANES; ++l)
+	{
+		if (!(lanes & (1u << l)))
+			continue;
+		size_t to = MIN((uint32_t)(*target)[l], len);
+		DropToScalar(g, 1u << l, to, g->vms[l]->code[to].handler != H_BLOCK);
+	}
+}
+
+// Computed jump to a different target in every lane. The lanes going
+// where the first one goes stay together.
+static void BranchIndirect(group_t *g, const lanes_t *target)
+{
+	size_t len = g->vms[0]->programLength;
+	size_t ip = SIZE_MAX;
+	unsigned same = 0;
+	
+	EACH_LANE(g, l)
+	{
+		size_t to = MIN((uint32_t)(*target)[l], len);
+		if (ip == SIZE_MAX)
+			ip = to;
+		if (to == ip)
+			same |= 1u << l;
+	}
+	
+	DropToScalarIndirect(g, g->mask & ~same, target);
+	
+	const instruction_t *ins = &g->vms[0]->code[ip];
+	if (ins->handler != H_BLOCK && !ChargeLanes(g, ins->left))
+		DropToScalar(g, g->mask, ip, 1);
+	g->ip = ip;
+}
+
+// Whether the batch engine runs this instruction itself. This is
+// checked before the block is charged so the interpreter can take over
+// from exactly here.
+static int Vectorizable(const group_t *g, const instruction_t *ins, uint8_t handler)
+{
+	if (ins->r0 >= NUM_REGS || ins->r1 >= NUM_REGS)
+		return 0;
+	
+	switch(handler)
+	{
+		case H_UNUSED: case H_UNIMPL: case H_PRNT: case H_DMP:
+		case H_UNKNOWN: case H_END:   case H_INT:
+		case H_LOAD8_R:   case H_LOAD8_I:   case H_LOAD16_R:  case H_LOAD16_I:
+		case H_LOAD32_R:  case H_LOAD32_I:  case H_STORE8_R:  case H_STORE8_I:
+		case H_STORE16_R: case H_STORE16_I: case H_STORE32_R: case H_STORE32_I:
+			// Every lane has memory of its own
+			return 0;
+		case H_DIV_RR:
+			// Leave the error message to the interpreter
+		{
+			lanes_t zero = g->regs[ins->r1] == 0;
+			return !(LaneMask(&zero) & g->mask);
+		}
+		case H_DIV_RI:
+			return ins->imm != 0;
+		case H_PUSH_R: case H_PUSH_I: case H_PUSHF: case H_CALL_R: case H_CALL_I:
+		case H_POP: case H_POPF: case H_RET:
+			return g->stackVerified;
+		default:
+			return 1;
+	}
+}
+
+// ALU ops, the arithmetic is done unsigned so it wraps
+#define ALU(name, op, expr) \
+	case H_##name##_RR: case H_##name##_RI: \
+		a = R[ins->r0]; \
+		b = handler == H_##name##_RR ? R[ins->r1] : imm; \
+		R[ins->r0] = (expr); \
+		FLAGS(op, R[ins->r0], a, b); \
+		break;
+
+#define JCC(name, cond) \
+	case H_##name##_I: \
+	{ \
+		lanes_t f, c; \
+		LaneFlags(g, &f); \
+		c = (cond); \
+		Branch(g, LaneMask(&c), MIN((uint32_t)ins->imm, len), g->ip); \
+		break; \
+	} \
+	case H_##name##_R: \
+	{ \
+		lanes_t f, c; \
+		LaneFlags(g, &f); \
+		c = (cond); \
+		unsigned taken = LaneMask(&c) & g->mask; \
+		if (taken == g->mask) \
+			BranchIndirect(g, &R[ins->r0]); \
+		else if (taken) \
+		{ \
+			/* the lanes that don't jump all go to the same place */ \
+			unsigned staying = g->mask & ~taken; \
+			if (__builtin_popcount(staying) > __builtin_popcount(taken)) \
+				DropToScalarIndirect(g, taken, &R[ins->r0]); \
+			else \
+			{ \
+				DropToScalar(g, staying, g->ip, 0); \
+				BranchIndirect(g, &R[ins->r0]); \
+			} \
+		} \
+		break; \
+	}
+
+static void RunGroup(group_t *g)
+{
+	lanes_t *R = g->regs;
+	const instruction_t *code = g->vms[0]->code;
+	size_t len = g->vms[0]->programLength;
+	
+	while (g->mask)
+	{
+		const instruction_t *ins = &code[g->ip];
+		uint8_t handler = g->base[g->ip];
+		uint8_t wrapped = ins->handler == H_BLOCK ? ins->block : ins->handler;
+		
+		if (!Vectorizable(g, ins, handler))
+		{
+			DropToScalar(g, g->mask, g->ip, 0);
+			break;
+		}
+		
+		if (ins->handler == H_BLOCK && !ChargeLanes(g, ins->left))
+		{
+			DropToScalar(g, g->mask, g->ip, 0);
+			break;
+		}
+		
+		if (wrapped == H_SYNCF)
+			MaterializeLaneFlags(g);
+		
+		g->ip++;
+		lanes_t a, b, imm = (lanes_t){ 0 } + ins->imm;
+		
+		switch(handler)
+		{
+			case H_NOP:
+				break;
+			case H_HALT:
+				EACH_LANE(g, l)
+				{
+					StoreLane(g, l, g->ip);
+					g->vms[l]->running = 0;
+					MaterializeFlags(g->vms[l]);
+				}
+				g->mask = 0;
+				break;
+			case H_LOADI: case H_LEA_I:
+				R[ins->r0] = imm;
+				break;
+			case H_LEA_R:
+				R[ins->r0] = (lanes_t)((ulanes_t)R[ins->r1] + (ulanes_t)imm);
+				break;
+			
+			ALU(ADD, LAZY_ADD,   (lanes_t)((ulanes_t)a + (ulanes_t)b))
+			ALU(SUB, LAZY_SUB,   (lanes_t)((ulanes_t)a - (ulanes_t)b))
+			ALU(MUL, LAZY_MUL,   (lanes_t)((ulanes_t)a * (ulanes_t)b))
+			ALU(XOR, LAZY_LOGIC, a ^ b)
+			ALU(OR,  LAZY_LOGIC, a | b)
+			ALU(AND, LAZY_LOGIC, a & b)
+			ALU(SHL, LAZY_LOGIC, (lanes_t)((ulanes_t)a << (ulanes_t)(b & 31)))
+			ALU(SHR, LAZY_LOGIC, a >> (b & 31))
+			ALU(NOT, LAZY_LOGIC, ~b)
+			ALU(MOV, LAZY_LOGIC, b)
+			
+			case H_DIV_RR: case H_DIV_RI:
+			{
+				a = R[ins->r0];
+				b = handler == H_DIV_RR ? R[ins->r1] : imm;
+				// There's no vector divide, and INT_MIN / -1 would trap
+				lanes_t res = a;
+				for (unsigned l = 0; l < BATCH_LANES; ++l)
+					res[l] = b[l] == -1 ? (int32_t)(0u - (uint32_t)a[l]) : b[l] ? a[l] / b[l] : a[l];
+				R[ins->r0] = res;
+				FLAGS(LAZY_LOGIC, res, a, b);
+				break;
+			}
+			
+			case H_INC:
+				a = R[ins->r0];
+				R[ins->r0] = (lanes_t)((ulanes_t)a + 1);
+				FLAGS(LAZY_ADD, R[ins->r0], a, (lanes_t){ 0 } + 1);
+				break;
+			case H_DEC:
+				a = R[ins->r0];
+				R[ins->r0] = (lanes_t)((ulanes_t)a - 1);
+				FLAGS(LAZY_SUB, R[ins->r0], a, (lanes_t){ 0 } + 1);
+				break;
+			case H_CMP_RR: case H_CMP_RI:
+				a = R[ins->r0];
+				b = handler == H_CMP_RR ? R[ins->r1] : imm;
+				FLAGS(LAZY_SUB, (lanes_t)((ulanes_t)a - (ulanes_t)b), a, b);
+				break;
+			
+			// Every lane has its own stack in its vm
+			case H_PUSH_R: case H_PUSH_I: case H_PUSHF: case H_CALL_R: case H_CALL_I:
+			{
+				if (handler == H_PUSHF)
+					MaterializeLaneFlags(g);
+				lanes_t value = handler == H_PUSH_R ? R[ins->r0] :
+				                handler == H_PUSH_I ? imm :
+				                handler == H_PUSHF  ? R[4] : (lanes_t){ 0 } + (int32_t)g->ip;
+				EACH_LANE(g, l)
+				{
+					vm_t *vm = g->vms[l];
+					vm->opstack[R[3][l]++] = value[l];
+					if ((uint32_t)R[3][l] > vm->stackHigh)
+						vm->stackHigh = R[3][l];
+				}
+				if (handler == H_CALL_I)
+					g->ip = MIN((uint32_t)ins->imm, len);
+				else if (handler == H_CALL_R)
+					BranchIndirect(g, &R[ins->r0]);
+				break;
+			}
+			case H_POP: case H_POPF: case H_RET:
+			{
+				lanes_t value = R[3];
+				EACH_LANE(g, l)
+					value[l] = g->vms[l]->opstack[--R[3][l]];
+				if (handler == H_RET)
+					BranchIndirect(g, &value);
+				else if (handler == H_POP)
+					R[ins->r0] = value;
+				else
+				{
+					R[4] = value;
+					g->lazyOp = LAZY_NONE;
+				}
+				break;
+			}
+			
+			case H_JMP_I:
+				g->ip = MIN((uint32_t)ins->imm, len);
+				break;
+			case H_JMP_R:
+				BranchIndirect(g, &R[ins->r0]);
+				break;
+			
+			JCC(JNZ, (f & FLAG_ZERO) == 0)
+			JCC(JZ,  (f & FLAG_ZERO) != 0)
+			JCC(JS,  (f & FLAG_SIGN) != 0)
+			JCC(JNS, (f & FLAG_SIGN) == 0)
+			JCC(JGT, ((f & FLAG_ZERO) == 0) & (((f & FLAG_SIGN) == 0) == ((f & FLAG_OVERFLOW) == 0)))
+			JCC(JLT, ((f & FLAG_SIGN) == 0) != ((f & FLAG_OVERFLOW) == 0))
+			JCC(JPE, (f & FLAG_PARITY) != 0)
+			JCC(JPO, (f & FLAG_PARITY) == 0)
+			
+			default:
+				// Vectorizable() keeps anything else away from here
+				break;
+		}
+	}
+}
+
+// Run a batch of vms which all have the same program loaded, from the
+// start, in lockstep. Anything past BATCH_LANES goes in the next batch.
+void RunBatch(vm_t *const *vms, size_t count)
+{
+	if (!count)
+		return;
+	
+	size_t len = vms[0]->programLength;
+	uint8_t *base = malloc(len + 1);
+	if (!base)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", len + 1, strerror(errno));
+		exit(1);
+	}
+	for (size_t i = 0; i <= len; ++i)
+		base[i] = BaseHandler(&vms[0]->code[i]);
+	
+	for (size_t first = 0; first < count; first += BATCH_LANES)
+	{
+		group_t g;
+		memset(&g, 0, sizeof(g));
+		g.base = base;
+		g.fuel = UINT64_MAX;
+		g.stackVerified = 1;
+		
+		size_t n = MIN(count - first, (size_t)BATCH_LANES);
+		for (size_t l = 0; l < n; ++l)
+		{
+			vm_t *vm = vms[first + l];
+			g.vms[l] = vm;
+			g.fuel = MIN(g.fuel, vm->fuel);
+			g.stackVerified &= StackVerified(vm);
+			MaterializeFlags(vm);
+			for (int r = 0; r < NUM_REGS; ++r)
+				g.regs[r][l] = vm->regs[r];
+			g.mask |= 1u << l;
+		}
+		// Unused lanes just shadow the first one so nothing in them
+		// can trap.
+		for (size_t l = n; l < BATCH_LANES; ++l)
+		{
+			g.vms[l] = g.vms[0];
+			for (int r = 0; r < NUM_REGS; ++r)
+				g.regs[r][l] = g.regs[r][0];
+		}
+		g.ip = MIN(g.vms[0]->ip, g.vms[0]->programLength);
+		
+		RunGroup(&g);
+	}
+	
+	free(base);
+}
+
+#else
+
+// Without vector extensions (or when tracing) every vm just runs on its own
+void RunBatch(vm_t *const *vms, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		RunVM(vms[i]);
+}
+
+#endif
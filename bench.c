@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Benchmark suite. Builds a small corpus of guest workloads in memory,
+// runs each of them for a fixed number of instructions with warmup runs
+// and repetitions and writes the results out as JSON so two builds can
+// be compared (make bench, see the Makefile).
+//
+// Every workload is an endless loop stopped by running out of fuel, so
+// every run of a benchmark retires exactly the same instructions no
+// matter which build or dispatch method runs it.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+// Longest program any of the benchmarks build
+#define MAX_PROGRAM 256
+
+typedef struct
+{
+	program_t words[MAX_PROGRAM];
+	size_t len;
+} builder_t;
+
+typedef struct
+{
+	const char *name;
+	const char *kind;
+	void (*build)(builder_t *b);
+} benchmark_t;
+
+typedef struct
+{
+	uint64_t fuel;
+	unsigned reps;
+	unsigned warmup;
+	size_t threads;
+	size_t vms;
+	int useJIT;
+	const char *filter;
+} options_t;
+
+static uint64_t Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int CompareTimes(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Encode an instruction the same way the assembler does
+static void Emit(builder_t *b, int opcode, int type, int r0, int r1, int imm)
+{
+	if (b->len == MAX_PROGRAM)
+	{
+		fprintf(stderr, "benchmark program is longer than %d instructions\n", MAX_PROGRAM);
+		exit(1);
+	}
+	EncodeInstruction(&b->words[b->len], opcode, type, r0, r1, imm);
+	b->len++;
+}
+
+#define RR(b, op, r0, r1) Emit(b, OP_##op, OP_FLAG_REGISTER, r0, r1, 0)
+#define RI(b, op, r0, imm) Emit(b, OP_##op, OP_FLAG_IMMEDIATE, r0, 0, imm)
+#define I(b, op, imm) Emit(b, OP_##op, OP_FLAG_IMMEDIATE, 0, 0, imm)
+#define R(b, op, r0) Emit(b, OP_##op, OP_FLAG_REGISTER, r0, 0, 0)
+
+//
+// Guest workloads
+//
+
+// Straight line arithmetic
+static void BuildArith(builder_t *b)
+{
+	RI(b, LOADI, 1, 3);
+	RR(b, ADD, 0, 1);
+	RR(b, MUL, 0, 1);
+	RR(b, XOR, 2, 0);
+	RI(b, SHL, 2, 1);
+	RR(b, SUB, 1, 2);
+	RI(b, AND, 1, 127);
+	R(b, INC, 1);
+	I(b, JMP, 1);
+}
+
+// Recursion 16 calls deep, over and over
+static void BuildCalls(builder_t *b)
+{
+	RI(b, LOADI, 1, 16); // 0
+	I(b, CALL, 3);       // 1
+	I(b, JMP, 0);        // 2
+	R(b, DEC, 1);        // 3: count down to the bottom
+	I(b, JZ, 7);         // 4
+	I(b, CALL, 3);       // 5
+	R(b, INC, 0);        // 6
+	R(b, RET, 0);        // 7
+}
+
+// Branches on a bit of a pseudo random number
+static void BuildBranchy(builder_t *b)
+{
+	RI(b, MUL, 0, 75);   // 0
+	RI(b, ADD, 0, 74);   // 1
+	RR(b, MOV, 1, 0);    // 2
+	RI(b, SHR, 1, 9);    // 3
+	RI(b, AND, 1, 1);    // 4
+	I(b, JZ, 8);         // 5
+	R(b, INC, 2);        // 6
+	I(b, JMP, 0);        // 7
+	R(b, DEC, 2);        // 8
+	I(b, JMP, 0);        // 9
+}
+
+// Pushes and pops, the verifier can bound this one
+static void BuildStack(builder_t *b)
+{
+	R(b, PUSH, 0);
+	I(b, PUSH, 5);
+	R(b, PUSHF, 0);
+	R(b, POPF, 0);
+	R(b, POP, 1);
+	R(b, POP, 2);
+	RR(b, ADD, 0, 1);
+	I(b, JMP, 0);
+}
+
+//
+// Per-opcode dispatch microbenchmarks: a block of the same instruction
+// over and over with a jump back to the start at the end.
+//
+
+#define REPEAT 128
+
+#define OPCODE_BENCH(name, ...) \
+	static void Build_##name(builder_t *b) \
+	{ \
+		for (int i = 0; i < REPEAT; ++i) \
+		{ __VA_ARGS__; } \
+		I(b, JMP, 0); \
+	}
+
+OPCODE_BENCH(nop,    R(b, NOP, 0))
+OPCODE_BENCH(loadi,  RI(b, LOADI, 0, i))
+OPCODE_BENCH(add_rr, RR(b, ADD, 0, 1))
+OPCODE_BENCH(add_ri, RI(b, ADD, 0, 1))
+OPCODE_BENCH(mul_rr, RR(b, MUL, 0, 1))
+OPCODE_BENCH(div_ri, RI(b, DIV, 0, 3))
+OPCODE_BENCH(xor_rr, RR(b, XOR, 0, 1))
+OPCODE_BENCH(shl_ri, RI(b, SHL, 0, 1))
+OPCODE_BENCH(mov_rr, RR(b, MOV, 0, 1))
+OPCODE_BENCH(cmp_rr, RR(b, CMP, 0, 1))
+OPCODE_BENCH(inc,    R(b, INC, 0))
+OPCODE_BENCH(push_pop, if (i & 1) R(b, POP, 1); else R(b, PUSH, 0))
+OPCODE_BENCH(pushf_popf, if (i & 1) R(b, POPF, 0); else R(b, PUSHF, 0))
+OPCODE_BENCH(jmp,    I(b, JMP, i + 1))
+OPCODE_BENCH(jnz,    if (i == 0) RI(b, CMP, 0, 1); else I(b, JNZ, i + 1))
+OPCODE_BENCH(cmp_jnz, if (i & 1) I(b, JNZ, i + 1); else RI(b, CMP, 0, 1))
+OPCODE_BENCH(call_ret, if (i == REPEAT - 2) I(b, JMP, 0); else if (i == REPEAT - 1) R(b, RET, 0); else I(b, CALL, REPEAT - 1))
+
+static const benchmark_t Benchmarks[] = {
+	{ "arith",      "workload", BuildArith },
+	{ "calls",      "workload", BuildCalls },
+	{ "branchy",    "workload", BuildBranchy },
+	{ "stack",      "workload", BuildStack },
+#define OPCODE(name) { #name, "opcode", Build_##name },
+	OPCODE(nop) OPCODE(loadi) OPCODE(add_rr) OPCODE(add_ri) OPCODE(mul_rr)
+	OPCODE(div_ri) OPCODE(xor_rr) OPCODE(shl_ri) OPCODE(mov_rr) OPCODE(cmp_rr)
+	OPCODE(inc) OPCODE(push_pop) OPCODE(pushf_popf) OPCODE(jmp) OPCODE(jnz)
+	OPCODE(cmp_jnz) OPCODE(call_ret)
+#undef OPCODE
+};
+
+// A fresh vm with the benchmark's program loaded
+static vm_t *LoadBenchmark(const benchmark_t *bench, const options_t *opt, uint64_t fuel)
+{
+	builder_t b;
+	b.len = 0;
+	bench->build(&b);
+	
+	vm_t *vm = AllocateVM();
+	vm->name = bench->name;
+	vm->nameLen = strlen(bench->name);
+	vm->running = 1;
+	vm->fuel = fuel;
+	if (CompileVM(vm, (const char*)b.words, b.len * sizeof(program_t)) != 0)
+	{
+		fprintf(stderr, "benchmark %s doesn't verify\n", bench->name);
+		exit(1);
+	}
+	if (opt->useJIT && !(vm->jit = CompileJIT(vm)))
+		fprintf(stderr, "Couldn't JIT \"%s\", it will be interpreted\n", bench->name);
+	return vm;
+}
+
+static int Selected(const options_t *opt, const char *name)
+{
+	return !opt->filter || strstr(name, opt->filter);
+}
+
+static void WriteTimes(FILE *out, const uint64_t *times, unsigned n)
+{
+	fprintf(out, "[");
+	for (unsigned i = 0; i < n; ++i)
+		fprintf(out, "%s%" PRIu64, i ? ", " : "", times[i]);
+	fprintf(out, "]");
+}
+
+// Median of the repetitions, sorting them on the way
+static uint64_t Median(uint64_t *times, unsigned n)
+{
+	qsort(times, n, sizeof(*times), CompareTimes);
+	return n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+}
+
+static void RunBenchmark(FILE *out, const benchmark_t *bench, const options_t *opt, int first)
+{
+	uint64_t *times = calloc(opt->reps, sizeof(uint64_t));
+	uint64_t retired = 0;
+	
+	for (unsigned rep = 0; rep < opt->warmup + opt->reps; ++rep)
+	{
+		vm_t *vm = LoadBenchmark(bench, opt, opt->fuel);
+		uint64_t start = Now();
+		RunVM(vm);
+		uint64_t elapsed = Now() - start;
+		retired = vm->retired;
+		DeallocateVM(vm);
+		
+		if (rep >= opt->warmup)
+			times[rep - opt->warmup] = elapsed;
+	}
+	
+	uint64_t median = Median(times, opt->reps);
+	fprintf(out, "%s\n\t\t{ \"name\": \"%s\", \"kind\": \"%s\", \"instructions\": %" PRIu64 ", ",
+		first ? "" : ",", bench->name, bench->kind, retired);
+	fprintf(out, "\"ns\": ");
+	WriteTimes(out, times, opt->reps);
+	fprintf(out, ", \"median_ns\": %" PRIu64 ", \"min_ns\": %" PRIu64 ", ", median, times[0]);
+	fprintf(out, "\"ns_per_instruction\": %.3f, \"instructions_per_second\": %.0f }",
+		retired ? (double)median / retired : 0.0, median ? retired * 1e9 / median : 0.0);
+	fflush(out);
+	
+	fprintf(stderr, "%-12s %8.3f ns/instruction\n", bench->name, retired ? (double)median / retired : 0.0);
+	free(times);
+}
+
+// Creating, loading and throwing away a vm
+static void RunLifecycle(FILE *out, const options_t *opt, int first)
+{
+	const unsigned count = 10000;
+	uint64_t *times = calloc(opt->reps, sizeof(uint64_t));
+	
+	for (unsigned rep = 0; rep < opt->warmup + opt->reps; ++rep)
+	{
+		uint64_t start = Now();
+		for (unsigned i = 0; i < count; ++i)
+			DeallocateVM(LoadBenchmark(&Benchmarks[0], opt, 0));
+		uint64_t elapsed = Now() - start;
+		
+		if (rep >= opt->warmup)
+			times[rep - opt->warmup] = elapsed;
+	}
+	
+	uint64_t median = Median(times, opt->reps);
+	fprintf(out, "%s\n\t\t{ \"name\": \"vm_lifecycle\", \"kind\": \"lifecycle\", \"vms\": %u, \"ns\": ",
+		first ? "" : ",", count);
+	WriteTimes(out, times, opt->reps);
+	fprintf(out, ", \"median_ns\": %" PRIu64 ", \"min_ns\": %" PRIu64 ", \"ns_per_vm\": %.1f }",
+		median, times[0], (double)median / count);
+	
+	fprintf(stderr, "%-12s %8.1f ns/vm\n", "vm_lifecycle", (double)median / count);
+	free(times);
+}
+
+// Forking a vm with half of its stack in use and throwing the child
+// away again, which shouldn't depend on how much stack there is.
+static void RunFork(FILE *out, const options_t *opt, int first)
+{
+	const unsigned count = 1000;
+	uint64_t *times = calloc(opt->reps, sizeof(uint64_t));
+	
+	vm_t *parent = LoadBenchmark(&Benchmarks[0], opt, 0);
+	for (unsigned i = 0; i < MAX_STACK / 2; ++i)
+		parent->opstack[i] = i;
+	parent->regs[3] = MAX_STACK / 2;
+	parent->stackHigh = MAX_STACK / 2;
+	
+	for (unsigned rep = 0; rep < opt->warmup + opt->reps; ++rep)
+	{
+		uint64_t start = Now();
+		for (unsigned i = 0; i < count; ++i)
+			DeallocateVM(ForkVM(parent));
+		uint64_t elapsed = Now() - start;
+		
+		if (rep >= opt->warmup)
+			times[rep - opt->warmup] = elapsed;
+	}
+	DeallocateVM(parent);
+	
+	uint64_t median = Median(times, opt->reps);
+	fprintf(out, "%s\n\t\t{ \"name\": \"vm_fork\", \"kind\": \"lifecycle\", \"vms\": %u, \"ns\": ",
+		first ? "" : ",", count);
+	WriteTimes(out, times, opt->reps);
+	fprintf(out, ", \"median_ns\": %" PRIu64 ", \"min_ns\": %" PRIu64 ", \"ns_per_vm\": %.1f }",
+		median, times[0], (double)median / count);
+	
+	fprintf(stderr, "%-12s %8.1f ns/vm\n", "vm_fork", (double)median / count);
+	free(times);
+}
+
+// The same number of vms all running arith on more and more threads
+static void RunScaling(FILE *out, const options_t *opt)
+{
+	uint64_t fuel = opt->fuel / 4;
+	uint64_t *times = calloc(opt->reps, sizeof(uint64_t));
+	vm_t **vms = calloc(opt->vms, sizeof(*vms));
+	int first = 1;
+	
+	fprintf(out, ",\n\t\"scaling\": [");
+	for (size_t threads = 1;; threads = MIN(threads * 2, opt->threads))
+	{
+		// Fuel is charged a block at a time so what actually retired
+		// is a little less than the fuel handed out
+		uint64_t instructions = 0;
+		for (unsigned rep = 0; rep < opt->warmup + opt->reps; ++rep)
+		{
+			struct scheduler_s *sched = CreateScheduler(threads, 10000);
+			for (size_t i = 0; i < opt->vms; ++i)
+			{
+				vms[i] = LoadBenchmark(&Benchmarks[0], opt, fuel);
+				// Keep it around after it's retired to count what it ran
+				LookupVM(RegisterVM(vms[i]));
+				Schedule(sched, vms[i]);
+			}
+			
+			uint64_t start = Now();
+			RunScheduler(sched);
+			uint64_t elapsed = Now() - start;
+			DestroyScheduler(sched);
+			
+			instructions = 0;
+			for (size_t i = 0; i < opt->vms; ++i)
+			{
+				instructions += vms[i]->retired;
+				ReleaseVM(vms[i]->handle);
+			}
+			
+			if (rep >= opt->warmup)
+				times[rep - opt->warmup] = elapsed;
+		}
+		
+		uint64_t median = Median(times, opt->reps);
+		fprintf(out, "%s\n\t\t{ \"threads\": %zu, \"vms\": %zu, \"instructions\": %" PRIu64 ", \"ns\": ",
+			first ? "" : ",", threads, opt->vms, instructions);
+		WriteTimes(out, times, opt->reps);
+		fprintf(out, ", \"median_ns\": %" PRIu64 ", \"instructions_per_second\": %.0f }",
+			median, median ? instructions * 1e9 / median : 0.0);
+		first = 0;
+		
+		fprintf(stderr, "%2zu threads   %8.0f Minstructions/s\n", threads,
+			median ? instructions * 1e3 / median : 0.0);
+		
+		if (threads == opt->threads)
+			break;
+	}
+	fprintf(out, "\n\t]");
+	free(vms);
+	free(times);
+}
+
+static void WriteBuild(FILE *out, const options_t *opt)
+{
+	fprintf(out, "\t\"build\": { ");
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+	fprintf(out, "\"dispatch\": \"computed-goto\", ");
+#else
+	fprintf(out, "\"dispatch\": \"switch\", ");
+#endif
+#ifdef __VERSION__
+	fprintf(out, "\"compiler\": \"%s\", ", __VERSION__);
+#endif
+#ifdef VM_TRACE
+	fprintf(out, "\"trace\": true, ");
+#endif
+#ifdef VM_PAIR_PROFILE
+	fprintf(out, "\"pair_profile\": true, ");
+#endif
+	fprintf(out, "\"jit\": %s },\n", opt->useJIT ? "true" : "false");
+	fprintf(out, "\t\"config\": { \"fuel\": %" PRIu64 ", \"reps\": %u, \"warmup\": %u, \"threads\": %zu, \"vms\": %zu },\n",
+		opt->fuel, opt->reps, opt->warmup, opt->threads, opt->vms);
+}
+
+int main(int argc, char **argv)
+{
+	options_t opt = { 20000000, 5, 1, 0, 0, 0, NULL };
+	// The scheduler and vms print to stdout so the results go to a file
+	const char *output = "bench.json";
+	
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strncasecmp(argv[i], "--fuel=", 7))
+			opt.fuel = strtoull(argv[i] + 7, NULL, 0);
+		else if (!strncasecmp(argv[i], "--reps=", 7))
+			opt.reps = strtoul(argv[i] + 7, NULL, 0);
+		else if (!strncasecmp(argv[i], "--warmup=", 9))
+			opt.warmup = strtoul(argv[i] + 9, NULL, 0);
+		else if (!strncasecmp(argv[i], "--threads=", 10))
+			opt.threads = strtoul(argv[i] + 10, NULL, 0);
+		else if (!strncasecmp(argv[i], "--vms=", 6))
+			opt.vms = strtoul(argv[i] + 6, NULL, 0);
+		else if (!strcasecmp(argv[i], "--jit"))
+			opt.useJIT = 1;
+		else if (!strncasecmp(argv[i], "--filter=", 9))
+			opt.filter = argv[i] + 9;
+		else if (!strncasecmp(argv[i], "--output=", 9))
+			output = argv[i] + 9;
+		else
+		{
+			fprintf(stderr, "USAGE: %s [options]\n\n", argv[0]);
+			fprintf(stderr, "OPTIONS:\n");
+			fprintf(stderr, "--fuel=N           Instructions each benchmark runs for (default: 20000000)\n");
+			fprintf(stderr, "--reps=N           Timed repetitions of each benchmark (default: 5)\n");
+			fprintf(stderr, "--warmup=N         Untimed runs before those (default: 1)\n");
+			fprintf(stderr, "--threads=N        Most worker threads to scale up to (default: one per core)\n");
+			fprintf(stderr, "--vms=N            vms running at once when scaling (default: twice the threads)\n");
+			fprintf(stderr, "--jit              Run the guest workloads with the JIT\n");
+			fprintf(stderr, "--filter=NAME      Only run benchmarks with NAME in their name\n");
+			fprintf(stderr, "--output=FILE      Write the JSON results to FILE (default: bench.json)\n");
+			return 1;
+		}
+	}
+	
+	if (!opt.reps)
+		opt.reps = 1;
+	if (!opt.threads)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		opt.threads = cores > 0 ? (size_t)cores : 1;
+	}
+	if (!opt.vms)
+		opt.vms = opt.threads * 2;
+	
+	FILE *out = fopen(output, "w");
+	if (!out)
+	{
+		fprintf(stderr, "Failed to open %s: %s\n", output, strerror(errno));
+		return 1;
+	}
+	
+	fprintf(out, "{\n");
+	WriteBuild(out, &opt);
+	fprintf(out, "\t\"benchmarks\": [");
+	
+	int first = 1;
+	for (size_t i = 0; i < sizeof(Benchmarks) / sizeof(*Benchmarks); ++i)
+	{
+		if (!Selected(&opt, Benchmarks[i].name))
+			continue;
+		RunBenchmark(out, &Benchmarks[i], &opt, first);
+		first = 0;
+	}
+	if (Selected(&opt, "vm_lifecycle"))
+	{
+		RunLifecycle(out, &opt, first);
+		first = 0;
+	}
+	if (Selected(&opt, "vm_fork"))
+	{
+		RunFork(out, &opt, first);
+		first = 0;
+	}
+	fprintf(out, "\n\t]");
+	
+	if (Selected(&opt, "scaling"))
+		RunScaling(out, &opt);
+	fprintf(out, "\n}\n");
+	
+	fclose(out);
+	fprintf(stderr, "Results written to %s\n", output);
+	return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// The decoded programs. Every vm running the same program (same bytes,
+// same entry point) shares one read-only copy of its decoded code, so
+// loading a program a thousand times decodes and verifies it once and
+// all the cores running it share the same cache lines. Only registers,
+// ip and stack belong to each vm.
+//
+// Programs are found by a hash of their bytes and then compared in
+// full, so two programs with the same hash just don't get shared. Each
+// one is reference counted by the vms using it. Once the last of them
+// is deallocated it's kept around in case the program is loaded again,
+// only the CACHE_IDLE most recently used of those are kept.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+// Must be a power of two
+#define CACHE_BUCKETS 256
+// Programs kept decoded while no vm is running them
+#define CACHE_IDLE 64
+
+typedef struct cached_code_s
+{
+	code_t code;
+	// vms using it
+	size_t refs;
+	
+	uint64_t hash;
+	// The program_t words the code was decoded from
+	void *program;
+	size_t programSize;
+	// Where the code is mapped
+	size_t mapSize;
+	// The same without the optimizer, only decoded once something
+	// needs it (see PlainCode())
+	instruction_t *plain;
+	
+	struct cached_code_s *next;
+	// On the idle list while refs is 0
+	struct cached_code_s *idlePrev, *idleNext;
+} cached_code_t;
+
+static mtx_t cacheLock;
+static once_flag cacheOnce = ONCE_FLAG_INIT;
+static cached_code_t *buckets[CACHE_BUCKETS];
+// Least recently used first
+static cached_code_t *idleHead, *idleTail;
+static size_t idle;
+
+static _Atomic uint64_t decoded, shared;
+
+static void InitCache(void)
+{
+	mtx_init(&cacheLock, mtx_plain);
+}
+
+static void *Allocate(size_t size)
+{
+	void *ptr = malloc(size);
+	if (!ptr)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", size, strerror(errno));
+		exit(1);
+	}
+	return ptr;
+}
+
+// FNV-1a, 64 bit
+static uint64_t Hash(const void *ptr, size_t len, size_t entry)
+{
+	const unsigned char *data = ptr;
+	uint64_t hash = UINT64_C(14695981039346656037) ^ entry;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ data[i]) * UINT64_C(1099511628211);
+	return hash;
+}
+
+// Call with cacheLock held
+static cached_code_t *Find(uint64_t hash, const void *program, size_t size, size_t entry)
+{
+	for (cached_code_t *c = buckets[hash & (CACHE_BUCKETS - 1)]; c; c = c->next)
+	{
+		if (c->hash == hash && c->code.entry == entry && c->programSize == size &&
+		    !memcmp(c->program, program, size))
+			return c;
+	}
+	return NULL;
+}
+
+static void Free(cached_code_t *c)
+{
+	munmap((void*)c->code.code, c->mapSize);
+	if (c->plain)
+		munmap(c->plain, c->mapSize);
+	free(c->program);
+	free(c);
+}
+
+// Call with cacheLock held
+static void Unidle(cached_code_t *c)
+{
+	if (c->idlePrev)
+		c->idlePrev->idleNext = c->idleNext;
+	else
+		idleHead = c->idleNext;
+	if (c->idleNext)
+		c->idleNext->idlePrev = c->idlePrev;
+	else
+		idleTail = c->idlePrev;
+	c->idlePrev = c->idleNext = NULL;
+	idle--;
+}
+
+// Call with cacheLock held
+static void Unlink(cached_code_t *c)
+{
+	cached_code_t **link = &buckets[c->hash & (CACHE_BUCKETS - 1)];
+	while (*link != c)
+		link = &(*link)->next;
+	*link = c->next;
+}
+
+// Another vm is using it, call with cacheLock held
+static const code_t *Reference(cached_code_t *c)
+{
+	if (!c->refs++)
+		Unidle(c);
+	atomic_fetch_add(&shared, 1);
+	return &c->code;
+}
+
+static instruction_t *MapCode(size_t size)
+{
+	instruction_t *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+	{
+		fprintf(stderr, "failed mapping %zu bytes: %s\n", size, strerror(errno));
+		exit(1);
+	}
+	return code;
+}
+
+// Decode a program nobody has loaded yet into a mapping of its own
+// which is made read-only once it's done.
+static cached_code_t *Decode(const char *name, const char *data, size_t instructions, size_t entry)
+{
+	cached_code_t *c = Allocate(sizeof(cached_code_t));
+	memset(c, 0, sizeof(*c));
+	c->code.length = instructions;
+	c->code.entry = entry;
+	c->programSize = instructions * sizeof(program_t);
+	
+	// The extra slot is the END sentinel
+	c->mapSize = (instructions + 1) * sizeof(instruction_t);
+	instruction_t *code = MapCode(c->mapSize);
+	
+	if (DecodeProgram(name, data, instructions, entry, code, &c->code.maxDepth, 1) != 0)
+	{
+		munmap(code, c->mapSize);
+		free(c);
+		return NULL;
+	}
+	
+	c->code.memory = UsesMemory(code, instructions);
+	
+	// Nothing gets to change it from here on
+	mprotect(code, c->mapSize, PROT_READ);
+	c->code.code = code;
+	
+	c->program = Allocate(c->programSize ? c->programSize : 1);
+	memcpy(c->program, data, c->programSize);
+	atomic_fetch_add(&decoded, 1);
+	return c;
+}
+
+// Get the decoded code for a program, decoding it if no other vm is
+// running it already. NULL if it doesn't pass the verifier.
+const code_t *AcquireCode(const char *name, const char *data, size_t len, size_t entry)
+{
+	call_once(&cacheOnce, InitCache);
+	
+	size_t instructions = len / sizeof(program_t);
+	size_t size = instructions * sizeof(program_t);
+	uint64_t hash = Hash(data, size, entry);
+	
+	mtx_lock(&cacheLock);
+	cached_code_t *c = Find(hash, data, size, entry);
+	if (c)
+	{
+		const code_t *code = Reference(c);
+		mtx_unlock(&cacheLock);
+		return code;
+	}
+	mtx_unlock(&cacheLock);
+	
+	// Decode without holding up everyone else loading something
+	cached_code_t *fresh = Decode(name, data, instructions, entry);
+	if (!fresh)
+		return NULL;
+	fresh->hash = hash;
+	fresh->code.hash = hash;
+	
+	// Someone else may have beaten us to it in the meantime
+	mtx_lock(&cacheLock);
+	if ((c = Find(hash, data, size, entry)))
+	{
+		const code_t *code = Reference(c);
+		mtx_unlock(&cacheLock);
+		Free(fresh);
+		return code;
+	}
+	
+	fresh->refs = 1;
+	cached_code_t **bucket = &buckets[hash & (CACHE_BUCKETS - 1)];
+	fresh->next = *bucket;
+	*bucket = fresh;
+	mtx_unlock(&cacheLock);
+	return &fresh->code;
+}
+
+// Another vm is using code someone already has, see ForkVM()
+const code_t *RetainCode(const code_t *code)
+{
+	mtx_lock(&cacheLock);
+	Reference((cached_code_t*)code);
+	mtx_unlock(&cacheLock);
+	return code;
+}
+
+// The program decoded without the optimizer, for vms the host has
+// changed part way through (see DeoptimizeVM()). It's decoded the
+// first time a vm running the program needs it.
+const instruction_t *PlainCode(const code_t *code)
+{
+	// code is the first member
+	cached_code_t *c = (cached_code_t*)code;
+	
+	mtx_lock(&cacheLock);
+	if (!c->plain)
+	{
+		size_t maxDepth;
+		instruction_t *plain = MapCode(c->mapSize);
+		// It passed the verifier the first time around
+		DecodeProgram("", c->program, code->length, code->entry, plain, &maxDepth, 0);
+		mprotect(plain, c->mapSize, PROT_READ);
+		c->plain = plain;
+	}
+	mtx_unlock(&cacheLock);
+	return c->plain;
+}
+
+// A vm is done with the code. Once nothing uses it it goes on the idle
+// list, pushing the least recently used program off it if that's full.
+void ReleaseCode(const code_t *code)
+{
+	if (!code)
+		return;
+	
+	// code is the first member
+	cached_code_t *c = (cached_code_t*)code;
+	cached_code_t *evict = NULL;
+	
+	mtx_lock(&cacheLock);
+	if (!--c->refs)
+	{
+		c->idlePrev = idleTail;
+		if (idleTail)
+			idleTail->idleNext = c;
+		else
+			idleHead = c;
+		idleTail = c;
+		
+		if (++idle > CACHE_IDLE)
+		{
+			evict = idleHead;
+			Unidle(evict);
+			Unlink(evict);
+		}
+	}
+	mtx_unlock(&cacheLock);
+	
+	if (evict)
+		Free(evict);
+}
+
+void GetCodeStats(alloc_stats_t *out)
+{
+	out->programsDecoded = atomic_load(&decoded);
+	out->programsShared = atomic_load(&shared);
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Forking vms. The child gets its own copy of the parent's registers,
+// stack and linear memory, but the pages are shared copy on write so a
+// fork costs about the same however big they are and each child only
+// uses memory for the pages it changes.
+//
+// The shared pages live in layers: memfds which are written once, when
+// they're made, and then only ever mapped MAP_PRIVATE. Each page of a
+// forked region remembers which layer it's mapped from (NULL for plain
+// anonymous memory). Forking looks up which pages the parent has
+// written since it was last forked in /proc/self/pagemap, a private
+// file mapping turns into an anonymous page when it's written to, and
+// puts just those into a new layer. The parent and the child then both
+// map every page from its layer. Forking the same vm over and over
+// without it changing anything makes no new layers at all.
+//
+// Without pagemap every page counts as written. Without memfds (or on
+// hosts without guard pages, where linear memory is an ordinary
+// allocation) the child just gets a copy.
+
+#ifdef __linux__
+// memfd_create()
+# define _GNU_SOURCE
+#endif
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef struct layer_s
+{
+	int fd;
+	// Where page 0 of the region is in the file
+	uint64_t offset;
+	// One for every page mapped from it anywhere
+	_Atomic size_t refs;
+} layer_t;
+
+// Which layer each page of a region is mapped from
+typedef struct pages_s
+{
+	size_t count;
+	layer_t *layers[];
+} pages_t;
+
+#define PAGEMAP_PRESENT (UINT64_C(1) << 63)
+#define PAGEMAP_SWAPPED (UINT64_C(1) << 62)
+#define PAGEMAP_FILE    (UINT64_C(1) << 61)
+
+static size_t pageSize;
+static int pagemap = -1;
+static once_flag forkOnce = ONCE_FLAG_INIT;
+
+static void InitFork(void)
+{
+	pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#ifdef __linux__
+	pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+static void *Allocate(size_t size)
+{
+	void *ptr = calloc(1, size);
+	if (!ptr)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", size, strerror(errno));
+		exit(1);
+	}
+	return ptr;
+}
+
+static void Unref(layer_t *layer, size_t pages)
+{
+	if (layer && atomic_fetch_sub(&layer->refs, pages) == pages)
+	{
+		close(layer->fd);
+		free(layer);
+	}
+}
+
+// The region isn't shared any more, whatever is mapped there now is
+// up to the caller.
+void ReleasePages(struct pages_s **pages)
+{
+	if (!*pages)
+		return;
+	for (size_t i = 0; i < (*pages)->count; ++i)
+		Unref((*pages)->layers[i], 1);
+	free(*pages);
+	*pages = NULL;
+}
+
+static pages_t *NewPages(size_t count)
+{
+	pages_t *pages = Allocate(sizeof(pages_t) + count * sizeof(layer_t*));
+	pages->count = count;
+	return pages;
+}
+
+// Map count pages of the region at addr from the layer, anonymous
+// zeroes if there isn't one.
+static int MapRun(uint8_t *addr, size_t first, size_t count, const layer_t *layer)
+{
+	void *at = addr + first * pageSize;
+	size_t len = count * pageSize;
+	void *ret = layer ?
+		mmap(at, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, layer->fd, (off_t)(layer->offset + first * pageSize)) :
+		mmap(at, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	return ret == MAP_FAILED ? -1 : 0;
+}
+
+// Map the whole region the way pages says, a run of pages from the
+// same layer at a time.
+static int MapPages(uint8_t *addr, const pages_t *pages)
+{
+	for (size_t i = 0, j; i < pages->count; i = j)
+	{
+		for (j = i + 1; j < pages->count && pages->layers[j] == pages->layers[i]; ++j)
+			;
+		if (MapRun(addr, i, j - i, pages->layers[i]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Whether each page of the region has been written since it was mapped
+// from its layer. Anything we can't tell about counts as written.
+static void FindDirty(const uint8_t *addr, const pages_t *pages, uint8_t *dirty)
+{
+	memset(dirty, 1, pages->count);
+	
+	uint64_t entries[512];
+	for (size_t i = 0; pagemap >= 0 && i < pages->count; i += 512)
+	{
+		size_t n = MIN(pages->count - i, (size_t)512);
+		off_t at = (off_t)(((uintptr_t)addr / pageSize + i) * sizeof(uint64_t));
+		if (pread(pagemap, entries, n * sizeof(uint64_t), at) != (ssize_t)(n * sizeof(uint64_t)))
+			return;
+		
+		for (size_t j = 0; j < n; ++j)
+		{
+			uint64_t e = entries[j];
+			if (pages->layers[i + j])
+				// Still the file page, or never touched at all
+				dirty[i + j] = (e & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) && !(e & PAGEMAP_FILE);
+			else
+				// Anonymous memory only has something in it once touched
+				dirty[i + j] = !!(e & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED));
+		}
+	}
+}
+
+// Share the parent's region at from with the child's at to, both size
+// bytes and page aligned. Returns -1 if it couldn't be shared, the
+// caller copies it instead.
+static int ForkPages(uint8_t *from, pages_t **fromPages, uint8_t *to, pages_t **toPages, size_t size)
+{
+#ifdef __linux__
+	if (size % pageSize)
+		return -1;
+	size_t count = size / pageSize;
+	if (!*fromPages)
+		*fromPages = NewPages(count);
+	pages_t *pages = *fromPages;
+	
+	uint8_t *dirty = Allocate(count);
+	FindDirty(from, pages, dirty);
+	
+	size_t written = 0;
+	for (size_t i = 0; i < count; ++i)
+		written += dirty[i];
+	
+	// Whatever the parent changed goes in a new layer
+	if (written)
+	{
+		int fd = memfd_create("playvm", MFD_CLOEXEC);
+		if (fd < 0 || ftruncate(fd, (off_t)size) != 0)
+		{
+			if (fd >= 0)
+				close(fd);
+			free(dirty);
+			return -1;
+		}
+		
+		layer_t *layer = Allocate(sizeof(layer_t));
+		layer->fd = fd;
+		atomic_init(&layer->refs, 0);
+		
+		for (size_t i = 0, j; i < count; i = j)
+		{
+			for (j = i + 1; j < count && dirty[j] == dirty[i]; ++j)
+				;
+			if (!dirty[i])
+				continue;
+			
+			size_t len = (j - i) * pageSize;
+			if (pwrite(fd, from + i * pageSize, len, (off_t)(i * pageSize)) != (ssize_t)len ||
+			    MapRun(from, i, j - i, layer) != 0)
+			{
+				// The pages mapped so far already point at it
+				fprintf(stderr, "failed sharing vm memory: %s\n", strerror(errno));
+				exit(1);
+			}
+			
+			atomic_fetch_add(&layer->refs, j - i);
+			for (size_t k = i; k < j; ++k)
+			{
+				Unref(pages->layers[k], 1);
+				pages->layers[k] = layer;
+			}
+		}
+	}
+	free(dirty);
+	
+	// The child maps all of the same pages
+	pages_t *child = NewPages(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if ((child->layers[i] = pages->layers[i]))
+			atomic_fetch_add(&child->layers[i]->refs, 1);
+	}
+	ReleasePages(toPages);
+	*toPages = child;
+	if (MapPages(to, child) != 0)
+	{
+		fprintf(stderr, "failed sharing vm memory: %s\n", strerror(errno));
+		exit(1);
+	}
+	return 0;
+#else
+	(void)from; (void)fromPages; (void)to; (void)toPages; (void)size;
+	return -1;
+#endif
+}
+
+// Map the vm's linear memory copy on write from fd at offset. The file
+// becomes a layer, so forks of the vm share it as well. snapshot.c
+// restores memory with this.
+int ShareFileMemory(vm_t *vm, int fd, uint64_t offset)
+{
+	call_once(&forkOnce, InitFork);
+	
+	size_t count = vm->memorySize / pageSize;
+	if (!count)
+		return 0;
+	
+	layer_t *layer = Allocate(sizeof(layer_t));
+	if ((layer->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+	{
+		free(layer);
+		return -1;
+	}
+	layer->offset = offset;
+	atomic_init(&layer->refs, count);
+	
+	pages_t *pages = NewPages(count);
+	for (size_t i = 0; i < count; ++i)
+		pages->layers[i] = layer;
+	
+	if (MapPages(vm->memory, pages) != 0)
+	{
+		ReleasePages(&pages);
+		return -1;
+	}
+	ReleasePages(&vm->memoryPages);
+	vm->memoryPages = pages;
+	return 0;
+}
+
+// Make a new vm which carries on from exactly where the parent is. The
+// child isn't registered or scheduled, that's up to the caller. NULL
+// if the parent has no program.
+vm_t *ForkVM(vm_t *parent)
+{
+	if (!parent->shared)
+	{
+		fprintf(stderr, "%s: has no program to fork\n", parent->name);
+		return NULL;
+	}
+	call_once(&forkOnce, InitFork);
+	
+	vm_t *child = AllocateVM();
+	
+	// Its own name, the parent might go away first
+	char *name = ArenaAlloc(child->arena, parent->nameLen + 1, 1);
+	memcpy(name, parent->name, parent->nameLen);
+	child->name = name;
+	child->nameLen = parent->nameLen;
+	
+	child->shared = RetainCode(parent->shared);
+	child->code = parent->code;
+	child->programLength = parent->programLength;
+	child->maxDepth = parent->maxDepth;
+	
+	MaterializeFlags(parent);
+	memcpy(child->regs, parent->regs, sizeof(parent->regs));
+	child->lazyOp = LAZY_NONE;
+	child->ip = parent->ip;
+	child->fuel = parent->fuel;
+	child->retired = parent->retired;
+	child->yielded = parent->yielded;
+	child->running = parent->running;
+	child->trap = parent->trap;
+	child->waiting = parent->waiting;
+	child->syscall = parent->syscall;
+	
+	// Only as much of a pooled stack as was used is clean, so without
+	// sharing just that much needs copying
+	size_t stackSize = MAX_STACK * sizeof(*parent->opstack);
+	child->stackHigh = parent->stackHigh;
+	if (ForkPages((uint8_t*)parent->opstack, &parent->stackPages, (uint8_t*)child->opstack, &child->stackPages, stackSize) != 0)
+		memcpy(child->opstack, parent->opstack, MIN((size_t)parent->stackHigh, (size_t)MAX_STACK) * sizeof(*parent->opstack));
+	
+	if (parent->memorySize)
+	{
+		if (ReserveMemory(child, parent->memorySize) != 0)
+		{
+			DeallocateVM(child);
+			return NULL;
+		}
+#ifdef VM_MEMORY_GUARD
+		if (ForkPages(parent->memory, &parent->memoryPages, child->memory, &child->memoryPages, parent->memorySize) != 0)
+#endif
+			memcpy(child->memory, parent->memory, parent->memorySize);
+	}
+	
+	// Both of them have the files open, like after fork(2)
+	for (int fd = 3; fd < VM_FILES; ++fd)
+	{
+		if (parent->files[fd])
+		{
+			int host = fcntl(parent->files[fd] - 1, F_DUPFD_CLOEXEC, 0);
+			child->files[fd] = host < 0 ? 0 : host + 1;
+		}
+	}
+	
+	if (parent->jit)
+		child->jit = CompileJIT(child);
+#ifdef VM_PROFILE
+	child->profile = ArenaAlloc(child->arena, (child->programLength + 1) * sizeof(profile_entry_t), sizeof(uint64_t));
+#endif
+	return child;
+}
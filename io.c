@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// System calls. INT #n stops the program with vm->waiting set and the
+// call's arguments in r0-r2, the result goes in r0 once it's done and
+// the program carries on from the instruction after the INT. Nothing
+// that does I/O happens inside the interpreter.
+//
+// Anything that only has the one vm to run (RunVM(), the library) just
+// makes the call with Syscall() and continues. The scheduler instead
+// hands the vm to SubmitIO(): a few I/O threads here make the call
+// while the worker goes on running other vms, and the vm is given back
+// to the scheduler once it's done. The vm is parked the whole time so
+// the I/O threads can read and write its memory directly.
+//
+// Guest file descriptors are per vm. 0-2 are the host's stdin, stdout
+// and stderr and can't be closed, the rest are files the program
+// opened. Programs can only open paths under the current directory.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+// Host fd for a guest fd, -1 if it isn't open
+static int HostFile(const vm_t *vm, int32_t fd)
+{
+	if (fd >= 0 && fd < 3)
+		return fd;
+	if (fd < 3 || fd >= VM_FILES)
+		return -1;
+	return vm->files[fd] - 1;
+}
+
+// Guest memory for [at, at + len), NULL if any of it is outside the
+// program's memory.
+static uint8_t *GuestBuffer(const vm_t *vm, uint32_t at, uint32_t len)
+{
+	if ((uint64_t)at + len > vm->memorySize)
+		return NULL;
+	return vm->memory + at;
+}
+
+// Absolute paths and .. components would get out of the directory
+static int PathAllowed(const char *path)
+{
+	if (!*path || *path == '/')
+		return 0;
+	for (const char *p = path; p; p = strchr(p, '/'))
+	{
+		if (*p == '/')
+			p++;
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || !p[2]))
+			return 0;
+	}
+	return 1;
+}
+
+static int32_t Open(vm_t *vm, uint32_t at, int32_t mode)
+{
+	// The path has to be NUL terminated inside the program's memory
+	if (at >= vm->memorySize)
+		return -EFAULT;
+	const char *path = (const char*)vm->memory + at;
+	size_t max = MIN(vm->memorySize - at, (uint64_t)PATH_MAX);
+	if (!memchr(path, '\0', max))
+		return -ENAMETOOLONG;
+	if (!PathAllowed(path))
+		return -EACCES;
+	
+	int flags;
+	switch(mode)
+	{
+		case OPEN_READ:   flags = O_RDONLY; break;
+		case OPEN_WRITE:  flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+		case OPEN_APPEND: flags = O_WRONLY | O_CREAT | O_APPEND; break;
+		default:          return -EINVAL;
+	}
+	
+	int32_t fd = 3;
+	while (fd < VM_FILES && vm->files[fd])
+		fd++;
+	if (fd == VM_FILES)
+		return -EMFILE;
+	
+	int host = open(path, flags | O_CLOEXEC, 0644);
+	if (host < 0)
+		return -errno;
+	vm->files[fd] = host + 1;
+	return fd;
+}
+
+static int32_t Close(vm_t *vm, int32_t fd)
+{
+	if (fd < 3 || HostFile(vm, fd) < 0)
+		return -EBADF;
+	int ret = close(vm->files[fd] - 1);
+	vm->files[fd] = 0;
+	return ret < 0 ? -errno : 0;
+}
+
+static int32_t Transfer(vm_t *vm, int32_t fd, uint32_t at, uint32_t len, int out)
+{
+	int host = HostFile(vm, fd);
+	if (host < 0)
+		return -EBADF;
+	
+	// The result has to fit in r0
+	len = MIN(len, (uint32_t)INT32_MAX);
+	uint8_t *buffer = len ? GuestBuffer(vm, at, len) : vm->memory;
+	if (len && !buffer)
+		return -EFAULT;
+	
+	ssize_t ret;
+	if (out)
+	{
+		// Keep it in order with whatever DMP and PRNT printed
+		if (host == 1 || host == 2)
+			fflush(host == 1 ? stdout : stderr);
+		ret = write(host, buffer, len);
+	}
+	else
+		ret = read(host, buffer, len);
+	return ret < 0 ? -errno : (int32_t)ret;
+}
+
+// Make the system call the vm is waiting on and let it carry on
+void Syscall(vm_t *vm)
+{
+	int32_t *regs = vm->regs;
+	int32_t ret;
+	
+	switch(vm->syscall)
+	{
+		case SYS_OPEN:  ret = Open(vm, (uint32_t)regs[0], regs[1]); break;
+		case SYS_CLOSE: ret = Close(vm, regs[0]); break;
+		case SYS_READ:  ret = Transfer(vm, regs[0], (uint32_t)regs[1], (uint32_t)regs[2], 0); break;
+		case SYS_WRITE: ret = Transfer(vm, regs[0], (uint32_t)regs[1], (uint32_t)regs[2], 1); break;
+		default:        ret = -ENOSYS; break;
+	}
+	
+	regs[0] = ret;
+	vm->waiting = 0;
+}
+
+// Close whatever the program left open, for when the vm is recycled
+void CloseFiles(vm_t *vm)
+{
+	for (int32_t fd = 3; fd < VM_FILES; ++fd)
+	{
+		if (vm->files[fd])
+			close(vm->files[fd] - 1);
+		vm->files[fd] = 0;
+	}
+}
+
+// The I/O threads share one queue of waiting vms, linked through
+// runNext since they aren't on a run queue while they wait.
+static mtx_t ioLock;
+static cnd_t ioReady;
+static vm_t *ioHead, *ioTail;
+static size_t ioThreads = IO_THREADS, ioStarted;
+static once_flag ioOnce = ONCE_FLAG_INIT;
+
+static void IOThread(void *ptr)
+{
+	(void)ptr;
+	for (;;)
+	{
+		mtx_lock(&ioLock);
+		while (!ioHead)
+			cnd_wait(&ioReady, &ioLock);
+		vm_t *vm = ioHead;
+		if (!(ioHead = vm->runNext))
+			ioTail = NULL;
+		mtx_unlock(&ioLock);
+		
+		Syscall(vm);
+		vm->ioDone(vm, vm->ioArg);
+	}
+}
+
+static void StartIO(void)
+{
+	mtx_init(&ioLock, mtx_plain);
+	cnd_init(&ioReady);
+	
+	for (size_t i = 0; i < ioThreads; ++i)
+	{
+		thrd_t thread;
+		if (thrd_create(&thread, IOThread, NULL) != thrd_success)
+		{
+			fprintf(stderr, "Failed to start I/O thread %zu!\n", i);
+			break;
+		}
+		ioStarted++;
+	}
+}
+
+// How many I/O threads to start, only before anything is submitted
+void SetIOThreads(size_t threads)
+{
+	ioThreads = threads ? threads : 1;
+}
+
+// Make the system call the vm is waiting on in the background, done is
+// called from an I/O thread once the vm can run again.
+void SubmitIO(vm_t *vm, void (*done)(vm_t *vm, void *arg), void *arg)
+{
+	call_once(&ioOnce, StartIO);
+	
+	vm->ioDone = done;
+	vm->ioArg = arg;
+	
+	// Without any threads it has to be done right here
+	if (!ioStarted)
+	{
+		Syscall(vm);
+		done(vm, arg);
+		return;
+	}
+	
+	vm->runNext = NULL;
+	mtx_lock(&ioLock);
+	if (ioTail)
+		ioTail->runNext = vm;
+	else
+		ioHead = vm;
+	ioTail = vm;
+	cnd_signal(&ioReady);
+	mtx_unlock(&ioLock);
+}
@@ -0,0 +1,951 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// A baseline template JIT for x86-64. Every guest instruction is turned
+// into a fixed little sequence of machine code with the guest registers
+// r0-r4 living in host registers the whole time. Anything we don't have
+// a template for leaves the JIT code and gets run by the interpreter
+// (see RunJIT) so both always end up in exactly the same state.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Traced and profiled builds interpret everything so every instruction
+// gets recorded
+#if defined(__x86_64__) && !defined(VM_TRACE) && !defined(VM_PROFILE)
+
+#include <sys/mman.h>
+
+// The compiled program
+typedef struct jit_s
+{
+	// mmap'd executable buffer, the entry trampoline is at the start
+	uint8_t *code;
+	size_t size;
+	// Native entry point of every instruction, [len] exits the JIT
+	// just like the END sentinel does for the interpreter.
+	const uint8_t **table;
+	// Where indirect jumps go. Same as table for instructions that
+	// start a basic block, everything else has to be charged for the
+	// rest of its block first.
+	const uint8_t **indirect;
+	const uint8_t *exit;
+	size_t len;
+} jit_t;
+
+// x86-64 register numbers
+enum
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8,  R9,  R10, R11, R12, R13, R14, R15
+};
+
+// Where the guest registers live. These are all callee saved so the
+// guest state survives calls into the C helpers below. rbp holds the vm.
+static const uint8_t GuestReg[NUM_REGS] = { RBX, R12, R13, R14, R15 };
+
+// Offsets into the vm struct
+#define VM_REG(n)   ((int32_t)(offsetof(vm_t, regs) + (n) * sizeof(int32_t)))
+#define VM_LAZYOP   ((int32_t)offsetof(vm_t, lazyOp))
+#define VM_LAZYRES  ((int32_t)offsetof(vm_t, lazyResult))
+#define VM_LAZYA    ((int32_t)offsetof(vm_t, lazyA))
+#define VM_LAZYB    ((int32_t)offsetof(vm_t, lazyB))
+#define VM_OPSTACK  ((int32_t)offsetof(vm_t, opstack))
+#define VM_IP       ((int32_t)offsetof(vm_t, ip))
+#define VM_FUEL     ((int32_t)offsetof(vm_t, fuel))
+#define VM_RETIRED  ((int32_t)offsetof(vm_t, retired))
+#define VM_STACKHIGH ((int32_t)offsetof(vm_t, stackHigh))
+
+// A rel32 jump that can only be filled in once everything is emitted
+typedef struct fixup_s
+{
+	size_t at;        // offset of the rel32 field
+	size_t target;    // instruction we want to go to
+	int inlined;      // to the inline code rather than its entry point
+} fixup_t;
+
+// A conditional jump that was compiled straight off the host flags. It
+// is only valid when falling through from the instruction before, so
+// anything jumping to it goes through a stub working from the vm flags.
+typedef struct coldstub_s
+{
+	size_t ip;
+} coldstub_t;
+
+typedef struct compiler_s
+{
+	const vm_t *vm;
+
+	// The code being generated
+	uint8_t *buf;
+	size_t len;
+	size_t cap;
+
+	size_t *entry;    // entry point offset of every instruction
+	size_t *inlined;  // offset of the inline code of every instruction
+
+	fixup_t *fixups;
+	size_t nfixups, fixupsCap;
+	coldstub_t *stubs;
+	size_t nstubs, stubsCap;
+
+	size_t exit;      // offset of the exit stub
+	size_t charge;    // offset of the indirect jump charging stub
+	jit_t *jit;
+} compiler_t;
+
+static void Grow(void **ptr, size_t *cap, size_t want, size_t size)
+{
+	if (want <= *cap)
+		return;
+
+	size_t newcap = *cap ? *cap * 2 : 64;
+	while (newcap < want)
+		newcap *= 2;
+
+	void *tmpptr = realloc(*ptr, newcap * size);
+	if (!tmpptr)
+	{
+		fprintf(stderr, "failed realloc'ing %zu bytes: %s\n", newcap * size, strerror(errno));
+		exit(1);
+	}
+	*ptr = tmpptr;
+	*cap = newcap;
+}
+
+static void Emit(compiler_t *c, const void *data, size_t n)
+{
+	Grow((void**)&c->buf, &c->cap, c->len + n, 1);
+	memcpy(c->buf + c->len, data, n);
+	c->len += n;
+}
+
+static void Byte(compiler_t *c, uint8_t b)
+{
+	Emit(c, &b, 1);
+}
+
+static void Dword(compiler_t *c, uint32_t d)
+{
+	Emit(c, &d, 4);
+}
+
+static void Qword(compiler_t *c, uint64_t q)
+{
+	Emit(c, &q, 8);
+}
+
+static void Rex(compiler_t *c, int w, int reg, int index, int base)
+{
+	uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+	if (rex != 0x40)
+		Byte(c, rex);
+}
+
+static void ModRM(compiler_t *c, int mod, int reg, int rm)
+{
+	Byte(c, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op r/m32, r32 with a register destination (mov, add, sub, cmp, test...)
+static void OpRR(compiler_t *c, uint8_t opcode, int dst, int src)
+{
+	Rex(c, 0, src, 0, dst);
+	Byte(c, opcode);
+	ModRM(c, 3, src, dst);
+}
+
+// op r/m32, imm32 from the 0x81 group (add, or, and, sub, xor, cmp)
+static void OpRI(compiler_t *c, int ext, int dst, int32_t imm)
+{
+	Rex(c, 0, 0, 0, dst);
+	Byte(c, 0x81);
+	ModRM(c, 3, ext, dst);
+	Dword(c, imm);
+}
+
+// mov r32, imm32
+static void MovRI(compiler_t *c, int dst, int32_t imm)
+{
+	Rex(c, 0, 0, 0, dst);
+	Byte(c, 0xB8 + (dst & 7));
+	Dword(c, imm);
+}
+
+// op r32, [rbp + off] / op [rbp + off], r32
+static void OpVM(compiler_t *c, int w, uint8_t opcode, int reg, int32_t off)
+{
+	Rex(c, w, reg, 0, RBP);
+	Byte(c, opcode);
+	ModRM(c, 2, reg, RBP);
+	Dword(c, off);
+}
+
+#define LoadVM(c, dst, off)  OpVM(c, 0, 0x8B, dst, off)
+#define StoreVM(c, off, src) OpVM(c, 0, 0x89, src, off)
+
+// mov dword [rbp + off], imm32
+static void StoreVMImm(compiler_t *c, int32_t off, int32_t imm)
+{
+	OpVM(c, 0, 0xC7, 0, off);
+	Dword(c, imm);
+}
+
+// mov byte [rbp + off], imm8
+static void StoreVMByte(compiler_t *c, int32_t off, uint8_t imm)
+{
+	OpVM(c, 0, 0xC6, 0, off);
+	Byte(c, imm);
+}
+
+// Record the lazy flags exactly like the interpreter's FLAGS() does.
+// These are all plain moves so the host flags survive them.
+static void LazyFlags(compiler_t *c, uint8_t op, int res, int a, int b, int32_t bimm)
+{
+	StoreVM(c, VM_LAZYA, a);
+	if (b < 0)
+		StoreVMImm(c, VM_LAZYB, bimm);
+	else
+		StoreVM(c, VM_LAZYB, b);
+	StoreVM(c, VM_LAZYRES, res);
+	StoreVMByte(c, VM_LAZYOP, op);
+}
+
+// Call a C helper with the vm as its first argument. The guest
+// registers are callee saved but r4 has to be in the vm for anything
+// reading the flags.
+typedef void (*helper_t)(void);
+
+static void CallHelper(compiler_t *c, helper_t fn)
+{
+	StoreVM(c, VM_REG(4), GuestReg[4]);
+	// mov rdi, rbp
+	Rex(c, 1, RBP, 0, RDI);
+	Byte(c, 0x89);
+	ModRM(c, 3, RBP, RDI);
+	// mov rax, fn; call rax
+	Rex(c, 1, 0, 0, RAX);
+	Byte(c, 0xB8);
+	Qword(c, (uint64_t)(uintptr_t)fn);
+	Byte(c, 0xFF);
+	ModRM(c, 3, 2, RAX);
+}
+
+// Load the opstack pointer into rax and the sign extended stack
+// pointer into rcx so [rax + rcx*4] is the top of the stack.
+static void StackAddress(compiler_t *c)
+{
+	OpVM(c, 1, 0x8B, RAX, VM_OPSTACK);
+	// movsxd rcx, r3
+	Rex(c, 1, RCX, 0, GuestReg[3]);
+	Byte(c, 0x63);
+	ModRM(c, 3, RCX, GuestReg[3]);
+}
+
+// op [rax + rcx*4], reg
+static void OpStack(compiler_t *c, uint8_t opcode, int reg)
+{
+	Rex(c, 0, reg, RCX, RAX);
+	Byte(c, opcode);
+	ModRM(c, 0, reg, 4);
+	Byte(c, 0x88); // SIB: scale 4, index rcx, base rax
+}
+
+static void Push(compiler_t *c, int src, int32_t imm)
+{
+	StackAddress(c);
+	if (src < 0)
+	{
+		OpStack(c, 0xC7, 0);
+		Dword(c, imm);
+	}
+	else
+		OpStack(c, 0x89, src);
+	OpRI(c, 0, GuestReg[3], 1);
+	
+	// Remember how far up the stack has been used like PUSH() does
+	OpVM(c, 0, 0x3B, GuestReg[3], VM_STACKHIGH); // cmp r3, [stackHigh]
+	Byte(c, 0x76);                                // jbe over the store
+	size_t skip = c->len;
+	Byte(c, 0);
+	StoreVM(c, VM_STACKHIGH, GuestReg[3]);
+	c->buf[skip] = (uint8_t)(c->len - (skip + 1));
+}
+
+static void Pop(compiler_t *c, int dst)
+{
+	OpRI(c, 5, GuestReg[3], 1);
+	StackAddress(c);
+	OpStack(c, 0x8B, dst);
+}
+
+// Jump (or conditional jump when cc is set) to an instruction
+static void JumpTo(compiler_t *c, uint8_t cc, size_t target, int inlined)
+{
+	if (cc)
+	{
+		Byte(c, 0x0F);
+		Byte(c, cc);
+	}
+	else
+		Byte(c, 0xE9);
+
+	Grow((void**)&c->fixups, &c->fixupsCap, c->nfixups + 1, sizeof(fixup_t));
+	c->fixups[c->nfixups++] = (fixup_t){ c->len, target, inlined };
+	Dword(c, 0);
+}
+
+// Jump to the instruction in eax, anything past the end ends up at the
+// exit for the END sentinel.
+static void JumpIndirect(compiler_t *c)
+{
+	MovRI(c, RCX, (int32_t)c->vm->programLength);
+	OpRR(c, 0x39, RAX, RCX);           // cmp eax, ecx
+	Byte(c, 0x0F);                     // cmova eax, ecx
+	Byte(c, 0x47);
+	ModRM(c, 3, RAX, RCX);
+	Rex(c, 1, 0, 0, RCX);              // mov rcx, table
+	Byte(c, 0xB8 + RCX);
+	Qword(c, (uint64_t)(uintptr_t)c->jit->indirect);
+	Byte(c, 0xFF);                     // jmp [rcx + rax*8]
+	ModRM(c, 0, 4, 4);
+	Byte(c, 0xC1);
+}
+
+// Leave the JIT code so the interpreter runs instruction ip
+static void ExitAt(compiler_t *c, size_t ip)
+{
+	// mov qword [rbp + ip], imm32
+	OpVM(c, 1, 0xC7, 0, VM_IP);
+	Dword(c, (uint32_t)ip);
+	Byte(c, 0xE9);
+	Dword(c, (uint32_t)(c->exit - (c->len + 4)));
+}
+
+// Leave for the interpreter at ip unless r3 has room for pushing (pops
+// 0) or popping (pops 1) a value. It checks the stack of programs the
+// verifier couldn't bound and stops them with the right trap, and the
+// host (see playvm.c) can move the stack under any program between runs.
+static void StackCheck(compiler_t *c, size_t ip, int pops)
+{
+	OpRR(c, 0x89, RCX, GuestReg[3]);    // mov ecx, r3
+	if (pops)
+		OpRI(c, 5, RCX, 1);             // sub ecx, 1
+	OpRI(c, 7, RCX, MAX_STACK);         // cmp ecx, MAX_STACK
+	Byte(c, 0x72);                      // jb over the exit
+	size_t skip = c->len;
+	Byte(c, 0);
+	ExitAt(c, ip);
+	c->buf[skip] = (uint8_t)(c->len - (skip + 1));
+}
+
+// Pay for the block starting at instruction ip. If there isn't enough
+// fuel leave for the interpreter which will stop the vm there.
+static void ChargeBlock(compiler_t *c, size_t ip, uint16_t left)
+{
+	OpVM(c, 1, 0x8B, RAX, VM_FUEL);     // mov rax, [fuel]
+	Rex(c, 1, 0, 0, RAX);               // cmp rax, left
+	Byte(c, 0x81);
+	ModRM(c, 3, 7, RAX);
+	Dword(c, left);
+	Byte(c, 0x0F);                      // jae over the exit
+	Byte(c, 0x83);
+	size_t skip = c->len;
+	Dword(c, 0);
+	ExitAt(c, ip);
+	uint32_t rel = (uint32_t)(c->len - (skip + 4));
+	memcpy(c->buf + skip, &rel, 4);
+	Rex(c, 1, 0, 0, RAX);               // sub rax, left
+	Byte(c, 0x81);
+	ModRM(c, 3, 5, RAX);
+	Dword(c, left);
+	OpVM(c, 1, 0x89, RAX, VM_FUEL);     // mov [fuel], rax
+	OpVM(c, 1, 0x81, 0, VM_RETIRED);    // add qword [retired], left
+	Dword(c, left);
+}
+
+static size_t ClampTarget(const compiler_t *c, int32_t target)
+{
+	size_t ip = (uint32_t)target;
+	return ip > c->vm->programLength ? c->vm->programLength : ip;
+}
+
+// Helpers called from the generated code
+
+static void JitMaterialize(vm_t *vm)
+{
+	MaterializeFlags(vm);
+}
+
+static int JitCondition(const vm_t *vm, int handler)
+{
+	switch(handler)
+	{
+		case H_JNZ_R: case H_JNZ_I: return !ReadFlags(vm, FLAG_ZERO);
+		case H_JZ_R:  case H_JZ_I:  return ReadFlags(vm, FLAG_ZERO) != 0;
+		case H_JS_R:  case H_JS_I:  return ReadFlags(vm, FLAG_SIGN) != 0;
+		case H_JNS_R: case H_JNS_I: return !ReadFlags(vm, FLAG_SIGN);
+		case H_JGT_R: case H_JGT_I: return JGT_TAKEN(ReadFlags(vm, FLAG_ZERO | FLAG_SIGN | FLAG_OVERFLOW));
+		case H_JLT_R: case H_JLT_I: return JLT_TAKEN(ReadFlags(vm, FLAG_SIGN | FLAG_OVERFLOW));
+		case H_JPE_R: case H_JPE_I: return ReadFlags(vm, FLAG_PARITY) != 0;
+		case H_JPO_R: case H_JPO_I: return !ReadFlags(vm, FLAG_PARITY);
+		default: return 0;
+	}
+}
+
+static int32_t JitDivide(vm_t *vm, int32_t a, int32_t b)
+{
+	(void)vm;
+	if (b == 0)
+	{
+		fprintf(stderr, "Program attempted to divide by zero!\n");
+		return a;
+	}
+	if (b == -1)
+		return (int32_t)(0u - (uint32_t)a);
+	return a / b;
+}
+
+// An indirect jump into the middle of a basic block
+static const uint8_t *JitIndirect(vm_t *vm, uint32_t target)
+{
+	if (!ChargeFuel(vm, target))
+		return vm->jit->exit;
+	return vm->jit->table[target];
+}
+
+// Bring r4 up to date with the lazy flags
+static void SyncFlags(compiler_t *c)
+{
+	CallHelper(c, (helper_t)JitMaterialize);
+	LoadVM(c, GuestReg[4], VM_REG(4));
+}
+
+// The host condition code matching a jump compiled off the host flags
+static uint8_t HostCondition(uint8_t handler)
+{
+	switch(handler)
+	{
+		case H_JZ_I:  return 0x84; // je
+		case H_JNZ_I: return 0x85; // jne
+		case H_JS_I:  return 0x88; // js
+		case H_JNS_I: return 0x89; // jns
+		case H_JGT_I: return 0x8F; // jg
+		case H_JLT_I: return 0x8C; // jl
+		default:      return 0;
+	}
+}
+
+// Conditional jump working from the vm's (lazy) flags
+static void SlowCondition(compiler_t *c, const instruction_t *ins, uint8_t handler)
+{
+	// JitCondition(vm, handler)
+	MovRI(c, RSI, handler);
+	CallHelper(c, (helper_t)JitCondition);
+	OpRR(c, 0x85, RAX, RAX);            // test eax, eax
+	if (ins->type == OP_FLAG_IMMEDIATE)
+		JumpTo(c, 0x85, ClampTarget(c, ins->imm), 0);
+	else
+	{
+		// jz over the indirect jump
+		Byte(c, 0x0F);
+		Byte(c, 0x84);
+		size_t skip = c->len;
+		Dword(c, 0);
+		OpRR(c, 0x89, RAX, GuestReg[ins->r0]);
+		JumpIndirect(c);
+		uint32_t rel = (uint32_t)(c->len - (skip + 4));
+		memcpy(c->buf + skip, &rel, 4);
+	}
+}
+
+// Whether the host flags after this handler match the guest flags
+static int SetsHostFlags(uint8_t handler)
+{
+	switch(handler)
+	{
+		case H_ADD_RR: case H_ADD_RI: case H_SUB_RR: case H_SUB_RI:
+		case H_XOR_RR: case H_XOR_RI: case H_OR_RR:  case H_OR_RI:
+		case H_AND_RR: case H_AND_RI: case H_MOV_RR: case H_MOV_RI:
+		case H_NOT_RR: case H_NOT_RI: case H_CMP_RR: case H_CMP_RI:
+		case H_INC:    case H_DEC:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Compile a single instruction. Returns the handler it compiled or
+// H_COUNT if it left it to the interpreter.
+static uint8_t CompileInstruction(compiler_t *c, size_t i, uint8_t previous)
+{
+	const instruction_t *ins = &c->vm->code[i];
+	uint8_t handler = BaseHandler(ins);
+	uint8_t wrapped = ins->handler == H_BLOCK ? ins->block : ins->handler;
+
+	// HALT, INT, memory accesses, the debug opcodes and anything unknown
+	// are left to the interpreter, as are register numbers that don't
+	// exist. The interpreter is where memory faults are caught.
+	switch(handler)
+	{
+		case H_UNUSED: case H_HALT: case H_UNIMPL: case H_PRNT:
+		case H_DMP:    case H_UNKNOWN: case H_END:   case H_INT:
+		case H_LOAD8_R:   case H_LOAD8_I:   case H_LOAD16_R:  case H_LOAD16_I:
+		case H_LOAD32_R:  case H_LOAD32_I:  case H_STORE8_R:  case H_STORE8_I:
+		case H_STORE16_R: case H_STORE16_I: case H_STORE32_R: case H_STORE32_I:
+			ExitAt(c, i);
+			return H_COUNT;
+		default:
+			if (ins->r0 >= NUM_REGS || ins->r1 >= NUM_REGS)
+			{
+				ExitAt(c, i);
+				return H_COUNT;
+			}
+			break;
+	}
+
+	int g0 = GuestReg[ins->r0], g1 = GuestReg[ins->r1];
+	int32_t imm = ins->imm;
+
+	// Before paying for the block, the interpreter does that itself
+	// if we leave for it here.
+	switch(handler)
+	{
+		case H_PUSH_R: case H_PUSH_I: case H_PUSHF: case H_CALL_R: case H_CALL_I:
+			StackCheck(c, i, 0);
+			break;
+		case H_POP: case H_POPF: case H_RET:
+			StackCheck(c, i, 1);
+			break;
+		default:
+			break;
+	}
+
+	if (ins->handler == H_BLOCK)
+	{
+		ChargeBlock(c, i, ins->left);
+		previous = H_COUNT;
+	}
+
+	if (wrapped == H_SYNCF)
+	{
+		SyncFlags(c);
+		previous = H_COUNT;
+	}
+
+	// ALU opcode and 0x81 group extension for the simple ones
+	uint8_t opcode = 0, ext = 0, lazy = LAZY_LOGIC;
+	switch(handler)
+	{
+		case H_ADD_RR: case H_ADD_RI: opcode = 0x01; ext = 0; lazy = LAZY_ADD; break;
+		case H_SUB_RR: case H_SUB_RI: opcode = 0x29; ext = 5; lazy = LAZY_SUB; break;
+		case H_XOR_RR: case H_XOR_RI: opcode = 0x31; ext = 6; break;
+		case H_OR_RR:  case H_OR_RI:  opcode = 0x09; ext = 1; break;
+		case H_AND_RR: case H_AND_RI: opcode = 0x21; ext = 4; break;
+		default: break;
+	}
+
+	switch(handler)
+	{
+		case H_NOP:
+			break;
+		case H_LOADI: case H_LEA_I:
+			MovRI(c, g0, imm);
+			break;
+		case H_LEA_R:
+			OpRR(c, 0x89, RAX, g1);
+			OpRI(c, 0, RAX, imm);
+			OpRR(c, 0x89, g0, RAX);
+			break;
+
+		case H_ADD_RR: case H_SUB_RR: case H_XOR_RR: case H_OR_RR: case H_AND_RR:
+			OpRR(c, 0x89, RAX, g0);
+			OpRR(c, 0x89, RCX, g1);
+			OpRR(c, opcode, g0, RCX);
+			LazyFlags(c, lazy, g0, RAX, RCX, 0);
+			break;
+		case H_ADD_RI: case H_SUB_RI: case H_XOR_RI: case H_OR_RI: case H_AND_RI:
+			OpRR(c, 0x89, RAX, g0);
+			OpRI(c, ext, g0, imm);
+			LazyFlags(c, lazy, g0, RAX, -1, imm);
+			break;
+
+		case H_MOV_RR: case H_NOT_RR:
+			OpRR(c, 0x89, RAX, g0);
+			OpRR(c, 0x89, RCX, g1);
+			OpRR(c, 0x89, g0, RCX);
+			if (handler == H_NOT_RR)
+			{
+				Rex(c, 0, 0, 0, g0);
+				Byte(c, 0xF7);
+				ModRM(c, 3, 2, g0);
+			}
+			OpRR(c, 0x85, g0, g0);
+			LazyFlags(c, LAZY_LOGIC, g0, RAX, RCX, 0);
+			break;
+		case H_MOV_RI: case H_NOT_RI:
+			OpRR(c, 0x89, RAX, g0);
+			MovRI(c, g0, handler == H_NOT_RI ? ~imm : imm);
+			OpRR(c, 0x85, g0, g0);
+			LazyFlags(c, LAZY_LOGIC, g0, RAX, -1, imm);
+			break;
+
+		case H_SHL_RR: case H_SHR_RR:
+			OpRR(c, 0x89, RAX, g0);
+			OpRR(c, 0x89, RCX, g1);
+			Rex(c, 0, 0, 0, g0);
+			Byte(c, 0xD3);
+			ModRM(c, 3, handler == H_SHL_RR ? 4 : 7, g0);
+			LazyFlags(c, LAZY_LOGIC, g0, RAX, RCX, 0);
+			break;
+		case H_SHL_RI: case H_SHR_RI:
+			OpRR(c, 0x89, RAX, g0);
+			Rex(c, 0, 0, 0, g0);
+			Byte(c, 0xC1);
+			ModRM(c, 3, handler == H_SHL_RI ? 4 : 7, g0);
+			Byte(c, imm & 31);
+			LazyFlags(c, LAZY_LOGIC, g0, RAX, -1, imm);
+			break;
+
+		case H_MUL_RR:
+			OpRR(c, 0x89, RAX, g0);
+			OpRR(c, 0x89, RCX, g1);
+			Rex(c, 0, g0, 0, RCX);          // imul g0, ecx
+			Byte(c, 0x0F);
+			Byte(c, 0xAF);
+			ModRM(c, 3, g0, RCX);
+			LazyFlags(c, LAZY_MUL, g0, RAX, RCX, 0);
+			break;
+		case H_MUL_RI:
+			OpRR(c, 0x89, RAX, g0);
+			Rex(c, 0, g0, 0, g0);           // imul g0, g0, imm32
+			Byte(c, 0x69);
+			ModRM(c, 3, g0, g0);
+			Dword(c, imm);
+			LazyFlags(c, LAZY_MUL, g0, RAX, -1, imm);
+			break;
+
+		case H_DIV_RR: case H_DIV_RI:
+			StoreVM(c, VM_LAZYA, g0);
+			if (handler == H_DIV_RR)
+			{
+				StoreVM(c, VM_LAZYB, g1);
+				OpRR(c, 0x89, RDX, g1);
+			}
+			else
+			{
+				StoreVMImm(c, VM_LAZYB, imm);
+				MovRI(c, RDX, imm);
+			}
+			OpRR(c, 0x89, RSI, g0);
+			CallHelper(c, (helper_t)JitDivide);
+			OpRR(c, 0x89, g0, RAX);
+			StoreVM(c, VM_LAZYRES, g0);
+			StoreVMByte(c, VM_LAZYOP, LAZY_LOGIC);
+			break;
+
+		case H_INC: case H_DEC:
+			OpRR(c, 0x89, RAX, g0);
+			OpRI(c, handler == H_INC ? 0 : 5, g0, 1);
+			LazyFlags(c, handler == H_INC ? LAZY_ADD : LAZY_SUB, g0, RAX, -1, 1);
+			break;
+
+		case H_CMP_RR:
+			OpRR(c, 0x89, RAX, g0);
+			OpRR(c, 0x89, RCX, g1);
+			StoreVM(c, VM_LAZYA, RAX);
+			StoreVM(c, VM_LAZYB, RCX);
+			OpRR(c, 0x29, RAX, RCX);
+			StoreVM(c, VM_LAZYRES, RAX);
+			StoreVMByte(c, VM_LAZYOP, LAZY_SUB);
+			break;
+		case H_CMP_RI:
+			OpRR(c, 0x89, RAX, g0);
+			StoreVM(c, VM_LAZYA, RAX);
+			StoreVMImm(c, VM_LAZYB, imm);
+			OpRI(c, 5, RAX, imm);
+			StoreVM(c, VM_LAZYRES, RAX);
+			StoreVMByte(c, VM_LAZYOP, LAZY_SUB);
+			break;
+
+		case H_PUSH_R:
+			Push(c, g0, 0);
+			break;
+		case H_PUSH_I:
+			Push(c, -1, imm);
+			break;
+		case H_PUSHF:
+			SyncFlags(c);
+			Push(c, GuestReg[4], 0);
+			break;
+		case H_POP:
+			Pop(c, g0);
+			break;
+		case H_POPF:
+			Pop(c, GuestReg[4]);
+			StoreVMByte(c, VM_LAZYOP, LAZY_NONE);
+			break;
+
+		case H_CALL_I:
+			Push(c, -1, (int32_t)(i + 1));
+			JumpTo(c, 0, ClampTarget(c, imm), 0);
+			break;
+		case H_CALL_R:
+			Push(c, -1, (int32_t)(i + 1));
+			OpRR(c, 0x89, RAX, g0);
+			JumpIndirect(c);
+			break;
+		case H_RET:
+			Pop(c, RAX);
+			JumpIndirect(c);
+			break;
+		case H_JMP_I:
+			JumpTo(c, 0, ClampTarget(c, imm), 0);
+			break;
+		case H_JMP_R:
+			OpRR(c, 0x89, RAX, g0);
+			JumpIndirect(c);
+			break;
+
+		case H_JNZ_I: case H_JZ_I: case H_JS_I: case H_JNS_I:
+		case H_JGT_I: case H_JLT_I: case H_JPE_I: case H_JPO_I:
+			// Straight after something that left the guest flags in the
+			// host flags we can just branch on them.
+			if (SetsHostFlags(previous) && HostCondition(handler))
+			{
+				JumpTo(c, HostCondition(handler), ClampTarget(c, imm), 0);
+				Grow((void**)&c->stubs, &c->stubsCap, c->nstubs + 1, sizeof(coldstub_t));
+				c->stubs[c->nstubs++] = (coldstub_t){ i };
+				break;
+			}
+			SlowCondition(c, ins, handler);
+			break;
+		case H_JNZ_R: case H_JZ_R: case H_JS_R: case H_JNS_R:
+		case H_JGT_R: case H_JLT_R: case H_JPE_R: case H_JPO_R:
+			SlowCondition(c, ins, handler);
+			break;
+
+		default:
+			break;
+	}
+
+	return handler;
+}
+
+jit_t *CompileJIT(const vm_t *vm)
+{
+	compiler_t c;
+	memset(&c, 0, sizeof(c));
+	c.vm = vm;
+
+	size_t len = vm->programLength;
+	c.entry = calloc(len + 1, sizeof(size_t));
+	c.inlined = calloc(len + 1, sizeof(size_t));
+	// The tables live as long as the program so they go in its arena
+	c.jit = ArenaAlloc(vm->arena, sizeof(jit_t), sizeof(void*));
+	c.jit->table = ArenaAlloc(vm->arena, (len + 1) * sizeof(uint8_t*), sizeof(void*));
+	c.jit->indirect = ArenaAlloc(vm->arena, (len + 1) * sizeof(uint8_t*), sizeof(void*));
+	c.jit->len = len;
+	if (!c.entry || !c.inlined)
+	{
+		fprintf(stderr, "failed allocating JIT tables: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	// Entry trampoline: void enter(vm_t *vm, const void *target)
+	static const uint8_t prologue[] = {
+		0x53,                   // push rbx
+		0x55,                   // push rbp
+		0x41, 0x54,             // push r12
+		0x41, 0x55,             // push r13
+		0x41, 0x56,             // push r14
+		0x41, 0x57,             // push r15
+		0x48, 0x83, 0xEC, 0x08, // sub rsp, 8 (keep calls 16 byte aligned)
+		0x48, 0x89, 0xFD,       // mov rbp, rdi
+	};
+	Emit(&c, prologue, sizeof(prologue));
+	for (int r = 0; r < NUM_REGS; ++r)
+		LoadVM(&c, GuestReg[r], VM_REG(r));
+	Byte(&c, 0xFF);             // jmp rsi
+	ModRM(&c, 3, 4, RSI);
+
+	// Exit: write the guest registers back and return
+	c.exit = c.len;
+	for (int r = 0; r < NUM_REGS; ++r)
+		StoreVM(&c, VM_REG(r), GuestReg[r]);
+	static const uint8_t epilogue[] = {
+		0x48, 0x83, 0xC4, 0x08, // add rsp, 8
+		0x41, 0x5F,             // pop r15
+		0x41, 0x5E,             // pop r14
+		0x41, 0x5D,             // pop r13
+		0x41, 0x5C,             // pop r12
+		0x5D,                   // pop rbp
+		0x5B,                   // pop rbx
+		0xC3,                   // ret
+	};
+	Emit(&c, epilogue, sizeof(epilogue));
+
+	// Indirect jumps into the middle of a block, the target is in eax
+	c.charge = c.len;
+	OpRR(&c, 0x89, RSI, RAX);
+	CallHelper(&c, (helper_t)JitIndirect);
+	Byte(&c, 0xFF);             // jmp rax
+	ModRM(&c, 3, 4, RAX);
+
+	uint8_t previous = H_COUNT;
+	for (size_t i = 0; i < len; ++i)
+	{
+		c.entry[i] = c.inlined[i] = c.len;
+		previous = CompileInstruction(&c, i, previous);
+	}
+
+	// Falling off the end leaves for the END sentinel
+	c.entry[len] = c.inlined[len] = c.len;
+	ExitAt(&c, len);
+
+	// Out of line entry points for jumps compiled off the host flags
+	for (size_t s = 0; s < c.nstubs; ++s)
+	{
+		size_t i = c.stubs[s].ip;
+		c.entry[i] = c.len;
+		SlowCondition(&c, &vm->code[i], BaseHandler(&vm->code[i]));
+		JumpTo(&c, 0, i + 1, 1);
+	}
+
+	for (size_t f = 0; f < c.nfixups; ++f)
+	{
+		const fixup_t *fx = &c.fixups[f];
+		size_t to = fx->inlined ? c.inlined[fx->target] : c.entry[fx->target];
+		uint32_t rel = (uint32_t)(to - (fx->at + 4));
+		memcpy(c.buf + fx->at, &rel, 4);
+	}
+
+	// Copy it all into executable memory
+	jit_t *jit = c.jit;
+	jit->size = c.len;
+	jit->code = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map JIT buffer: %s\n", strerror(errno));
+		jit->code = NULL;
+		FreeJIT(jit);
+		jit = NULL;
+	}
+	else
+	{
+		memcpy(jit->code, c.buf, c.len);
+		if (mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC) != 0)
+		{
+			fprintf(stderr, "Failed to make JIT buffer executable: %s\n", strerror(errno));
+			FreeJIT(jit);
+			jit = NULL;
+		}
+		else
+		{
+			jit->exit = jit->code + c.exit;
+			for (size_t i = 0; i <= len; ++i)
+			{
+				jit->table[i] = jit->code + c.entry[i];
+				jit->indirect[i] = vm->code[i].handler == H_BLOCK || i == len ? jit->table[i] : jit->code + c.charge;
+			}
+		}
+	}
+
+	free(c.buf);
+	free(c.entry);
+	free(c.inlined);
+	free(c.fixups);
+	free(c.stubs);
+	return jit;
+}
+
+void FreeJIT(jit_t *jit)
+{
+	if (!jit)
+		return;
+	if (jit->code)
+		munmap(jit->code, jit->size);
+	// Everything else goes with the vm's arena
+}
+
+// Run the vm using its compiled code. Every time the JIT code leaves,
+// vm->ip is at something it doesn't compile so the interpreter runs
+// that one instruction and we go straight back in. Running out of fuel
+// stops both.
+void RunJIT(vm_t *vm)
+{
+	if (!ResumeFuel(vm))
+		return;
+
+	jit_t *jit = vm->jit;
+	union
+	{
+		void *ptr;
+		void (*enter)(vm_t *vm, const void *target);
+	} code;
+	code.ptr = jit->code;
+
+	while (vm->running && !vm->yielded && !vm->waiting)
+	{
+		size_t ip = vm->ip > jit->len ? jit->len : vm->ip;
+		code.enter(vm, jit->table[ip]);
+		if (vm->yielded)
+		{
+			// Out of fuel after an indirect jump, leave r4 exact
+			// just like the interpreter does.
+			MaterializeFlags(vm);
+			break;
+		}
+		InterpretOne(vm);
+	}
+}
+
+#else
+
+// No JIT for this architecture (or we're tracing), everything runs in
+// the interpreter.
+
+struct jit_s *CompileJIT(const vm_t *vm)
+{
+	(void)vm;
+	return NULL;
+}
+
+void FreeJIT(struct jit_s *jit)
+{
+	(void)jit;
+}
+
+void RunJIT(vm_t *vm)
+{
+	interpret(vm);
+}
+
+#endif
@@ -86,6 +86,7 @@ enum
 	OP_DMP    = 0x26,
 };
 
+#ifdef VM_TRACE
 // Op code tables
 typedef struct
 {
@@ -126,6 +127,7 @@ static const opcodes_t OpTable[] = {
 	{OP_PRNT,   "PRNT"},
 	{OP_DMP,    "DMP"},
 };
+#endif
 
 // Our program
 static const unsigned program[] =
@@ -197,11 +199,13 @@ int running = 1;
 // evaluate the last decoded instruction
 void eval(void)
 {
+#ifdef VM_TRACE
 	// In case we hit an unknown instruction.
 	if (instrNum <= (sizeof(OpTable) / sizeof(*OpTable)))
 		printf("%s(%d) {r0: %d, r1: %d, r2: %d} imm %d\n",
                 OpTable[instrNum].opcodename,
                 instrNum, reg1, reg2, reg3, imm);
+#endif
 	
 	switch(instrNum)
 	{
@@ -348,13 +352,18 @@ void run(void)
 	memset(opstack, 0, sizeof(opstack));
 	while(running)
 	{
+		// Only traced builds (make TRACE=1) print every step
+#ifdef VM_TRACE
 		showRegs();
+#endif
 		int instr = fetch();
 		decode(instr);
 		eval();
+#ifdef VM_TRACE
 		// Slow down our program so we can debug easier
 // 		sleep(1);
 		usleep(8400);
+#endif
 	}
 	showRegs();
 }
@@ -25,594 +25,1093 @@
  */
 
 // Compiled with:
-// clang -Wall -Wextra -pedantic -std=c11 -Wshadow -I. -g main2.c -o main2 -pthreads
+// clang -Wall -Wextra -pedantic -std=c11 -Wshadow -I. -g main2.c jit.c sched.c registry.c pool.c batch.c verify.c profile.c module.c asm.c playvm.c codecache.c memory.c io.c snapshot.c fork.c optimize.c -o main2 -pthreads
 
-// Needed for the bullshit license issues - Justasic
-#define _POSIX_C_SOURCE 200809L 
-#define __USE_XOPEN2K8 1
-#define __USE_XOPEN2K 1
+#include "vm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h> // fuck this header
-#include <stdint.h>
-#include <limits.h>
-#ifndef __STDC_NO_THREADS__
-# include <threads.h>
-#else
-// Use our local hack-around version
-# include "threads.h"
-#endif
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
 
-// Our registers
-//
-// r0 - general register
-// r1 - general register
-// r2 - general register
-// r3 - stack pointer register
-// r4 - flags register
-#define NUM_REGS 5
-
-// Our max stack size
-#define MAX_STACK (1 << 16)
-
-// Some flag functions
-#define SETFLAGS(var, flags)   (var |= (flags))
-#define UNSETFLAGS(var, flags) (var &= ~(flags))
-
-// Other macros
-#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
-
-// Our registers struct to hold the opcode registers.
-typedef struct registers_s
-{
-	int32_t r0; // General register
-	int32_t r1; // General register
-	int32_t r2; // General register
-	int32_t r3; // Stack pointer
-	int32_t r4; // Flags
-	int32_t imm; // immediate value
-} registers_t;
-
-// The decoded instruction.
-typedef struct instruction_s
-{
-	// The opcode that was decoded
-	uint32_t opcode;
-	//unsigned operand; // Technically not needed since registers_t decodes this.
-	// The type of the operands (whether it's a register or an immediate constant value)
-	uint8_t type;
-	// operands (decoded)
-	registers_t *reg;
-} instruction_t;
-
-// This is just a struct to use in the struct below
-// it corrects the instruction pointer
-typedef struct program_s
-{
-	int32_t opcode;
-	int32_t operands;
-} program_t;
-
-// vm struct to allow for multiple programs
-// to run at the same time on the same inter-
-// preter. Multiplexing!
-typedef struct vm_s
-{
-        // See the define above
-	int32_t regs[NUM_REGS];
-
-        // Our stack -- quite large so we
-        // can hold a lot of things in it.
-        // Size should be 1 << 16
-        unsigned *opstack;
-
-        // Our instruction pointer
-        unsigned long ip;
-
-        // The length of the program loaded
-        size_t programLength;
-
-        // The program, loaded into a buffer
-	program_t **program;
-	
-	// Check whether the program is running
-	unsigned char running;
-	
-	// The name of the program
-	const char *name;
-	size_t nameLen;
-	
-	// The thread id this vm is running in
-	thrd_t thread;
-	
-	// The next program (if there is one)
-	struct vm_s *next;
-} vm_t;
-
-// All the mnemonics
-enum 
-{
-        // Basic mnemonics
-        OP_UNUSED = 0x000, // Unused -- throw error if used because program is likely corrupt.
-        OP_NOP    = 0x001, // No-operation opcode
-        OP_ADD    = 0x002, // add two numbers together
-        OP_SUB    = 0x003, // subtract two numbers
-        OP_MUL    = 0x004, // Multiply two numbers
-        OP_DIV    = 0x005, // divide two numbers
-        
-        // Bitwise operators
-        OP_XOR    = 0x006, // bitwise exclusive or
-        OP_OR     = 0x007, // bitwise or
-        OP_NOT    = 0x008, // bitwise not
-        OP_AND    = 0x009, // bitwise and
-        OP_SHR    = 0x00A, // bitshift right
-        OP_SHL    = 0x00B, // bitshift left
-
-        OP_INC    = 0x00C, // increment register
-        OP_DEC    = 0x00D, // decrement register
-
-        // Stack operators
-        OP_MOV    = 0x00E, // Move values from register to register
-        OP_CMP    = 0x00F, // Compare two registers
-        OP_CALL   = 0x010, // Call a function
-        OP_RET    = 0x011, // Return from a function call
-        OP_PUSH   = 0x012, // Push a value to the stack
-        OP_POP    = 0x013, // Pop a value from the stack
-        OP_LEA    = 0x014, // Load effective address
-
-        // Jumps
-        OP_JMP    = 0x015, // Jump always
-        OP_JNZ    = 0x016, // Jump if not zero
-        OP_JZ     = 0x017, // Jump if zero
-        OP_JS     = 0x018, // Jump if sign
-	OP_JNS    = 0x019, // Jump if not sign
-        OP_JGT    = 0x01A, // Jump if greater than
-        OP_JLT    = 0x01B, // Jump if less than
-	OP_JPE    = 0x01C, // Jump if parity even
-	OP_JPO    = 0x01D, // Jump if parity odd
-
-        // Program control
-        OP_HALT   = 0x01E, // Halt the application
-        OP_INT    = 0x01F, // Interrupt -- used for syscalls
-	OP_LOADI  = 0x020, // Load an imm value
-	OP_PUSHF  = 0x021, // Push flags to stack
-	OP_POPF   = 0x022, // Pop flags from stack
-
-        // Debug
-        OP_DMP    = 0xA00, // Dump all registers to terminal
-        OP_PRNT   = 0xA01 // Dump specific register to the terminal
+#ifdef VM_PAIR_PROFILE
+// Printable handler names for the profiling output
+static const char *const HandlerNames[H_COUNT] = {
+#define X(name) #name,
+	HANDLERS(X)
+#undef X
 };
+#endif
 
-// All flags
-enum
+// This decodes the operands for the instruction
+// We pack the operands into a int32_t-sized char
+void DecodeOperand(instruction_t *ins, int32_t operand)
 {
-	FLAG_CARRY    = (1 << 0), // If an arithmatic carry operation occured
-	FLAG_ZERO     = (1 << 1), // If the operation resulted in a zero result
-	FLAG_OVERFLOW = (1 << 2), // If the operation overflowed the integer
-	FLAG_SIGN     = (1 << 3), // If the operation used a signed integer that is negative
-	FLAG_PARITY   = (1 << 4)  // see http://en.wikipedia.org/wiki/Parity_flag
-};
+	ins->type = (operand >> 16) & 0xF;
+	ins->r0   = (operand >> 12) & 0xF;
+	ins->r1   = (operand >>  8) & 0xF;
+	ins->r2   = (operand >>  4) & 0xF;
+	ins->imm  = (operand & 0xFF)     ;
+}
 
-// used to tell whether the opcode is to use
-// the constant value (imm) or the registers.
-enum 
+// The other way around, for the assemblers. Immediates which don't fit
+// in the normal 8 bits get the wide form.
+void EncodeInstruction(program_t *pr, uint16_t opcode, uint8_t type, uint8_t r0, uint8_t r1, int32_t imm)
 {
-	OP_FLAG_UNKNOWN,
-	OP_FLAG_IMMEDIATE,
-	OP_FLAG_REGISTER
-};
+	int32_t fields = (type & 0xF) << 16 | (r0 & 0xF) << 12 | (r1 & 0xF) << 8;
+	if (NARROW_IMMEDIATE(imm))
+	{
+		pr->opcode = opcode;
+		pr->operands = fields | imm;
+	}
+	else
+	{
+		pr->opcode = OP_WIDE | fields << 8 | opcode;
+		pr->operands = imm;
+	}
+}
 
-// This just allocates and prepares our vm_t struct object
-vm_t *AllocateVM(void)
+// Pick the specialized handler for a decoded instruction. Anything
+// that isn't marked as an immediate is treated as the register form.
+static uint8_t SelectHandler(const instruction_t *ins)
 {
-        vm_t *vm = malloc(sizeof(vm_t));
-        memset(vm, 0, sizeof(vm_t));
-        vm->opstack = malloc(MAX_STACK);
-        memset(vm->opstack, 0, MAX_STACK);
-        return vm;
+	int imm = ins->type == OP_FLAG_IMMEDIATE;
+#define FORM2(name) (imm ? H_##name##_RI : H_##name##_RR)
+#define FORM1(name) (imm ? H_##name##_I : H_##name##_R)
+	switch(ins->opcode)
+	{
+		case OP_UNUSED: return H_UNUSED;
+		case OP_NOP:    return H_NOP;
+		case OP_HALT:   return H_HALT;
+		case OP_LOADI:  return H_LOADI;
+		case OP_ADD:    return FORM2(ADD);
+		case OP_SUB:    return FORM2(SUB);
+		case OP_MUL:    return FORM2(MUL);
+		case OP_DIV:    return FORM2(DIV);
+		case OP_XOR:    return FORM2(XOR);
+		case OP_OR:     return FORM2(OR);
+		case OP_AND:    return FORM2(AND);
+		case OP_SHL:    return FORM2(SHL);
+		case OP_SHR:    return FORM2(SHR);
+		case OP_NOT:    return FORM2(NOT);
+		case OP_MOV:    return FORM2(MOV);
+		case OP_CMP:    return FORM2(CMP);
+		case OP_INC:    return H_INC;
+		case OP_DEC:    return H_DEC;
+		case OP_CALL:   return FORM1(CALL);
+		case OP_RET:    return H_RET;
+		case OP_PUSH:   return FORM1(PUSH);
+		case OP_PUSHF:  return H_PUSHF;
+		case OP_POPF:   return H_POPF;
+		case OP_POP:    return H_POP;
+		case OP_JMP:    return FORM1(JMP);
+		case OP_JNZ:    return FORM1(JNZ);
+		case OP_JZ:     return FORM1(JZ);
+		case OP_JS:     return FORM1(JS);
+		case OP_JNS:    return FORM1(JNS);
+		case OP_JGT:    return FORM1(JGT);
+		case OP_JLT:    return FORM1(JLT);
+		case OP_JPE:    return FORM1(JPE);
+		case OP_JPO:    return FORM1(JPO);
+		case OP_LEA:    return FORM1(LEA);
+		case OP_LOAD8:  return FORM1(LOAD8);
+		case OP_LOAD16: return FORM1(LOAD16);
+		case OP_LOAD32: return FORM1(LOAD32);
+		case OP_STORE8: return FORM1(STORE8);
+		case OP_STORE16: return FORM1(STORE16);
+		case OP_STORE32: return FORM1(STORE32);
+		case OP_INT:    return H_INT;
+		case OP_PRNT:   return H_PRNT;
+		case OP_DMP:    return H_DMP;
+		default:        return H_UNKNOWN;
+	}
+#undef FORM1
+#undef FORM2
+}
+
+// Decode a raw program word pair into its instruction_t.
+void DecodeInstruction(instruction_t *ins, const program_t *pr)
+{
+	ins->opcode = pr->opcode;
+	if (pr->opcode & OP_WIDE)
+	{
+		// Same fields, just 8 bits further up and without the immediate
+		DecodeOperand(ins, (pr->opcode >> 8) & 0xFFF00);
+		ins->imm = pr->operands;
+	}
+	else
+		DecodeOperand(ins, pr->operands);
+	ins->handler = SelectHandler(ins);
+	
+	// Anything that touches r4 directly needs the real flags
+	// worked out first.
+	if (ins->r0 == 4 || ins->r1 == 4)
+	{
+		ins->inner = ins->handler;
+		ins->handler = H_SYNCF;
+	}
 }
 
-// This does the opposite of the above function
-void DeallocateVM(vm_t *vm)
+// Pairs of instructions which are common enough to get their own
+// handler that runs both of them in a single dispatch. Build with
+// -DVM_PAIR_PROFILE to find out which pairs a workload actually runs.
+static const struct
+{
+	uint8_t first;
+	uint8_t second;
+	uint8_t fused;
+} Superinstructions[] = {
+	{ H_CMP_RR, H_JZ_I,   H_CMP_RR_JZ  },
+	{ H_CMP_RI, H_JZ_I,   H_CMP_RI_JZ  },
+	{ H_CMP_RR, H_JNZ_I,  H_CMP_RR_JNZ },
+	{ H_CMP_RI, H_JNZ_I,  H_CMP_RI_JNZ },
+	{ H_CMP_RR, H_JLT_I,  H_CMP_RR_JLT },
+	{ H_CMP_RI, H_JLT_I,  H_CMP_RI_JLT },
+	{ H_CMP_RR, H_JGT_I,  H_CMP_RR_JGT },
+	{ H_CMP_RI, H_JGT_I,  H_CMP_RI_JGT },
+	{ H_INC,    H_JZ_I,   H_INC_JZ     },
+	{ H_INC,    H_JNZ_I,  H_INC_JNZ    },
+	{ H_DEC,    H_JZ_I,   H_DEC_JZ     },
+	{ H_DEC,    H_JNZ_I,  H_DEC_JNZ    },
+	{ H_LOADI,  H_ADD_RR, H_LOADI_ADD_RR },
+	{ H_LOADI,  H_SUB_RR, H_LOADI_SUB_RR },
+};
+
+// The versions of the handlers which set the flags that don't, for
+// where the optimizer found nothing reads them.
+static const struct
+{
+	uint8_t handler;
+	uint8_t quiet;
+} QuietHandlers[] = {
+	{ H_ADD_RR, H_ADD_RR_NF }, { H_ADD_RI, H_ADD_RI_NF },
+	{ H_SUB_RR, H_SUB_RR_NF }, { H_SUB_RI, H_SUB_RI_NF },
+	{ H_MUL_RR, H_MUL_RR_NF }, { H_MUL_RI, H_MUL_RI_NF },
+	{ H_DIV_RR, H_DIV_RR_NF }, { H_DIV_RI, H_DIV_RI_NF },
+	{ H_XOR_RR, H_XOR_RR_NF }, { H_XOR_RI, H_XOR_RI_NF },
+	{ H_OR_RR,  H_OR_RR_NF  }, { H_OR_RI,  H_OR_RI_NF  },
+	{ H_AND_RR, H_AND_RR_NF }, { H_AND_RI, H_AND_RI_NF },
+	{ H_SHL_RR, H_SHL_RR_NF }, { H_SHL_RI, H_SHL_RI_NF },
+	{ H_SHR_RR, H_SHR_RR_NF }, { H_SHR_RI, H_SHR_RI_NF },
+	{ H_NOT_RR, H_NOT_RR_NF }, { H_NOT_RI, H_NOT_RI_NF },
+	{ H_MOV_RR, H_MOV_RR_NF }, { H_MOV_RI, H_MOV_RI_NF },
+	{ H_INC,    H_INC_NF    }, { H_DEC,    H_DEC_NF    },
+};
+
+// The flagless version of handler, H_COUNT if it has none
+uint8_t QuietHandler(uint8_t handler)
 {
-        free(vm->opstack);
-	for (size_t i = 0; i < vm->programLength; ++i)
-		free(vm->program[i]);
-        free(vm->program);
-        free(vm);
+	for (size_t j = 0; j < sizeof(QuietHandlers) / sizeof(*QuietHandlers); ++j)
+		if (QuietHandlers[j].handler == handler)
+			return QuietHandlers[j].quiet;
+	return H_COUNT;
 }
 
-// This deallocates a decoded instruction_t struct.
-void DeallocateInstruction(instruction_t *in)
+// The other way around, the handler itself if it isn't a quiet one
+static uint8_t LoudHandler(uint8_t handler)
 {
-	free(in->reg);
-	free(in);
+	for (size_t j = 0; j < sizeof(QuietHandlers) / sizeof(*QuietHandlers); ++j)
+		if (QuietHandlers[j].quiet == handler)
+			return QuietHandlers[j].handler;
+	return handler;
 }
 
-// This decodes the operands for the instruction
-// We pack the operands into a int32_t-sized char
-void DecodeOperand(instruction_t *ins, int32_t operand)
+// The handler an instruction would have without any superinstruction
+// fusion, BLOCK/SYNCF wrapping or flags left out. The JIT compiles
+// from this, which means it always sets the flags.
+uint8_t BaseHandler(const instruction_t *ins)
 {
-	registers_t *reg = malloc(sizeof(registers_t));
-	memset(reg, 0, sizeof(registers_t));
-	ins->type = (operand >> 16) & 0xF;
-	reg->r0   = (operand >> 12) & 0xF;
-	reg->r1   = (operand >>  8) & 0xF;
-	reg->r2   = (operand >>  4) & 0xF;
-	reg->imm  = (operand & 0xFF)     ;
-	ins->reg  = reg;
+	uint8_t handler = ins->handler == H_BLOCK ? ins->block : ins->handler;
+	if (handler == H_SYNCF)
+		handler = ins->inner;
+	
+	for (size_t j = 0; j < sizeof(Superinstructions) / sizeof(*Superinstructions); ++j)
+		if (Superinstructions[j].fused == handler)
+			return Superinstructions[j].first;
+	
+	return LoudHandler(handler);
 }
 
-// Decode an instruction from our program loaded in memory and 
-// translate that into a struct.
-instruction_t *DecodeInstruction(vm_t *vm)
+// Work out where the basic blocks of the program are. A block starts at
+// the start of the program, where it's entered, at every jump or call
+// target and right after anything that can go somewhere other than the
+// next instruction. left ends up as the number of instructions from each
+// instruction to the end of its block, so an instruction starts a block
+// exactly when the one before it has left == 1.
+void SplitBlocks(instruction_t *code, size_t len, size_t entry)
 {
-	if (++vm->ip > vm->programLength)
+	uint8_t *leader = calloc(len + 1, 1);
+	if (!leader)
 	{
-		fprintf(stderr, "Error: %s tried to run past length of program. Terminating.\n", vm->name);
-		vm->running = 0;
-		return NULL;
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", len + 1, strerror(errno));
+		exit(1);
 	}
 	
-	instruction_t *ins = malloc(sizeof(instruction_t));
-	memset(ins, 0, sizeof(instruction_t));
+	leader[len] = 1;
+	leader[entry] = 1;
+	for (size_t i = 0; i < len; ++i)
+	{
+		switch(BaseHandler(&code[i]))
+		{
+			case H_JMP_I:  case H_CALL_I:
+			case H_JNZ_I:  case H_JZ_I:  case H_JS_I:  case H_JNS_I:
+			case H_JGT_I:  case H_JLT_I: case H_JPE_I: case H_JPO_I:
+				leader[MIN((uint32_t)code[i].imm, len)] = 1;
+				// fall through
+			case H_JMP_R:  case H_CALL_R: case H_RET:
+			case H_JNZ_R:  case H_JZ_R:  case H_JS_R:  case H_JNS_R:
+			case H_JGT_R:  case H_JLT_R: case H_JPE_R: case H_JPO_R:
+			case H_HALT:   case H_UNUSED: case H_INT:
+				leader[i + 1] = 1;
+				break;
+			default:
+				break;
+		}
+	}
 	
-// 	printf("instruction pointer: %zu\n", vm->ip);
-	ins->opcode = vm->program[vm->ip]->opcode;
- 	printf("Running instruction \"0x%.4X\" of type %d at ip: %zu\n", ins->opcode, ins->type, vm->ip);
-	DecodeOperand(ins, vm->program[vm->ip]->operands);
+	code[len].left = 0;
+	for (size_t i = len; i-- > 0;)
+	{
+		// Really long blocks just get split up
+		if (code[i + 1].left == UINT16_MAX)
+			leader[i + 1] = 1;
+		code[i].left = leader[i + 1] ? 1 : code[i + 1].left + 1;
+	}
 	
-	return ins;
+	free(leader);
 }
 
-static inline int has_even_parity(uint32_t x)
+// Put a BLOCK in front of the first instruction of every basic block so
+// the fuel for the whole block is charged once when it's entered.
+void WrapBlocks(instruction_t *code, size_t len)
 {
-	uint32_t count = 0;
+	for (size_t i = 0; i < len; ++i)
+	{
+		if (i == 0 || code[i - 1].left == 1)
+		{
+			code[i].block = code[i].handler;
+			code[i].handler = H_BLOCK;
+		}
+	}
+}
+
+// Charge for running the rest of the block from ip, or if there isn't
+// enough fuel left stop the vm in front of it. Returns 0 when out of fuel.
+int ChargeFuel(vm_t *vm, size_t ip)
+{
+	uint16_t left = vm->code[ip].left;
 	
-	for(uint32_t i = 0; i < (sizeof(uint32_t) * CHAR_BIT); i++)
-		if(x & (1 << i))
-			count++;
+	if (vm->fuel < left)
+	{
+		vm->ip = ip;
+		vm->yielded = 1;
+		return 0;
+	}
 	
-	return !(count % 2);
+	vm->fuel -= left;
+	vm->retired += left;
+	vm->yielded = 0;
+	return 1;
 }
 
-// Check and make sure the last operation doesn't need
-// any new flags to be set.
-void CheckFlags(vm_t *vm, int32_t value)
+// Called before continuing a vm which may have run out of fuel. If it
+// stopped in front of a BLOCK that will charge when it runs, but if it
+// stopped after an indirect jump into the middle of a block the rest of
+// that block is paid for here.
+int ResumeFuel(vm_t *vm)
 {
-	if (value == 0)
-		SETFLAGS(vm->regs[4], FLAG_ZERO);
-	else
-		UNSETFLAGS(vm->regs[4], FLAG_ZERO);
-	
-	// Thanks stackoverflow! Anyway, this checks if the integer is strictly positive
-	// see http://stackoverflow.com/a/3731575 for more.
-	uint32_t u = (uint32_t)value;
-	int32_t strictly_positive = (-u & ~u) >> ((sizeof(int) * CHAR_BIT) - 1);
-	// Set the sign flag depending on the signedness of the integer.
-	if (strictly_positive)
-		UNSETFLAGS(vm->regs[4], FLAG_SIGN);
-	else
-		SETFLAGS(vm->regs[4], FLAG_SIGN);
+	if (!vm->yielded)
+		return 1;
 	
-	// Set parity flag
-	if (has_even_parity(value))
-		SETFLAGS(vm->regs[4], FLAG_PARITY);
-	else
-		UNSETFLAGS(vm->regs[4], FLAG_PARITY);
+	size_t ip = MIN(vm->ip, vm->programLength);
+	if (vm->code[ip].handler == H_BLOCK)
+	{
+		vm->yielded = 0;
+		return 1;
+	}
 	
-	// TODO:
-	//     implement FLAG_CARRY
-	//     implement FLAG_OVERFLOW
+	return ChargeFuel(vm, ip);
 }
 
-void interpret(vm_t *vm)
+// Replace common instruction pairs with a superinstruction. Only the
+// first instruction of a pair is rewritten, the fused handler reads the
+// second one's operands straight out of the next slot and then skips
+// it. That slot is left as it was so anything jumping into the middle
+// of a pair still runs just the second instruction. Pairs split across
+// two basic blocks are left alone so the second block still gets charged.
+// A superinstruction always sets the flags, it's still worth it for a
+// second instruction whose flags the optimizer left out.
+void FuseInstructions(instruction_t *code, size_t len)
 {
-        // load 2-words (8 bytes) of data and interpret it
-        // first word is the instruction and the second is
-        // the operands for that instruction. This allows
-        // for more registers to be used.
-	instruction_t *ins = DecodeInstruction(vm);
-	
-	// In case we get an invalid length or something.
-	if (!ins)
+	for (size_t i = 0; i + 1 < len; ++i)
+	{
+		if (code[i].left == 1)
+			continue;
+		
+		for (size_t j = 0; j < sizeof(Superinstructions) / sizeof(*Superinstructions); ++j)
+		{
+			if (code[i].handler == Superinstructions[j].first &&
+			    LoudHandler(code[i + 1].handler) == Superinstructions[j].second)
+			{
+				code[i].handler = Superinstructions[j].fused;
+				break;
+			}
+		}
+	}
+}
+
+// Pick the dispatch engine. Where the compiler supports taking the
+// address of a label we use direct-threaded dispatch (one indirect
+// branch per guest instruction), otherwise -- or when built with
+// -DVM_SWITCH_DISPATCH so the two can be benchmarked against each
+// other -- we fall back to a plain portable switch() loop.
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+# define VM_COMPUTED_GOTO 1
+#endif
+
+// Fetch the next instruction and advance the instruction pointer past
+// it. ip always holds the index of the next instruction to run.
+#define FETCH() do { \
+	ins = &code[ip++]; \
+	TRACE(vm, ip - 1, ins); \
+	PROFILE_PAIR(); \
+	PROFILE_FETCH(); \
+} while(0)
+
+#ifdef VM_PROFILE
+// Charge the cycles since the last fetch to the instruction fetched
+// then and count this one.
+# define PROFILE_FETCH() do { \
+	uint64_t now_ = ProfileClock(); \
+	if (profAt != SIZE_MAX) \
+		vm->profile[profAt].cycles += now_ - profLast; \
+	profLast = now_; \
+	profAt = ip - 1; \
+	vm->profile[profAt].count++; \
+} while(0)
+// Whether the conditional jump at instruction at went anywhere
+# define PROFILE_BRANCH(at, went) do { \
+	if (went) \
+		vm->profile[at].taken++; \
+	else \
+		vm->profile[at].notTaken++; \
+} while(0)
+#else
+# define PROFILE_FETCH() do { } while(0)
+# define PROFILE_BRANCH(at, went) do { } while(0)
+#endif
+
+#ifdef VM_PAIR_PROFILE
+// Count which handler ran right before this one.
+# define PROFILE_PAIR() do { \
+	uint8_t cur = BaseHandler(ins); \
+	vm->pairCounts[prev * H_COUNT + cur]++; \
+	prev = cur; \
+} while(0)
+#else
+# define PROFILE_PAIR() do { } while(0)
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+# define HANDLER(name) L_##name:
+# define REDISPATCH(h) __extension__ ({ goto *handlers[(h)]; })
+# define NEXT() do { if (single) goto done; FETCH(); REDISPATCH(ins->handler); } while(0)
+#else
+# define HANDLER(name) case H_##name:
+# define REDISPATCH(h) do { handler = (h); goto redispatch; } while(0)
+# define NEXT() goto next
+#endif
+
+// Record the flags for an operation without computing them
+#define FLAGS(op, res, a, b) do { \
+	vm->lazyOp = (op); \
+	vm->lazyResult = (res); \
+	vm->lazyA = (a); \
+	vm->lazyB = (b); \
+} while(0)
+
+// Stop running the program and leave interpret()
+#define STOP() do { vm->running = 0; goto done; } while(0)
+
+// Stop because the program did something it can't continue from. The
+// instruction that did it never ran, so give back what was charged for
+// it and the rest of its block.
+#define TRAP(why) do { fuel += ins->left; vm->trap = (why); STOP(); } while(0)
+
+// Pay for the block starting at instruction at, if there's not enough
+// fuel left stop in front of it.
+#define CHARGE(at, n) do { \
+	if (fuel < (n)) \
+	{ \
+		ip = (at); \
+		vm->yielded = 1; \
+		goto done; \
+	} \
+	fuel -= (n); \
+} while(0)
+
+// Programs the verifier couldn't bound the stack of check every push
+// and pop instead.
+#define STACK_CHECK(bad, what, why) do { \
+	if (checked && (bad)) \
+	{ \
+		fprintf(stderr, "Error: %s stack " what ". Terminating.\n", vm->name); \
+		TRAP(why); \
+	} \
+} while(0)
+
+// Push onto the stack, remembering how far up it has been used so a
+// recycled vm only has to clear that much.
+#define PUSH(value) do { \
+	STACK_CHECK((uint32_t)regs[3] >= MAX_STACK, "overflow", TRAP_STACK_OVERFLOW); \
+	vm->opstack[regs[3]++] = (value); \
+	if ((uint32_t)regs[3] > vm->stackHigh) \
+		vm->stackHigh = regs[3]; \
+} while(0)
+
+// Take the top value off the stack
+#define POP(dst) do { \
+	STACK_CHECK((uint32_t)regs[3] - 1 >= MAX_STACK, "underflow", TRAP_STACK_UNDERFLOW); \
+	(dst) = vm->opstack[--regs[3]]; \
+} while(0)
+
+// Jump to an absolute instruction, the verifier has already made sure
+// it's inside the program.
+#define JUMP(target) do { \
+	ip = (uint32_t)(target); \
+	NEXT(); \
+} while(0)
+
+// Jump to a computed instruction. Immediate targets always start a
+// block but these can land anywhere, so pay for the rest of the block
+// if it doesn't start with a BLOCK that will.
+#define JUMP_INDIRECT(target) do { \
+	ip = (uint32_t)(target); \
+	if (ip > len) \
+		ip = len; \
+	if (code[ip].handler != H_BLOCK) \
+		CHARGE(ip, code[ip].left); \
+	NEXT(); \
+} while(0)
+
+// For the _NF handlers, which leave the flags for the optimizer
+#define NO_FLAGS(op, res, a, b) do { (void)(a); (void)(b); } while(0)
+
+// Without the flags to store GCC turns r0 += x into a single add to
+// memory, which the next instruction reading r0 has to wait a lot
+// longer on than a plain load, add and store. Hiding the result from
+// it keeps those apart.
+#ifdef __GNUC__
+# define IN_REGISTER(x) __asm__("" : "+r"(x))
+#else
+# define IN_REGISTER(x) do { } while(0)
+#endif
+
+// Arithmetic/bitwise opcodes: r0 = r0 <op> (r1 or imm)
+#define ALU(name, op, expr) \
+	ALU_FORMS(name, , op, expr, FLAGS) \
+	ALU_FORMS(name, _NF, op, expr, NO_FLAGS)
+#define ALU_FORMS(name, nf, op, expr, flags) \
+	HANDLER(name##_RR##nf) { int32_t a = regs[ins->r0], b = regs[ins->r1]; ALU_BODY(op, expr, flags) } \
+	HANDLER(name##_RI##nf) { int32_t a = regs[ins->r0], b = ins->imm;      ALU_BODY(op, expr, flags) }
+#define ALU_BODY(op, expr, flags) \
+	int32_t res = (expr); \
+	IN_REGISTER(res); \
+	regs[ins->r0] = res; \
+	flags(op, res, a, b); \
+	NEXT();
+
+// Division needs an additional check to make sure nothing divides by zero
+#define DIV(name, divisor, flags) \
+	HANDLER(name) \
+	{ \
+		int32_t a = regs[ins->r0], b = (divisor); \
+		if (b == 0) \
+			fprintf(stderr, "Program attempted to divide by zero!\n"); \
+		else if (b == -1) \
+			regs[ins->r0] = (int32_t)(0u - (uint32_t)a); /* INT_MIN / -1 would trap */ \
+		else \
+			regs[ins->r0] = a / b; \
+		flags(LAZY_LOGIC, regs[ins->r0], a, b); \
+		NEXT(); \
+	}
+
+// INC/DEC, with or without the flags
+#define INCDEC(name, op, sign, flags) \
+	HANDLER(name) \
+	{ \
+		int32_t a = regs[ins->r0]; \
+		int32_t res = (int32_t)((uint32_t)a sign 1); \
+		IN_REGISTER(res); \
+		regs[ins->r0] = res; \
+		flags(op, res, a, 1); \
+		NEXT(); \
+	}
+
+// Conditional jumps to either a register or an immediate location
+#define JCC(name, cond) \
+	HANDLER(name##_R) { int taken = (cond); PROFILE_BRANCH(ip - 1, taken); if (taken) JUMP_INDIRECT(regs[ins->r0]); NEXT(); } \
+	HANDLER(name##_I) { int taken = (cond); PROFILE_BRANCH(ip - 1, taken); if (taken) JUMP(ins->imm); NEXT(); }
+
+// CMP followed by a conditional jump to an immediate location
+#define CMP_JCC(jcc, cond) \
+	HANDLER(CMP_RR_##jcc) { int32_t a = regs[ins->r0], b = regs[ins->r1]; CMP_JCC_BODY(cond) } \
+	HANDLER(CMP_RI_##jcc) { int32_t a = regs[ins->r0], b = ins->imm;      CMP_JCC_BODY(cond) }
+#define CMP_JCC_BODY(cond) \
+	FLAGS(LAZY_SUB, (int32_t)((uint32_t)a - (uint32_t)b), a, b); \
+	PROFILE_BRANCH(ip, cond); \
+	if (cond) \
+		JUMP(ins[1].imm); \
+	ip++; \
+	NEXT();
+
+// INC/DEC followed by a conditional jump to an immediate location
+#define INCDEC_JCC(name, op, sign, jcc, cond) \
+	HANDLER(name##_##jcc) \
+	{ \
+		int32_t a = regs[ins->r0]; \
+		int32_t res = (int32_t)((uint32_t)a sign 1); \
+		regs[ins->r0] = res; \
+		FLAGS(op, res, a, 1); \
+		PROFILE_BRANCH(ip, cond); \
+		if (cond) \
+			JUMP(ins[1].imm); \
+		ip++; \
+		NEXT(); \
+	}
+
+// LOADI followed by a register form ADD/SUB
+#define LOADI_ALU(name, op, sign) \
+	HANDLER(LOADI_##name##_RR) \
+	{ \
+		regs[ins->r0] = ins->imm; \
+		int32_t a = regs[ins[1].r0], b = regs[ins[1].r1]; \
+		regs[ins[1].r0] = (int32_t)((uint32_t)a sign (uint32_t)b); \
+		FLAGS(op, regs[ins[1].r0], a, b); \
+		ip++; \
+		NEXT(); \
+	}
+
+// Linear memory. The register forms address a register plus the
+// immediate, the immediate forms just the immediate, either way the
+// address wraps at 32 bits like any other guest arithmetic. With
+// VM_MEMORY_GUARD the address isn't checked at all: an access outside
+// the program's memory faults and memory.c jumps back out to Run()
+// below, so where the access was made has to be in the vm first.
+#ifdef VM_MEMORY_GUARD
+# define ACCESS(at, width) do { \
+	vm->accessIp = ip - 1; \
+	vm->accessFuel = fuel; \
+	atomic_signal_fence(memory_order_seq_cst); \
+} while(0)
+#else
+# define ACCESS(at, width) do { \
+	if ((uint64_t)(at) + (width) > vm->memorySize) \
+	{ \
+		fprintf(stderr, "Error: %s accessed memory outside of its %" PRIu64 " bytes at instruction %zu. Terminating.\n", \
+			vm->name, vm->memorySize, ip - 1); \
+		ip--; \
+		TRAP(TRAP_MEMORY); \
+	} \
+} while(0)
+#endif
+
+#define MEMORY(name, body) \
+	HANDLER(name##_R) { uint32_t at = (uint32_t)regs[ins->r1] + (uint32_t)ins->imm; body } \
+	HANDLER(name##_I) { uint32_t at = (uint32_t)ins->imm; body }
+
+// Narrow loads are zero extended
+#define LOAD(name, type) MEMORY(name, \
+	type value; \
+	ACCESS(at, sizeof(type)); \
+	memcpy(&value, memory + at, sizeof(type)); \
+	regs[ins->r0] = (int32_t)value; \
+	NEXT(); \
+)
+
+#define STORE(name, type) MEMORY(name, \
+	type value = (type)regs[ins->r0]; \
+	ACCESS(at, sizeof(type)); \
+	memcpy(memory + at, &value, sizeof(type)); \
+	NEXT(); \
+)
+
+// Run the program loaded in the vm until it halts or hits an error.
+// With single set only one instruction (or superinstruction) is run,
+// that's what the JIT uses for anything it doesn't compile itself.
+// It's only ever called with a constant so the check in NEXT() is
+// folded away by the compiler. checked keeps the stack checks for
+// programs the verifier couldn't bound, it never changes while running
+// so that branch always predicts.
+#ifdef __GNUC__
+// Run() calls sigsetjmp(), which makes the compiler pessimize whatever
+// it's in, so this mustn't be inlined into it.
+__attribute__((noinline))
+#endif
+static void Interpret(vm_t *vm, int single, int checked)
+{
+	// Still out of fuel
+	if (!ResumeFuel(vm))
 		return;
 	
-        switch(ins->opcode)
-        {
-		case OP_UNUSED:
+	int32_t *regs = vm->regs;
+	const instruction_t *code = vm->code;
+	const instruction_t *ins;
+	size_t len = vm->programLength;
+	size_t ip = vm->ip;
+	uint64_t fuel = vm->fuel;
+	uint8_t *memory = vm->memory;
+#ifndef VM_COMPUTED_GOTO
+	uint8_t handler;
+#endif
+#ifdef VM_PAIR_PROFILE
+	uint8_t prev = H_NOP;
+#endif
+#ifdef VM_PROFILE
+	size_t profAt = SIZE_MAX;
+	uint64_t profLast = 0;
+#endif
+	
+	// Anything outside of the program runs the END sentinel.
+	if (ip > len)
+		ip = len;
+	
+#ifdef VM_COMPUTED_GOTO
+	__extension__ static const void *const handlers[H_COUNT] = {
+# define X(name) [H_##name] = &&L_##name,
+		HANDLERS(X)
+# undef X
+	};
+	
+	FETCH();
+	REDISPATCH(ins->handler);
+#else
+	goto first;
+next:
+	if (single)
+		goto done;
+first:
+	FETCH();
+	handler = ins->handler;
+redispatch:
+	switch(handler)
+	{
+#endif
+		HANDLER(UNUSED)
 			// ignore but print warning
-			printf("Unused ovm->ipode encountered... terminating!\n");
-			vm->running = 0;
-		case OP_NOP:
+			printf("Unused opcode encountered... terminating!\n");
+			TRAP(TRAP_UNUSED);
+		HANDLER(NOP)
 			// No-Operation
-			break;
-		case OP_HALT:
+			NEXT();
+		HANDLER(HALT)
 			// halt the program
-			vm->running = 0;
-			break;
-		case OP_LOADI:
+			STOP();
+		HANDLER(LOADI)
 			// load static value into register
-			// 			printf("loadi r%d #%d\n", ins->reg->r0, ins->reg->imm);
-			vm->regs[ins->reg->r0] = ins->reg->imm;
-			break;
-		case OP_ADD:
-			// Add values together
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] += ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] += vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_SUB:
-			// Subtract values
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] -= ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] -= vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_DIV:
-			// Divide values
-			// because math is fucking stupid I have to
-			// have an additional fucking check to make sure
-			// none of this shit divides by zero
-			if (ins->type == OP_FLAG_IMMEDIATE)
-			{
-				if (vm->regs[ins->reg->r0] == 0 || ins->reg->imm == 0)
-					fprintf(stderr, "Program attempted to divide by zero!\n");
-				else
-					vm->regs[ins->reg->r0] /= ins->reg->imm;
-			}
-			else if(ins->type == OP_FLAG_REGISTER)
-			{
-				if (vm->regs[ins->reg->r0] == 0 || vm->regs[ins->reg->r1] == 0)
-					fprintf(stderr, "Program attempted to divide by zero!\n");
-				else
-					vm->regs[ins->reg->r0] /= vm->regs[ins->reg->r1];
-			}
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_XOR:
-			// xor 2 registers
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] ^= ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] ^= vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_NOT:
-			// bitwise not register
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] = ~ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] = ~vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_OR:
-			// bitwise or registers
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] |= ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] |= vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_AND:
-			// bitwise and registers
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] &= ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] &= vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_SHL:
-			// bitshift left
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] <<= ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] <<= vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_SHR:
-			// bitshift right
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] >>= ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] >>= vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_INC:
-			// increment register
-			vm->regs[ins->reg->r0]++;
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_DEC:
-			// decrement register
-			vm->regs[ins->reg->r0]--;
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_CMP:
-			// compare 2 registers together
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				CheckFlags(vm, (vm->regs[ins->reg->r0] == ins->reg->imm));
-			else if(ins->type == OP_FLAG_REGISTER)
-				CheckFlags(vm, (vm->regs[ins->reg->r0] == vm->regs[ins->reg->r1]));
-			break;
-		case OP_MOV:
-			// move values from register to register
-			// (and register to stack when stack implemented)
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->regs[ins->reg->r0] = ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->regs[ins->reg->r0] = vm->regs[ins->reg->r1];
-			CheckFlags(vm, vm->regs[ins->reg->r0]);
-			break;
-		case OP_CALL:
+			regs[ins->r0] = ins->imm;
+			NEXT();
+		
+		// The arithmetic is done unsigned so overflow wraps instead of
+		// being undefined, shift counts are masked to the register width.
+		ALU(ADD, LAZY_ADD,   (int32_t)((uint32_t)a + (uint32_t)b))
+		ALU(SUB, LAZY_SUB,   (int32_t)((uint32_t)a - (uint32_t)b))
+		ALU(MUL, LAZY_MUL,   (int32_t)((uint32_t)a * (uint32_t)b))
+		ALU(XOR, LAZY_LOGIC, a ^ b)
+		ALU(OR,  LAZY_LOGIC, a | b)
+		ALU(AND, LAZY_LOGIC, a & b)
+		ALU(SHL, LAZY_LOGIC, (int32_t)((uint32_t)a << (b & 31)))
+		ALU(SHR, LAZY_LOGIC, a >> (b & 31))
+		ALU(NOT, LAZY_LOGIC, ~b)
+		ALU(MOV, LAZY_LOGIC, b)
+		DIV(DIV_RR, regs[ins->r1], FLAGS)
+		DIV(DIV_RI, ins->imm, FLAGS)
+		DIV(DIV_RR_NF, regs[ins->r1], NO_FLAGS)
+		DIV(DIV_RI_NF, ins->imm, NO_FLAGS)
+		
+		// increment/decrement register
+		INCDEC(INC, LAZY_ADD, +, FLAGS)
+		INCDEC(DEC, LAZY_SUB, -, FLAGS)
+		INCDEC(INC_NF, LAZY_ADD, +, NO_FLAGS)
+		INCDEC(DEC_NF, LAZY_SUB, -, NO_FLAGS)
+		HANDLER(CMP_RR)
+		{
+			// compare 2 registers together by subtracting them
+			// and throwing away the result, just like x86 does.
+			int32_t a = regs[ins->r0], b = regs[ins->r1];
+			FLAGS(LAZY_SUB, (int32_t)((uint32_t)a - (uint32_t)b), a, b);
+			NEXT();
+		}
+		HANDLER(CMP_RI)
+		{
+			int32_t a = regs[ins->r0], b = ins->imm;
+			FLAGS(LAZY_SUB, (int32_t)((uint32_t)a - (uint32_t)b), a, b);
+			NEXT();
+		}
+		
+		HANDLER(CALL_R)
 			// Call a section of code.
 			// This is basically a push + jmp call in one.
-			
-			// put the instruction pointer + 1 (the +1 is so when we
-			// return, we're not gonna jump into the same call statement)
-			// onto the stack then increment the stack pointer.
-			vm->opstack[vm->regs[3]++] = vm->ip+1;
-			
-			// Jump in the switch statement to OP_JMP
-			goto jmpopcode;
-		case OP_RET:
+			// ip has already been advanced past the call so
+			// we don't jump into the same call statement when
+			// we return.
+			PUSH(ip);
+			JUMP_INDIRECT(regs[ins->r0]);
+		HANDLER(CALL_I)
+			PUSH(ip);
+			JUMP(ins->imm);
+		HANDLER(RET)
+		{
 			// This the opposite of call.
-			// Get the previous run position from stack and decrement the stack pointer.
-			vm->ip = vm->opstack[vm->regs[3]--];
-			break; // return, next iteration by CPU will be at new position
-		case OP_PUSH:
+			// Decrement the stack pointer and get the previous run position from stack.
+			unsigned to;
+			POP(to);
+			JUMP_INDIRECT(to);
+		}
+		HANDLER(PUSH_R)
 			// Push value onto stack
-			// we'll treat register 4 as the stack pointer.
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->opstack[vm->regs[3]] = ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->opstack[vm->regs[3]] = vm->regs[ins->reg->r0];
-
-			vm->regs[3]++;
-			break;
-		case OP_PUSHF:
+			// we'll treat register 3 as the stack pointer.
+			PUSH(regs[ins->r0]);
+			NEXT();
+		HANDLER(PUSH_I)
+			PUSH(ins->imm);
+			NEXT();
+		HANDLER(PUSHF)
 			// Push the flags register to the stack
-			vm->opstack[vm->regs[3]++] = vm->regs[4];
-			break;
-		case OP_POP:
+			MaterializeFlags(vm);
+			PUSH(regs[4]);
+			NEXT();
+		HANDLER(POPF)
+			// Pop the flags register from the stack
+			POP(regs[4]);
+			vm->lazyOp = LAZY_NONE;
+			NEXT();
+		HANDLER(SYNCF)
+			// This instruction reads or writes r4 directly so bring
+			// the flags up to date before running the real handler.
+			MaterializeFlags(vm);
+			REDISPATCH(ins->inner);
+		HANDLER(BLOCK)
+			// First instruction of a basic block, pay for all of it
+			CHARGE(ip - 1, ins->left);
+			REDISPATCH(ins->block);
+		HANDLER(POP)
 			// pop value from stack
-			vm->regs[ins->reg->r0] = vm->opstack[vm->regs[3]--];
-			break;
-		case OP_JMP:
-jmpopcode:		// Jump always -- other conditional jumps go here for cleanness
-			if (ins->type == OP_FLAG_IMMEDIATE)
-				vm->ip = ins->reg->imm;
-			else if(ins->type == OP_FLAG_REGISTER)
-				vm->ip = vm->regs[ins->reg->r0];
-			break;
-		case OP_JNZ:
-			// Jump if not zero
-			if (!(vm->regs[4] & FLAG_ZERO))
-				goto jmpopcode;
-			break;
-		case OP_JZ:
-			// Jump if zero
-			if (vm->regs[4] & FLAG_ZERO)
-				goto jmpopcode;
-			break;
-		case OP_JS:
-			// Jump if sign flag is set
-			if (vm->regs[4] & FLAG_SIGN)
-				goto jmpopcode;
-			break;
-		case OP_JNS:
-			// jump if sign flag is not set
-			if (!(vm->regs[4] & FLAG_SIGN))
-				goto jmpopcode;
-			break;
-		case OP_JGT:
-			// jump if value is greater than zero
-			if ((vm->regs[4] & FLAG_ZERO) || (!(vm->regs[4] & FLAG_SIGN) && !(vm->regs[4] & FLAG_OVERFLOW)))
-				goto jmpopcode;
-			break;
-		case OP_JLT:
-			// Jump if value is less than zero
-			if ((vm->regs[4] & FLAG_SIGN) || (vm->regs[4] & FLAG_OVERFLOW))
-				goto jmpopcode;
-			break;
-		case OP_JPE:
-			// Jump if parity is even
-			if (vm->regs[4] & FLAG_PARITY)
-				goto jmpopcode;
-			break;
-		case OP_JPO:
-			// Jump if parity is odd
-			if (!(vm->regs[4] & FLAG_PARITY))
-				goto jmpopcode;
-			break;
-		case OP_LEA:
-		case OP_INT:
+			POP(regs[ins->r0]);
+			NEXT();
+		
+		HANDLER(JMP_R)
+			// Jump always
+			JUMP_INDIRECT(regs[ins->r0]);
+		HANDLER(JMP_I)
+			JUMP(ins->imm);
+		JCC(JNZ, !ReadFlags(vm, FLAG_ZERO))
+		JCC(JZ,  ReadFlags(vm, FLAG_ZERO))
+		JCC(JS,  ReadFlags(vm, FLAG_SIGN))
+		JCC(JNS, !ReadFlags(vm, FLAG_SIGN))
+		JCC(JGT, JGT_TAKEN(ReadFlags(vm, FLAG_ZERO | FLAG_SIGN | FLAG_OVERFLOW)))
+		JCC(JLT, JLT_TAKEN(ReadFlags(vm, FLAG_SIGN | FLAG_OVERFLOW)))
+		JCC(JPE, ReadFlags(vm, FLAG_PARITY))
+		JCC(JPO, !ReadFlags(vm, FLAG_PARITY))
+		
+		HANDLER(LEA_R)
+			// Address arithmetic, it doesn't touch the flags
+			regs[ins->r0] = (int32_t)((uint32_t)regs[ins->r1] + (uint32_t)ins->imm);
+			NEXT();
+		HANDLER(LEA_I)
+			regs[ins->r0] = ins->imm;
+			NEXT();
+		LOAD(LOAD8, uint8_t)
+		LOAD(LOAD16, uint16_t)
+		LOAD(LOAD32, uint32_t)
+		STORE(STORE8, uint8_t)
+		STORE(STORE16, uint16_t)
+		STORE(STORE32, uint32_t)
+		
+		HANDLER(INT)
+			// System call, the vm stops after the INT until it's
+			// been made (see io.c). It ends a block so whatever's
+			// after it gets charged for when the vm goes on.
+			vm->syscall = ins->imm;
+			vm->waiting = 1;
+			goto done;
+		
+		HANDLER(UNIMPL)
 			printf("Ignoring unimplemented opcode %d\n", ins->opcode);
-			break;
+			NEXT();
+		
+		// Extended opcode which will later be removed.
+		HANDLER(PRNT)
+			printf("r%d: %d\n", ins->r0, regs[ins->r0]);
+			NEXT();
+		HANDLER(DMP)
+			printf("Registers:\nr0: %d\nr1: %d\nr2: %d\nr3: %d\n", regs[0], regs[1], regs[2], regs[3]);
+			NEXT();
+		HANDLER(UNKNOWN)
+			printf("Unknown opcode 0x%x!\n", ins->opcode);
+			NEXT();
+		
+		// Superinstructions. ins[1] is the second instruction of the
+		// pair which gets skipped once both have run.
+		CMP_JCC(JZ,  a == b)
+		CMP_JCC(JNZ, a != b)
+		CMP_JCC(JLT, a < b)
+		CMP_JCC(JGT, a > b)
+		INCDEC_JCC(INC, LAZY_ADD, +, JZ,  res == 0)
+		INCDEC_JCC(INC, LAZY_ADD, +, JNZ, res != 0)
+		INCDEC_JCC(DEC, LAZY_SUB, -, JZ,  res == 0)
+		INCDEC_JCC(DEC, LAZY_SUB, -, JNZ, res != 0)
+		LOADI_ALU(ADD, LAZY_ADD, +)
+		LOADI_ALU(SUB, LAZY_SUB, -)
+		
+		HANDLER(END)
+			// Sentinel placed just past the end of the program.
+			fprintf(stderr, "Error: %s tried to run past length of program. Terminating.\n", vm->name);
+			ip = len;
+			TRAP(TRAP_PAST_END);
+#ifndef VM_COMPUTED_GOTO
+	}
+#endif
 
-			// Extended opcode which will later be removed.
-		case OP_PRNT:
-			printf("r%d: %d\n", ins->reg->r0, vm->regs[ins->reg->r0]);
-			break;
-		case OP_DMP:
-			printf("Registers:\nr0: %d\nr1: %d\nr2: %d\nr3: %d\n", vm->regs[0], vm->regs[1], vm->regs[2], vm->regs[3]);
-			break;
-                default:
-                        printf("Unknown opcode 0x%x!\n", ins->opcode);
-        };
-	
-	// Deallocate our instruction we used.
-	DeallocateInstruction(ins);
+done:
+#ifdef VM_PROFILE
+	if (profAt != SIZE_MAX)
+		vm->profile[profAt].cycles += ProfileClock() - profLast;
+#endif
+	vm->ip = ip;
+	vm->retired += vm->fuel - fuel;
+	vm->fuel = fuel;
+	// Leave r4 exact for whoever looks at the vm next.
+	MaterializeFlags(vm);
 }
 
-// A mutex to make sure we don't cause any issues when
-// changing the linked list.
-mtx_t listmutex;
+#ifdef VM_MEMORY_GUARD
+// A memory access faulted. Stop the vm there, leaving it just like
+// Interpret() would have.
+static void MemoryFault(vm_t *vm)
+{
+	UnguardMemory();
+	fprintf(stderr, "Error: %s accessed memory outside of its %" PRIu64 " bytes at instruction %zu. Terminating.\n",
+		vm->name, vm->memorySize, vm->accessIp);
+	vm->ip = vm->accessIp;
+	// Like TRAP(), the rest of the block never ran
+	uint64_t fuel = vm->accessFuel + vm->code[vm->accessIp].left;
+	vm->retired += vm->fuel - fuel;
+	vm->fuel = fuel;
+	vm->yielded = 0;
+	vm->running = 0;
+	vm->trap = TRAP_MEMORY;
+	MaterializeFlags(vm);
+}
+#endif
+
+// Interpret() with somewhere for memory faults to go for programs that
+// have memory.
+static void Run(vm_t *vm, int single, int checked)
+{
+#ifdef VM_MEMORY_GUARD
+	if (vm->memory)
+	{
+		if (sigsetjmp(*GuardMemory(vm), 0))
+		{
+			MemoryFault(vm);
+			return;
+		}
+		Interpret(vm, single, checked);
+		UnguardMemory();
+		return;
+	}
+#endif
+	Interpret(vm, single, checked);
+}
 
-// Our linked list
-vm_t *first = NULL, *prev = NULL;
+void interpret(vm_t *vm)
+{
+	Run(vm, 0, !StackVerified(vm));
+}
 
-// This is the thread function used to
-// decode the program
-void DecodeThread(void *ptr)
+void InterpretOne(vm_t *vm)
 {
-	vm_t *me = (vm_t*)ptr;
-	// While the vm is still running
-	// decode each instruction and 
-	// run it.
-	while(me->running)
-		interpret(me);
+	Run(vm, 1, 1);
+}
 
-	// Modify the linked list so we can remove ourselves
-	// from the list.
-	mtx_lock(&listmutex);
+#ifdef VM_PAIR_PROFILE
+// Print the most frequently executed handler pairs of a vm
+void ReportPairs(const vm_t *vm)
+{
+	fprintf(stderr, "Most frequent instruction pairs for %s:\n", vm->name);
 	
-	// Iterate through the linked list, we're going to remove ourselves
-	// from the list so we can deallocate.
-	for (vm_t *vm = first, *prevvm = NULL; vm; prevvm = vm, vm = vm->next)
+	// Just pick the top entries one at a time, the table isn't big.
+	uint64_t last = UINT64_MAX;
+	size_t shown = 0;
+	while (shown < 20)
 	{
-		// If we've found ourselves
-		if (vm == me)
+		uint64_t best = 0;
+		for (size_t i = 0; i < H_COUNT * H_COUNT; ++i)
+			if (vm->pairCounts[i] < last && vm->pairCounts[i] > best)
+				best = vm->pairCounts[i];
+		
+		if (!best)
+			break;
+		
+		for (size_t i = 0; i < H_COUNT * H_COUNT && shown < 20; ++i)
 		{
-			// if we're first, set the first global var to
-			// the next vm in the list
-			if (me == first)
-				first = me->next;
-			else
-				// Tack together the previous vm to the next.
-				prevvm->next = me->next;
+			if (vm->pairCounts[i] != best)
+				continue;
+			fprintf(stderr, "%12" PRIu64 "  %s -> %s\n", best, HandlerNames[i / H_COUNT], HandlerNames[i % H_COUNT]);
+			shown++;
 		}
+		last = best;
 	}
-	
-	// Make sure our pointer is unusable
-	me->next = NULL;
+}
+#endif
 
-	// Unlock our mutex.
-	mtx_unlock(&listmutex);
+#ifdef VM_TRACE
+// Save the vm's trace ring to <program>.trace, oldest record first.
+// Read it back with playvm-tracedump.
+void WriteTrace(const vm_t *vm)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s.trace", vm->name);
+	
+	FILE *f = fopen(path, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Failed to write trace %s: %s\n", path, strerror(errno));
+		return;
+	}
+	
+	uint64_t head = atomic_load_explicit(&vm->trace->head, memory_order_acquire);
+	trace_header_t header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.recordSize = sizeof(trace_record_t),
+		.total = head,
+		.count = MIN(head, VM_TRACE_RECORDS)
+	};
+	fwrite(&header, sizeof(header), 1, f);
 	
-	// Deallocate ourselves
-	DeallocateVM(me);
+	for (uint64_t i = head - header.count; i < head; ++i)
+		fwrite(&vm->trace->records[i & (VM_TRACE_RECORDS - 1)], sizeof(trace_record_t), 1, f);
 	
-	// Exit the thread
-	thrd_exit(0);
+	fclose(f);
+	fprintf(stderr, "Wrote %" PRIu64 " trace records for %s to %s\n", header.count, vm->name, path);
 }
+#endif
 
-// Decode and compile the data into the struct above
-void CompileVM(vm_t *vm, char *data, size_t len)
+// Run the program until it halts, errors out, runs out of fuel or
+// stops at a system call. The scheduler makes those in the background
+// (see io.c), vm->waiting is set until then.
+void RunUntilSyscall(vm_t *vm)
 {
-	// This loop is a bit lopsided because we're going from a char
-	// (which is 1 byte) to two int32_t's (int32_t * 2 = 8 bytes).
-	// So we may crash in this loop. Not sure how to handle this.
+	if (vm->jit)
+		RunJIT(vm);
+	else
+		interpret(vm);
+}
+
+// Run the program until it halts, errors out or runs out of fuel,
+// making any system calls as it goes. A vm which ran out of fuel can
+// be given more and run again.
+void RunVM(vm_t *vm)
+{
+	RunUntilSyscall(vm);
+	while (vm->waiting)
+	{
+		Syscall(vm);
+		RunUntilSyscall(vm);
+	}
+}
 
+// Set by --check-modules, checksum every module as it's loaded instead
+// of just checking its header
+static int checkModules = 0;
+
+// Set by --snapshot, a vm which runs out of fuel is saved to
+// <program>.snap so it can be carried on from with --restore
+static int saveSnapshots = 0;
+
+// Called by the scheduler once a vm is finished for good
+void RetireVM(vm_t *me)
+{
+	if (me->yielded)
+		printf("%s ran out of fuel after %" PRIu64 " instructions\n", me->name, me->retired);
+	else
+		printf("%s retired %" PRIu64 " instructions\n", me->name, me->retired);
+	
+	if (saveSnapshots && me->running)
+	{
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s.snap", me->name);
+		if (SaveSnapshot(me, path) == 0)
+			printf("Saved %s to %s\n", me->name, path);
+	}
+#ifdef VM_PAIR_PROFILE
+	ReportPairs(me);
+#endif
+#ifdef VM_TRACE
+	WriteTrace(me);
+#endif
+#ifdef VM_PROFILE
+	MergeProfile(me);
+#endif
+
+	// Nothing can find us any more, we're freed as soon as the last
+	// one still looking at us lets go.
+	UnregisterVM(me->handle);
+}
+
+// Decode a program into code, which has room for instructions + 1
+// instructions, and get it ready to run from entry, optimized unless
+// optimize is 0. Returns -1 if the program doesn't pass the verifier.
+// Only codecache.c calls this, once for every different program.
+int DecodeProgram(const char *name, const char *data, size_t instructions, size_t entry, instruction_t *code, size_t *maxDepth, int optimize)
+{
+	// data has to be aligned for program_t, in practice it's a page
+	// aligned mapping of the program file so this decodes in place
+	// without any intermediate copies.
+	const program_t *program = (const program_t*)data;
+	for (size_t i = 0; i < instructions; ++i)
+		DecodeInstruction(&code[i], &program[i]);
 	
+	// The END sentinel stops programs running past their end without
+	// checking ip every step.
+	memset(&code[instructions], 0, sizeof(instruction_t));
+	code[instructions].handler = H_END;
+	
+	// Everything after this, and the interpreter, relies on the
+	// program being verified.
+	if (VerifyProgram(name, code, instructions, entry, maxDepth) != 0)
+		return -1;
+	
+	SplitBlocks(code, instructions, entry);
+#ifndef VM_NO_OPTIMIZE
+	if (optimize)
+		OptimizeProgram(name, code, instructions, entry, *maxDepth);
+#else
+	(void)optimize;
+#endif
+#ifndef VM_PAIR_PROFILE
+	// Profiling builds count the pairs as they are in the program.
+	FuseInstructions(code, instructions);
+#endif
+	WrapBlocks(code, instructions);
+	return 0;
+}
+
+// Give the vm the decoded program for data, decoding it only if no
+// other vm is running it already. Returns -1 if the program doesn't
+// pass the verifier.
+int CompileVM(vm_t *vm, const char *data, size_t len)
+{
 	// Make sure our program's opcodes are all valid. If they're not
-	// then the loop below may crash or fail.
+	// then the trailing partial instruction is dropped.
 	if (len % sizeof(program_t) != 0)
 	{
 		fprintf(stderr, "WARNING: %s is not a multiple of %zu bytes in length,"
@@ -621,47 +1120,208 @@ void CompileVM(vm_t *vm, char *data, size_t len)
 	}
 	
 	size_t instructions = len / sizeof(program_t);
+	const code_t *code = AcquireCode(vm->name, data, len, MIN(vm->ip, instructions));
+	if (!code)
+		return -1;
 	
-	// Attempt to guess the number of instructions we're gonna be needing to allocate for.
-	vm->program = calloc(instructions, sizeof(program_t*));
+	if (code->memory && SetupMemory(vm) != 0)
+	{
+		ReleaseCode(code);
+		return -1;
+	}
 	
-// 	printf("Preparing to compile program. Expecting %zu instructions. vm->program = 0x%p\n", instructions,
-// 	       vm->program);
+	vm->shared = code;
+	vm->code = code->code;
+	vm->programLength = code->length;
+	vm->maxDepth = code->maxDepth;
 	
-	size_t newlen = 0;
-	while(newlen < len)
+#ifdef VM_PROFILE
+	// The counts are the vm's own
+	vm->profile = ArenaAlloc(vm->arena, (instructions + 1) * sizeof(profile_entry_t), sizeof(uint64_t));
+#endif
+	return 0;
+}
+
+// Map a program file read-only and compile it into the vm. For a plain
+// program the mapping is only needed while decoding so it's dropped
+// again once we're done, a module keeps it (see module.c).
+int LoadProgram(vm_t *vm, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
 	{
-		// Allocate a prorgam instruction
-		program_t *pr = malloc(sizeof(program_t));
-		
-		// Determine the next best size to use to advance the copy
-		size_t nextlen = MIN(sizeof(program_t), sizeof(program_t) - len - newlen);
-		
-		// copy it into the newly allocated pointer
-		memcpy(pr, data, nextlen);
-		
-		newlen += nextlen;
-		data += nextlen;
-		vm->programLength++;
-		
-		if (vm->programLength > instructions)
+		fprintf(stderr, "Failed to open %s: %s. Skipping.\n", path, strerror(errno));
+		return -1;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size <= 0)
+	{
+		fprintf(stderr, "Failed to read program %s: invalid length!\n", path);
+		close(fd);
+		return -1;
+	}
+	
+	size_t len = st.st_size;
+	printf("Program length: %zu bytes\n", len);
+	
+	void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps its own reference to the file.
+	close(fd);
+	
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map program %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	
+	// Modules are used in place so the vm holds on to their mapping
+	if (IsModule(data, len))
+	{
+		if (LoadModule(vm, data, len, checkModules) != 0)
 		{
-// 			printf("realloc'ing program length: %zu objects, size %zu\n", vm->programLength,
-// 			       vm->programLength * sizeof(program_t*));
-			void *tmpptr = realloc(vm->program, vm->programLength * sizeof(program_t*));
-			if (!tmpptr)
-			{
-				fprintf(stderr, "failed realloc'ing %zu bytes: %s\n", vm->programLength * sizeof(program_t*),
-					strerror(errno));
-				exit(1);
-			}
-			vm->program = tmpptr;
+			munmap(data, len);
+			return -1;
+		}
+		return 0;
+	}
+	
+	// We only walk the program once, front to back.
+	posix_madvise(data, len, POSIX_MADV_SEQUENTIAL);
+	
+	int ret = CompileVM(vm, data, len);
+	
+	munmap(data, len);
+	return ret;
+}
+
+// Set by --asm, the programs on the command line are source files
+// which get assembled in-process (see asm.c) instead of binaries.
+static int assemble = 0;
+
+static int Load(vm_t *vm, const char *path)
+{
+	return assemble ? LoadAssembly(vm, path) : LoadProgram(vm, path);
+}
+
+// Run a program once in the interpreter and once with the JIT and
+// make sure both finish in exactly the same state.
+int CheckJIT(const char *path, uint64_t fuel)
+{
+	vm_t *vms[2] = { AllocateVM(), AllocateVM() };
+	int ret = 1;
+	
+	for (int i = 0; i < 2; ++i)
+	{
+		vms[i]->name = path;
+		vms[i]->nameLen = strlen(path);
+		vms[i]->running = 1;
+		vms[i]->fuel = fuel;
+		if (Load(vms[i], path) != 0)
+			goto out;
+	}
+	
+	if (!(vms[1]->jit = CompileJIT(vms[1])))
+	{
+		fprintf(stderr, "%s: the JIT isn't available on this platform\n", path);
+		goto out;
+	}
+	
+	// Both of them make any system calls, so a program's I/O happens
+	// twice here.
+	for (interpret(vms[0]); vms[0]->waiting; interpret(vms[0]))
+		Syscall(vms[0]);
+	for (RunJIT(vms[1]); vms[1]->waiting; RunJIT(vms[1]))
+		Syscall(vms[1]);
+	
+	ret = 0;
+	for (int r = 0; r < NUM_REGS; ++r)
+	{
+		if (vms[0]->regs[r] != vms[1]->regs[r])
+		{
+			fprintf(stderr, "%s: r%d differs: interpreter %" PRId32 ", JIT %" PRId32 "\n", path, r, vms[0]->regs[r], vms[1]->regs[r]);
+			ret = 1;
 		}
-		
-		vm->program[vm->programLength-1] = pr;
 	}
+	if (vms[0]->ip != vms[1]->ip)
+	{
+		fprintf(stderr, "%s: ip differs: interpreter %lu, JIT %lu\n", path, vms[0]->ip, vms[1]->ip);
+		ret = 1;
+	}
+	if (vms[0]->retired != vms[1]->retired || vms[0]->yielded != vms[1]->yielded)
+	{
+		fprintf(stderr, "%s: fuel differs: interpreter retired %" PRIu64 "%s, JIT retired %" PRIu64 "%s\n", path,
+			vms[0]->retired, vms[0]->yielded ? " (out of fuel)" : "",
+			vms[1]->retired, vms[1]->yielded ? " (out of fuel)" : "");
+		ret = 1;
+	}
+	if (memcmp(vms[0]->opstack, vms[1]->opstack, MAX_STACK * sizeof(*vms[0]->opstack)) != 0)
+	{
+		fprintf(stderr, "%s: the stacks differ\n", path);
+		ret = 1;
+	}
+	
+	printf("%s: JIT %s the interpreter\n", path, ret ? "DOES NOT match" : "matches");
+	
+out:
+	DeallocateVM(vms[0]);
+	DeallocateVM(vms[1]);
+	return ret;
 }
 
+void PrintAllocStats(void)
+{
+	alloc_stats_t st;
+	GetAllocStats(&st);
+	printf("vms created: %" PRIu64 ", reused: %" PRIu64 "\n", st.vmsCreated, st.vmsReused);
+	printf("arena chunks: %" PRIu64 " (%" PRIu64 " bytes)\n", st.arenaChunks, st.arenaBytes);
+	printf("stack cleared: %" PRIu64 " bytes\n", st.stackCleared);
+	printf("programs decoded: %" PRIu64 ", shared: %" PRIu64 "\n", st.programsDecoded, st.programsShared);
+}
+
+// Run count copies of a program in lockstep batches, copy n starting
+// with n in r0, and print where each of them ended up.
+int Sweep(const char *path, size_t count, uint64_t fuel)
+{
+	vm_t **vms = calloc(count, sizeof(vm_t*));
+	size_t loaded = 0;
+	int ret = 1;
+	
+	for (; loaded < count; ++loaded)
+	{
+		vm_t *vm = vms[loaded] = AllocateVM();
+		vm->name = path;
+		vm->nameLen = strlen(path);
+		vm->running = 1;
+		vm->fuel = fuel;
+		vm->regs[0] = (int32_t)loaded;
+		if (Load(vm, path) != 0)
+		{
+			DeallocateVM(vm);
+			goto out;
+		}
+	}
+	
+	RunBatch(vms, count);
+	
+	for (size_t i = 0; i < count; ++i)
+	{
+		const vm_t *vm = vms[i];
+		printf("%s[%zu]: r0 %" PRId32 " r1 %" PRId32 " r2 %" PRId32 " r3 %" PRId32 " r4 %" PRId32 " ip %lu, %s %" PRIu64 " instructions\n",
+			path, i, vm->regs[0], vm->regs[1], vm->regs[2], vm->regs[3], vm->regs[4], vm->ip,
+			vm->yielded ? "ran out of fuel after" : "retired", vm->retired);
+	}
+	ret = 0;
+	
+out:
+	for (size_t i = 0; i < loaded; ++i)
+		DeallocateVM(vms[i]);
+	free(vms);
+	return ret;
+}
+
+// The benchmarks (bench.c) link against everything in here but main()
+#ifndef VM_NO_MAIN
 // Obvious entry point.
 int main(int argc, char **argv)
 {
@@ -677,9 +1337,78 @@ int main(int argc, char **argv)
 		fprintf(stderr, "OPTIONS:\n");
 		fprintf(stderr, "-d, --dump         Dump the loaded program as hex to stdout\n");
 		fprintf(stderr, "-h, --help         Print this message.\n");
+		fprintf(stderr, "--jit              Compile the programs to native code before running them\n");
+		fprintf(stderr, "--jit-check        Run each program in both the interpreter and the JIT and compare\n");
+		fprintf(stderr, "--fuel=N           Stop each program before it runs more than N instructions,\n");
+		fprintf(stderr, "                   fuel is charged a whole basic block at a time\n");
+		fprintf(stderr, "--threads=N        Run the programs on N worker threads (default: one per core)\n");
+		fprintf(stderr, "--alloc-stats      Print what the vm pool allocated once everything has finished\n");
+		fprintf(stderr, "--sweep=N          Run N copies of each program with r0 = 0..N-1 in lockstep batches\n");
+		fprintf(stderr, "--quantum=N        Switch programs every N instructions (default: 10000)\n");
+		fprintf(stderr, "--snapshot         Save programs which run out of fuel to <program>.snap\n");
+		fprintf(stderr, "--restore          Start programs from their <program>.snap instead of the beginning\n");
+		fprintf(stderr, "--io-threads=N     Make the programs' system calls on N threads (default: %d)\n", IO_THREADS);
+		fprintf(stderr, "--asm              The programs are assembly source, assemble (and cache) them first\n");
+		fprintf(stderr, "--check-modules    Checksum the whole of every module when it's loaded\n");
+		fprintf(stderr, "--opt-stats        Print what the optimizer did to each program as it's loaded\n");
 		return 1;
 	}
 	
+	int useJIT = 0, checkJIT = 0, allocStats = 0, restore = 0;
+	uint64_t fuel = UINT64_MAX, quantum = 10000;
+	size_t threads = 0, sweep = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcasecmp(argv[i], "--jit"))
+			useJIT = 1;
+		else if (!strcasecmp(argv[i], "--jit-check"))
+			checkJIT = 1;
+		else if (!strncasecmp(argv[i], "--fuel=", 7))
+			fuel = strtoull(argv[i] + 7, NULL, 0);
+		else if (!strcasecmp(argv[i], "--alloc-stats"))
+			allocStats = 1;
+		else if (!strcasecmp(argv[i], "--asm"))
+			assemble = 1;
+		else if (!strncasecmp(argv[i], "--sweep=", 8))
+			sweep = strtoul(argv[i] + 8, NULL, 0);
+		else if (!strncasecmp(argv[i], "--threads=", 10))
+			threads = strtoul(argv[i] + 10, NULL, 0);
+		else if (!strncasecmp(argv[i], "--quantum=", 10))
+			quantum = strtoull(argv[i] + 10, NULL, 0);
+		else if (!strcasecmp(argv[i], "--snapshot"))
+			saveSnapshots = 1;
+		else if (!strcasecmp(argv[i], "--check-modules"))
+			checkModules = 1;
+		else if (!strcasecmp(argv[i], "--restore"))
+			restore = 1;
+		else if (!strncasecmp(argv[i], "--io-threads=", 13))
+			SetIOThreads(strtoul(argv[i] + 13, NULL, 0));
+		else if (!strcasecmp(argv[i], "--opt-stats"))
+			SetOptimizerStats(1);
+	}
+	
+	if (sweep)
+	{
+		int failed = 0;
+		for (int i = 1; i < argc; ++i)
+			if (argv[i][0] != '-')
+				failed |= Sweep(argv[i], sweep, fuel);
+		return failed;
+	}
+	
+	if (checkJIT)
+	{
+		int failed = 0;
+		for (int i = 1; i < argc; ++i)
+			if (argv[i][0] != '-')
+				failed |= CheckJIT(argv[i], fuel);
+		if (allocStats)
+			PrintAllocStats();
+		return failed;
+	}
+	
+	struct scheduler_s *sched = CreateScheduler(threads, quantum);
+	
 	for (int i = 1; i < argc; ++i)
 	{
 		char *program = argv[i];
@@ -698,102 +1427,48 @@ int main(int argc, char **argv)
 		vm->nameLen = len;
 		// We're running
 		vm->running = 1;
+		vm->fuel = fuel;
 		
-		printf("Attempting to open file \"%s\"\n", program);
-		
-		// Open a file as read-binary
-		FILE *f = fopen(vm->name, "rb");
+		printf("Attempting to map file \"%s\"\n", program);
 		
-		if(!f)
+		// Map the program and compile it straight out of the mapping
+		if (Load(vm, vm->name) != 0)
 		{
-			fprintf(stderr, "Failed to open %s. Skipping.\n", vm->name);
 			DeallocateVM(vm);
 			continue;
 		}
 		
-		printf("Program successfully opened, reading length and allocating temporary buffer\n");
-		
-		// Get program length
-		fseek(f, 0, SEEK_END);
-		size_t plen = ftell(f);
-		rewind(f);
-		
-		printf("Program length: %zu bytes\n", plen);
-		
-		// Make sure our program is empty
-		char *data = malloc(plen+1);
-		// Make sure the whole buffer is null before we start
-		memset(data, 0, plen+1);
+		printf("Loaded %zu instructions, continuing to next program...\n", vm->programLength);
 		
-		// Read each byte into our buffer
-		size_t ret = fread(data, 1, plen, f);
-		
-		// Close our file descriptor
-		fclose(f);
-		
-		printf("Verifying program length, fread returned %zu\n", ret);
-		
-		// Make sure the program has a valid length and isn't null.
-		if (ret != plen || ret == 0)
+		if (restore)
 		{
-			fprintf(stderr, "Failed to read program: invalid length!\n");
-			DeallocateVM(vm);
-			continue;
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s.snap", program);
+			if (RestoreSnapshot(vm, path) != 0)
+			{
+				DeallocateVM(vm);
+				continue;
+			}
 		}
 		
-		printf("Compiling program into 8-byte segments\n");
-		
-		// Compile the VM
-		CompileVM(vm, data, plen);
-		
-		printf("Cleaning up and continuing to next program...\n");
+		if (useJIT && !(vm->jit = CompileJIT(vm)))
+			fprintf(stderr, "Couldn't JIT \"%s\", it will be interpreted\n", program);
 		
-		// We don't need this anymore
-		free(data);
-		
-		// Check if this is the first element in the linked list.
-		if (!first)
-			first = vm;
-		// Set the previous vm so when we allocate our next
-		// vm, we can add it to the linked list
-		prev = vm;
+		RegisterVM(vm);
+		Schedule(sched, vm);
 	}
 	
-	printf("Starting program threads\n");
-	
-	// Initialize the mutex
-	mtx_init(&listmutex, mtx_plain);
+	// Wait for all of the programs to finish
+	RunScheduler(sched);
+	DestroyScheduler(sched);
 	
-	// Lock our mutex in case our programs are super small
-	// and we haven't even finished loading our program(s)
-	mtx_lock(&listmutex);
-	
-	// Iterate the vms and start running them
-	for (vm_t *vm = first; vm; vm = vm->next)
-	{
-		int ret = thrd_create(&vm->thread, DecodeThread, vm);
-		if (ret != thrd_success)
-			fprintf(stderr, "Failed to start a new program thread for program %s!\n", vm->name);
-	}
-	
-	printf("Waiting for threads to finish\n");
-	
-	// Unlock and let the threads do their thing.
-	mtx_unlock(&listmutex);
-	
-	// WARNING: this is technically a race
-	// condition but I am too lazy to write
-	// code to handle it.
-	//
-	// Wait for the threads to finish.
-	for (vm_t *vm = first; vm; vm = vm->next)
-	{
-		int res = 0;
-		thrd_join(vm->thread, &res);
-	}
+#ifdef VM_PROFILE
+	ReportProfiles();
+#endif
 	
-	// We're done with the mutex
-	mtx_destroy(&listmutex);
+	if (allocStats)
+		PrintAllocStats();
 	
         return 0;
 }
+#endif
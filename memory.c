@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Linear memory. Programs using LOAD/STORE or INT get a block of memory of
+// their own, DEFAULT_MEMORY bytes or as much as their module asks for,
+// with the module's read-only data copied to the start of it.
+//
+// Guest addresses are 32 bits, so on 64 bit hosts every vm reserves the
+// whole 4GB of them plus a guard page and only makes the program's
+// memory accessible. The interpreter then uses a guest address as it is
+// without checking it: anything past the end of the program's memory
+// lands on an inaccessible page and the SIGSEGV handler below jumps
+// back out of the interpreter, which stops the vm with TRAP_MEMORY at
+// the instruction that made the access. Reserving address space costs
+// nothing until it's touched, and the reservation stays with the vm in
+// the pool so it's only made once.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef VM_MEMORY_GUARD
+// All of the 32 bit address space, and past its end enough for the
+// widest access to fault on any page size.
+# define MEMORY_RESERVE ((UINT64_C(1) << 32) + 65536)
+#endif
+
+// Whether a decoded program has anything that accesses memory, system
+// calls read and write it too
+int UsesMemory(const instruction_t *code, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+	{
+		switch(BaseHandler(&code[i]))
+		{
+			case H_LOAD8_R:   case H_LOAD8_I:   case H_LOAD16_R:  case H_LOAD16_I:
+			case H_LOAD32_R:  case H_LOAD32_I:  case H_STORE8_R:  case H_STORE8_I:
+			case H_STORE16_R: case H_STORE16_I: case H_STORE32_R: case H_STORE32_I:
+			case H_INT:
+				return 1;
+			default:
+				break;
+		}
+	}
+	return 0;
+}
+
+#ifdef VM_MEMORY_GUARD
+
+// The vm the thread is running and where to go when it faults
+static _Thread_local vm_t *guarded;
+static _Thread_local sigjmp_buf guard;
+
+static struct sigaction previous;
+static once_flag handlerOnce = ONCE_FLAG_INIT;
+
+static void Fault(int sig, siginfo_t *info, void *context)
+{
+	const uint8_t *addr = info->si_addr;
+	vm_t *vm = guarded;
+	
+	if (vm && vm->memory && addr >= vm->memory && addr < vm->memory + MEMORY_RESERVE)
+		siglongjmp(guard, 1);
+	
+	// Not one of ours. Put back whatever was handling it before, the
+	// access is retried and goes there instead.
+	(void)sig;
+	(void)context;
+	sigaction(SIGSEGV, &previous, NULL);
+}
+
+static void InstallHandler(void)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = Fault;
+	// Left unblocked as the handler never returns to a guest access,
+	// so the next fault on this thread is caught too.
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGSEGV, &sa, &previous) != 0)
+	{
+		fprintf(stderr, "failed installing the memory fault handler: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+// Called just before running the vm, sigsetjmp() the result. It's only
+// ever jumped to out of the interpreter running this vm on this thread.
+sigjmp_buf *GuardMemory(vm_t *vm)
+{
+	guarded = vm;
+	return &guard;
+}
+
+void UnguardMemory(void)
+{
+	guarded = NULL;
+}
+
+#endif
+
+// Give the vm size bytes of zeroed memory, size is a whole number of
+// pages.
+int ReserveMemory(vm_t *vm, uint64_t size)
+{
+#ifdef VM_MEMORY_GUARD
+	call_once(&handlerOnce, InstallHandler);
+	
+	if (!vm->memory)
+	{
+		void *reserved = mmap(NULL, MEMORY_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (reserved == MAP_FAILED)
+		{
+			fprintf(stderr, "%s: failed reserving linear memory: %s\n", vm->name, strerror(errno));
+			return -1;
+		}
+		vm->memory = reserved;
+	}
+	
+	// Anything over 4GB can't be addressed anyway
+	size = MIN(size, UINT64_C(1) << 32);
+	if (size && mprotect(vm->memory, size, PROT_READ | PROT_WRITE) != 0)
+	{
+		fprintf(stderr, "%s: failed mapping %" PRIu64 " bytes of linear memory: %s\n", vm->name, size, strerror(errno));
+		return -1;
+	}
+#else
+	vm->memory = calloc(1, size ? size : 1);
+	if (!vm->memory)
+	{
+		fprintf(stderr, "%s: failed allocating %" PRIu64 " bytes of linear memory: %s\n", vm->name, size, strerror(errno));
+		return -1;
+	}
+#endif
+	
+	vm->memorySize = size;
+	return 0;
+}
+
+// Make the vm's program's memory accessible and fill it in. Called
+// when the program is loaded, and only for programs that need memory.
+int SetupMemory(vm_t *vm)
+{
+	size_t dataSize;
+	const void *data = ModuleData(vm, &dataSize);
+	
+	uint64_t size = DEFAULT_MEMORY;
+	if (vm->module && (vm->module->features & MODULE_FEATURE_MEMORY))
+		size = vm->module->memorySize;
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	size = MAX(size, (uint64_t)dataSize);
+	size = (size + page - 1) & ~(page - 1);
+	
+	if (ReserveMemory(vm, size) != 0)
+		return -1;
+	if (dataSize)
+		memcpy(vm->memory, data, dataSize);
+	return 0;
+}
+
+// Throw away the vm's memory contents when it's recycled. On 64 bit
+// hosts the reservation is kept, just with fresh zero pages that are
+// inaccessible again.
+void ResetMemory(vm_t *vm)
+{
+	if (!vm->memory)
+		return;
+	
+#ifdef VM_MEMORY_GUARD
+	if (vm->memorySize &&
+	    mmap(vm->memory, vm->memorySize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+	{
+		fprintf(stderr, "failed resetting linear memory: %s\n", strerror(errno));
+		exit(1);
+	}
+	ReleasePages(&vm->memoryPages);
+#else
+	free(vm->memory);
+	vm->memory = NULL;
+#endif
+	vm->memorySize = 0;
+}
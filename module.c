@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Loading module files (see module.h). Everything the header says is
+// checked against the size of the file up front, none of which depends
+// on how big the module is, after that the sections are used in place.
+// The checksum is the exception, it has to read the whole module, so
+// it's only worked out when the caller asks for it. The verifier still
+// checks the code of a module that wasn't checksummed.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// FNV-1a, 32 bit
+uint32_t ModuleChecksum(const void *ptr, size_t len)
+{
+	const unsigned char *data = ptr;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
+int IsModule(const void *data, size_t len)
+{
+	return len >= MODULE_HEADER_MIN && !memcmp(data, MODULE_MAGIC, 8);
+}
+
+// Whether count entries of size bytes at offset fit in the file and are
+// aligned for them.
+static int SectionFits(uint64_t offset, uint64_t count, uint64_t size, size_t len)
+{
+	if (offset % 8 || offset > len)
+		return 0;
+	return count <= (len - offset) / size;
+}
+
+// Check a mapped module and load its code into the vm. On success the
+// vm keeps the mapping and unmaps it when it's deallocated.
+int LoadModule(vm_t *vm, const void *data, size_t len, int checksum)
+{
+	const module_header_t *h = data;
+	const unsigned char *bytes = data;
+	
+	if (h->version != MODULE_VERSION)
+	{
+		fprintf(stderr, "%s: module version %u isn't supported\n", vm->name, h->version);
+		return -1;
+	}
+	if (h->features & ~MODULE_FEATURES_KNOWN)
+	{
+		fprintf(stderr, "%s: module uses unsupported features 0x%x\n", vm->name, h->features & ~MODULE_FEATURES_KNOWN);
+		return -1;
+	}
+	if (h->headerSize < MODULE_HEADER_MIN || h->headerSize > len ||
+	    ((h->features & MODULE_FEATURE_SOURCE) && h->headerSize < sizeof(module_header_t)) ||
+	    !SectionFits(h->codeOffset, h->codeCount, sizeof(program_t), len) ||
+	    !SectionFits(h->rodataOffset, h->rodataSize, 1, len) ||
+	    !SectionFits(h->symbolsOffset, h->symbolCount, sizeof(module_symbol_t), len) ||
+	    !SectionFits(h->stringsOffset, h->stringsSize, 1, len) ||
+	    (h->stringsSize && bytes[h->stringsOffset + h->stringsSize - 1] != '\0') ||
+	    (h->entry && h->entry >= h->codeCount))
+	{
+		fprintf(stderr, "%s: corrupt module header\n", vm->name);
+		return -1;
+	}
+	if (checksum && ModuleChecksum(bytes + h->headerSize, len - h->headerSize) != h->checksum)
+	{
+		fprintf(stderr, "%s: module checksum mismatch, the file is corrupt\n", vm->name);
+		return -1;
+	}
+	
+	// CompileVM() starts a basic block wherever the vm is going to start
+	// and sets up linear memory from the module
+	vm->ip = h->entry;
+	vm->module = h;
+	vm->moduleSize = len;
+	if (CompileVM(vm, (const char*)bytes + h->codeOffset, h->codeCount * sizeof(program_t)) != 0)
+	{
+		vm->module = NULL;
+		vm->moduleSize = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void UnloadModule(vm_t *vm)
+{
+	if (vm->module)
+		munmap((void*)vm->module, vm->moduleSize);
+	vm->module = NULL;
+	vm->moduleSize = 0;
+}
+
+// The read-only data of the vm's module
+const void *ModuleData(const vm_t *vm, size_t *size)
+{
+	if (!vm->module)
+	{
+		*size = 0;
+		return NULL;
+	}
+	*size = vm->module->rodataSize;
+	return (const char*)vm->module + vm->module->rodataOffset;
+}
+
+// Look a label or entry point up by name
+const module_symbol_t *FindSymbol(const vm_t *vm, const char *name)
+{
+	if (!vm->module)
+		return NULL;
+	
+	const module_header_t *h = vm->module;
+	const module_symbol_t *symbols = (const module_symbol_t*)((const char*)h + h->symbolsOffset);
+	const char *strings = (const char*)h + h->stringsOffset;
+	
+	for (uint64_t i = 0; i < h->symbolCount; ++i)
+		if (symbols[i].name < h->stringsSize && !strcmp(strings + symbols[i].name, name))
+			return &symbols[i];
+	return NULL;
+}
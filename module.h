@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#ifndef MODULE_H_
+#define MODULE_H_
+
+// Module files. Rather than a bare array of program_t words a module
+// has a header saying where everything is, so it can be mapped and used
+// where it lies: the code section is the program_t array CompileVM()
+// decodes, the read-only data and the symbol table are used straight
+// out of the mapping for as long as the vm lives. Assembler2.py writes
+// these with --module.
+//
+//   module_header_t
+//   code     codeCount program_t words
+//   rodata   rodataSize bytes
+//   symbols  symbolCount module_symbol_t
+//   strings  stringsSize bytes of NUL terminated symbol names
+//
+// Every section starts 8 byte aligned. The checksum is FNV-1a (32 bit)
+// of everything after the header. Assembler2.py's headers stop short of
+// sourceHash, those fields are only there with MODULE_FEATURE_SOURCE.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MODULE_MAGIC   "PVMMODUL"
+#define MODULE_VERSION 1
+
+// Feature flags. A module using a feature the loader doesn't know about
+// is refused rather than run wrong.
+#define MODULE_FEATURE_MEMORY (1u << 0) // memorySize says how much linear memory it wants
+#define MODULE_FEATURE_WIDE   (1u << 1) // the code has wide immediates (OP_WIDE)
+#define MODULE_FEATURE_SOURCE (1u << 2) // sourceHash and sourceSize say what it was assembled from
+#define MODULE_FEATURES_KNOWN (MODULE_FEATURE_MEMORY | MODULE_FEATURE_WIDE | MODULE_FEATURE_SOURCE)
+
+typedef struct module_header_s
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t features;
+	uint32_t headerSize;
+	uint32_t checksum;
+	// Instruction execution starts at
+	uint32_t entry;
+	// Bytes of linear memory, with MODULE_FEATURE_MEMORY. The rodata is
+	// copied to the start of it.
+	uint32_t memorySize;
+	
+	uint64_t codeOffset;
+	uint64_t codeCount;
+	uint64_t rodataOffset;
+	uint64_t rodataSize;
+	uint64_t symbolsOffset;
+	uint64_t symbolCount;
+	uint64_t stringsOffset;
+	uint64_t stringsSize;
+	// With MODULE_FEATURE_SOURCE, the SourceHash() and length of the
+	// source, so asm.c can tell a cached module is the one it wants
+	uint64_t sourceHash;
+	uint64_t sourceSize;
+} module_header_t;
+
+// The smallest header a module can have
+#define MODULE_HEADER_MIN offsetof(module_header_t, sourceHash)
+
+enum
+{
+	SYMBOL_LABEL, // value is an instruction
+	SYMBOL_ENTRY, // an instruction the host may start at
+	SYMBOL_DATA   // value is an offset into rodata
+};
+
+typedef struct module_symbol_s
+{
+	// Offset of the name in the strings section
+	uint32_t name;
+	uint32_t type;
+	uint32_t value;
+	uint32_t pad;
+} module_symbol_t;
+
+#endif // MODULE_H_
@@ -0,0 +1,736 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Load-time optimizer. Code generators leave a lot behind which is
+// plain to see once the program is loaded: constants loaded into a
+// register just to be added to another one, chains of MOVs, and flags
+// set by one instruction only to be overwritten by the next before
+// anything looks at them. DecodeProgram() runs this over every program
+// once it's been verified and split into blocks, before the
+// superinstructions are picked.
+//
+// Nothing is ever added, removed or moved. Every instruction keeps its
+// ip and the blocks stay where they were, so fuel is charged the same,
+// a vm stops in exactly the same places and jump targets, return
+// addresses, snapshots and the profiler all still line up. Instructions
+// are only rewritten into cheaper ones that do the same thing:
+//
+//  - Flags nothing reads. Working backwards through each block, an
+//    instruction whose flags are overwritten before any conditional
+//    jump, PUSHF or r4 access reads them gets a _NF handler which
+//    doesn't record them, a CMP just becomes a NOP. The flags are
+//    always kept at the end of a block, where the vm can run out of
+//    fuel and the host can look at r4, and in front of anything which
+//    can stop the vm part way through one.
+//
+//  - Constants and copies. Following the control flow graph of the
+//    blocks, what's known about r0-r2 is carried from one instruction
+//    to the next: that it holds a constant, or a copy of another
+//    register. A register operand with a known value becomes an
+//    immediate, one holding a copy reads the register it's a copy of
+//    instead, an instruction with a known result and flags nothing
+//    reads becomes a LOADI, or a NOP when the register already held
+//    it, and a conditional jump on known flags becomes a JMP or a NOP.
+//
+// What's known only holds for a vm which got where it is by running
+// the program from its entry point. It's only worked out for programs
+// the verifier could follow (see verify.c), which have no computed
+// jumps and where every RET goes back to the CALL that got there. A vm
+// the host changes part way through carries on with the program
+// decoded without any of this (see DeoptimizeVM()).
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// r3 is the stack pointer and r4 the flags, only the ones below this
+// are followed
+#define TRACKED 3
+// A register which isn't a copy of another one
+#define NO_COPY 0xFF
+
+// What's known about the registers at some point in the program
+typedef struct
+{
+	// Whether the program can get here at all
+	uint8_t reached;
+	// Bit r is set when regs[r] holds value[r]
+	uint8_t known;
+	// Whether the flags are flags
+	uint8_t flagsKnown;
+	// The register each one holds a copy of, or NO_COPY
+	uint8_t copy[TRACKED];
+	int32_t value[TRACKED];
+	int32_t flags;
+} facts_t;
+
+// What's known about what an instruction leaves in r0
+enum
+{
+	RESULT_UNKNOWN,
+	RESULT_CONSTANT,  // always the same value
+	RESULT_UNCHANGED  // what r0 held already
+};
+
+typedef struct
+{
+	instruction_t *code;
+	size_t len;
+	// Where each block starts, with len at the end, and the block each
+	// instruction is in
+	size_t *start;
+	size_t *blockOf;
+	size_t blocks;
+	
+	// What's known at the start of each block
+	facts_t *in;
+	// Blocks to go through again
+	size_t *work;
+	uint8_t *queued;
+	size_t pending;
+	
+	// What's known about each instruction's result, and what it is
+	uint8_t *kind;
+	int32_t *result;
+	
+	// For --opt-stats
+	size_t before, after;
+	size_t flagsBefore, flagsAfter;
+	size_t constants, copies, branches;
+} optimizer_t;
+
+static int reportStats = 0;
+
+// Print what was done to every program from now on
+void SetOptimizerStats(int on)
+{
+	reportStats = on;
+}
+
+static void *Allocate(size_t size)
+{
+	void *ptr = calloc(1, size ? size : 1);
+	if (!ptr)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", size, strerror(errno));
+		exit(1);
+	}
+	return ptr;
+}
+
+// Handlers which record flags for what they work out
+static int SetsFlags(uint8_t handler)
+{
+	switch(handler)
+	{
+		case H_ADD_RR: case H_ADD_RI: case H_SUB_RR: case H_SUB_RI:
+		case H_MUL_RR: case H_MUL_RI: case H_DIV_RR: case H_DIV_RI:
+		case H_XOR_RR: case H_XOR_RI: case H_OR_RR:  case H_OR_RI:
+		case H_AND_RR: case H_AND_RI: case H_SHL_RR: case H_SHL_RI:
+		case H_SHR_RR: case H_SHR_RI: case H_NOT_RR: case H_NOT_RI:
+		case H_MOV_RR: case H_MOV_RI: case H_CMP_RR: case H_CMP_RI:
+		case H_INC: case H_DEC:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Instructions which read the flags, or can stop the vm part way
+// through a block with the flags left for the host to look at. That's
+// memory faults and the stack checks, which even a program the
+// verifier could follow gets if the host moved its stack.
+static int NeedsFlags(const instruction_t *ins)
+{
+	switch(ins->handler)
+	{
+		case H_SYNCF: case H_PUSHF: case H_POPF:
+		case H_JNZ_R: case H_JNZ_I: case H_JZ_R:  case H_JZ_I:
+		case H_JS_R:  case H_JS_I:  case H_JNS_R: case H_JNS_I:
+		case H_JGT_R: case H_JGT_I: case H_JLT_R: case H_JLT_I:
+		case H_JPE_R: case H_JPE_I: case H_JPO_R: case H_JPO_I:
+		case H_HALT: case H_UNUSED: case H_INT:
+		case H_PUSH_R: case H_PUSH_I: case H_POP:
+		case H_CALL_R: case H_CALL_I: case H_RET:
+		case H_LOAD8_R:   case H_LOAD8_I:   case H_LOAD16_R:  case H_LOAD16_I:
+		case H_LOAD32_R:  case H_LOAD32_I:  case H_STORE8_R:  case H_STORE8_I:
+		case H_STORE16_R: case H_STORE16_I: case H_STORE32_R: case H_STORE32_I:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// The immediate form of a register form handler, H_COUNT if it has none
+static uint8_t ImmediateForm(uint8_t handler)
+{
+#define FORM2(name) case H_##name##_RR: return H_##name##_RI;
+#define FORM1(name) case H_##name##_R: return H_##name##_I;
+	switch(handler)
+	{
+		FORM2(ADD) FORM2(SUB) FORM2(MUL) FORM2(DIV) FORM2(XOR)
+		FORM2(OR)  FORM2(AND) FORM2(SHL) FORM2(SHR) FORM2(NOT)
+		FORM2(MOV) FORM2(CMP)
+		FORM1(PUSH) FORM1(LEA)
+		FORM1(LOAD8)  FORM1(LOAD16)  FORM1(LOAD32)
+		FORM1(STORE8) FORM1(STORE16) FORM1(STORE32)
+		default: return H_COUNT;
+	}
+#undef FORM1
+#undef FORM2
+}
+
+// Whether a conditional jump to an immediate location is taken with
+// flags f, -1 if handler isn't one
+static int Taken(uint8_t handler, int32_t f)
+{
+	switch(handler)
+	{
+		case H_JNZ_I: return !(f & FLAG_ZERO);
+		case H_JZ_I:  return !!(f & FLAG_ZERO);
+		case H_JS_I:  return !!(f & FLAG_SIGN);
+		case H_JNS_I: return !(f & FLAG_SIGN);
+		case H_JGT_I: return JGT_TAKEN(f);
+		case H_JLT_I: return JLT_TAKEN(f);
+		case H_JPE_I: return !!(f & FLAG_PARITY);
+		case H_JPO_I: return !(f & FLAG_PARITY);
+		default:      return -1;
+	}
+}
+
+// Work out what a handler which sets the flags does to a and b, just
+// like interpret() would. Returns 0 for a divide by zero, which is left
+// to print its warning when it runs.
+static int Evaluate(uint8_t handler, int32_t a, int32_t b, int32_t *res, uint8_t *op)
+{
+	*op = LAZY_LOGIC;
+	switch(handler)
+	{
+		case H_ADD_RR: case H_ADD_RI: case H_INC:
+			*op = LAZY_ADD;
+			*res = (int32_t)((uint32_t)a + (uint32_t)b);
+			return 1;
+		case H_SUB_RR: case H_SUB_RI: case H_DEC: case H_CMP_RR: case H_CMP_RI:
+			*op = LAZY_SUB;
+			*res = (int32_t)((uint32_t)a - (uint32_t)b);
+			return 1;
+		case H_MUL_RR: case H_MUL_RI:
+			*op = LAZY_MUL;
+			*res = (int32_t)((uint32_t)a * (uint32_t)b);
+			return 1;
+		case H_DIV_RR: case H_DIV_RI:
+			if (b == 0)
+				return 0;
+			*res = b == -1 ? (int32_t)(0u - (uint32_t)a) : a / b;
+			return 1;
+		case H_XOR_RR: case H_XOR_RI: *res = a ^ b; return 1;
+		case H_OR_RR:  case H_OR_RI:  *res = a | b; return 1;
+		case H_AND_RR: case H_AND_RI: *res = a & b; return 1;
+		case H_SHL_RR: case H_SHL_RI: *res = (int32_t)((uint32_t)a << (b & 31)); return 1;
+		case H_SHR_RR: case H_SHR_RI: *res = a >> (b & 31); return 1;
+		case H_NOT_RR: case H_NOT_RI: *res = ~b; return 1;
+		case H_MOV_RR: case H_MOV_RI: *res = b; return 1;
+		default:
+			return 0;
+	}
+}
+
+static int Known(const facts_t *f, uint8_t r)
+{
+	return r < TRACKED && (f->known & (1u << r));
+}
+
+// The register r holds a copy of, or r itself
+static uint8_t Root(const facts_t *f, uint8_t r)
+{
+	return r < TRACKED && f->copy[r] != NO_COPY ? f->copy[r] : r;
+}
+
+// Nothing is known, where the program starts and wherever something
+// other than the program may have changed the registers
+static void Forget(facts_t *f)
+{
+	memset(f, 0, sizeof(*f));
+	memset(f->copy, NO_COPY, sizeof(f->copy));
+	f->reached = 1;
+}
+
+// r is about to be overwritten
+static void Clobber(facts_t *f, uint8_t r)
+{
+	if (r == 4)
+		f->flagsKnown = 0;
+	if (r >= TRACKED)
+		return;
+	
+	f->known &= ~(1u << r);
+	f->copy[r] = NO_COPY;
+	for (int i = 0; i < TRACKED; ++i)
+		if (f->copy[i] == r)
+			f->copy[i] = NO_COPY;
+}
+
+// r is about to be set to value, returns what that means for its result
+static int Assign(facts_t *f, uint8_t r, int32_t value, int32_t *result)
+{
+	int same = Known(f, r) && f->value[r] == value;
+	
+	*result = value;
+	if (!same)
+	{
+		Clobber(f, r);
+		if (r < TRACKED)
+		{
+			f->known |= 1u << r;
+			f->value[r] = value;
+		}
+	}
+	return same ? RESULT_UNCHANGED : RESULT_CONSTANT;
+}
+
+// Read the register a copy is of instead, *field is r0 or r1
+static void ReadRoot(optimizer_t *o, const facts_t *f, uint8_t *field)
+{
+	uint8_t root = Root(f, *field);
+	if (root != *field)
+	{
+		*field = root;
+		o->copies++;
+	}
+}
+
+// Use the value of a register operand instead, for forms which add it
+// to the immediate
+static void MakeImmediate(optimizer_t *o, instruction_t *ins, int32_t value)
+{
+	ins->handler = ImmediateForm(ins->handler);
+	ins->type = OP_FLAG_IMMEDIATE;
+	ins->imm = (int32_t)((uint32_t)ins->imm + (uint32_t)value);
+	o->constants++;
+}
+
+// Carry what's known from in front of an instruction to after it. With
+// rewrite set the instruction is rewritten to make use of it first.
+// Returns what's known about the result the instruction leaves in r0
+// (RESULT_*) and, when it's constant, what it is.
+static int Step(optimizer_t *o, facts_t *f, instruction_t *ins, int rewrite, int32_t *result)
+{
+	uint8_t handler = ins->handler;
+	uint8_t r0 = ins->r0, r1 = ins->r1;
+	
+	// Anything which touches r4 is left alone
+	if (handler == H_SYNCF)
+	{
+		Clobber(f, r0);
+		f->flagsKnown = 0;
+		return RESULT_UNKNOWN;
+	}
+	
+	switch(handler)
+	{
+		case H_LOADI: case H_LEA_I:
+			return Assign(f, r0, ins->imm, result);
+		case H_LEA_R:
+			if (Known(f, r1))
+			{
+				int32_t value = (int32_t)((uint32_t)f->value[r1] + (uint32_t)ins->imm);
+				if (rewrite)
+					MakeImmediate(o, ins, f->value[r1]);
+				return Assign(f, r0, value, result);
+			}
+			if (rewrite)
+				ReadRoot(o, f, &ins->r1);
+			Clobber(f, r0);
+			return RESULT_UNKNOWN;
+		case H_LOAD8_R: case H_LOAD16_R: case H_LOAD32_R:
+		case H_STORE8_R: case H_STORE16_R: case H_STORE32_R:
+			if (rewrite && Known(f, r1))
+				MakeImmediate(o, ins, f->value[r1]);
+			else if (rewrite)
+				ReadRoot(o, f, &ins->r1);
+			// fall through
+		case H_LOAD8_I: case H_LOAD16_I: case H_LOAD32_I:
+		case H_STORE8_I: case H_STORE16_I: case H_STORE32_I:
+			if (handler >= H_STORE8_R && handler <= H_STORE32_I)
+			{
+				if (rewrite)
+					ReadRoot(o, f, &ins->r0);
+			}
+			else
+				Clobber(f, r0);
+			return RESULT_UNKNOWN;
+		case H_POP:
+			Clobber(f, r0);
+			return RESULT_UNKNOWN;
+		case H_PUSH_R:
+			if (rewrite && Known(f, r0))
+			{
+				ins->handler = H_PUSH_I;
+				ins->type = OP_FLAG_IMMEDIATE;
+				ins->imm = f->value[r0];
+				o->constants++;
+			}
+			else if (rewrite)
+				ReadRoot(o, f, &ins->r0);
+			return RESULT_UNKNOWN;
+		case H_POPF:
+			f->flagsKnown = 0;
+			return RESULT_UNKNOWN;
+		default:
+			if (rewrite && f->flagsKnown && Taken(handler, f->flags) >= 0)
+			{
+				if (Taken(handler, f->flags))
+				{
+					ins->handler = H_JMP_I;
+					ins->opcode = OP_JMP;
+				}
+				else
+				{
+					ins->handler = H_NOP;
+					ins->opcode = OP_NOP;
+				}
+				o->branches++;
+			}
+			if (!SetsFlags(handler))
+				return RESULT_UNKNOWN;
+			break;
+	}
+	
+	// Everything from here on works out r0 <op> r1/imm and sets the
+	// flags for it, CMP only sets the flags.
+	int cmp = handler == H_CMP_RR || handler == H_CMP_RI;
+	int ka = Known(f, r0), kb = 1;
+	int32_t a = ka ? f->value[r0] : 0, b = ins->imm;
+	
+	if (handler == H_INC || handler == H_DEC)
+		b = 1;
+	else if (ImmediateForm(handler) != H_COUNT)
+	{
+		kb = Known(f, r1);
+		b = kb ? f->value[r1] : 0;
+		if (rewrite && kb)
+		{
+			ins->handler = ImmediateForm(handler);
+			ins->type = OP_FLAG_IMMEDIATE;
+			ins->imm = b;
+			o->constants++;
+		}
+		else if (rewrite)
+			ReadRoot(o, f, &ins->r1);
+	}
+	if (cmp && rewrite)
+		ReadRoot(o, f, &ins->r0);
+	
+	// MOV and NOT don't look at r0
+	if (handler == H_MOV_RR || handler == H_MOV_RI || handler == H_NOT_RR || handler == H_NOT_RI)
+		ka = 1;
+	
+	int32_t res;
+	uint8_t op;
+	if (ka && kb && Evaluate(handler, a, b, &res, &op))
+	{
+		f->flagsKnown = 1;
+		f->flags = FlagsFor(op, res, a, b, FLAG_MASK);
+		return cmp ? RESULT_UNKNOWN : Assign(f, r0, res, result);
+	}
+	
+	f->flagsKnown = 0;
+	if (cmp)
+		return RESULT_UNKNOWN;
+	
+	if (handler == H_MOV_RR)
+	{
+		// r1 was already a copy of r0, or the other way around
+		uint8_t root = Root(f, r1);
+		if (root == r0 || (r0 < TRACKED && f->copy[r0] == root))
+			return RESULT_UNCHANGED;
+		
+		Clobber(f, r0);
+		if (r0 < TRACKED && root < TRACKED)
+			f->copy[r0] = root;
+		return RESULT_UNKNOWN;
+	}
+	
+	Clobber(f, r0);
+	return RESULT_UNKNOWN;
+}
+
+// Merge what's known coming from one more place into dst, returns
+// whether that changed it
+static int Meet(facts_t *dst, const facts_t *src)
+{
+	if (!dst->reached)
+	{
+		*dst = *src;
+		return 1;
+	}
+	
+	int changed = 0;
+	for (int r = 0; r < TRACKED; ++r)
+	{
+		if (Known(dst, r) && !(Known(src, r) && src->value[r] == dst->value[r]))
+		{
+			dst->known &= ~(1u << r);
+			changed = 1;
+		}
+		if (dst->copy[r] != NO_COPY && dst->copy[r] != src->copy[r])
+		{
+			dst->copy[r] = NO_COPY;
+			changed = 1;
+		}
+	}
+	if (dst->flagsKnown && !(src->flagsKnown && src->flags == dst->flags))
+	{
+		dst->flagsKnown = 0;
+		changed = 1;
+	}
+	return changed;
+}
+
+// The program can go to instruction to, which always starts a block,
+// with f known. Running off the end goes to the END sentinel.
+static void Flow(optimizer_t *o, size_t to, const facts_t *f)
+{
+	if (to >= o->len)
+		return;
+	
+	size_t b = o->blockOf[to];
+	if (Meet(&o->in[b], f) && !o->queued[b])
+	{
+		o->queued[b] = 1;
+		o->work[o->pending++] = b;
+	}
+}
+
+// Go through the block and pass what's known at the end of it on to
+// wherever it can go next
+static void Propagate(optimizer_t *o, size_t b)
+{
+	size_t end = o->start[b + 1];
+	facts_t f = o->in[b];
+	int32_t result;
+	
+	for (size_t i = o->start[b]; i < end; ++i)
+		Step(o, &f, &o->code[i], 0, &result);
+	
+	const instruction_t *last = &o->code[end - 1];
+	uint8_t handler = last->handler == H_SYNCF ? last->inner : last->handler;
+	int taken = f.flagsKnown && last->handler != H_SYNCF ? Taken(handler, f.flags) : -1;
+	
+	switch(handler)
+	{
+		case H_HALT: case H_UNUSED: case H_RET:
+			break;
+		case H_JMP_I:
+			Flow(o, (uint32_t)last->imm, &f);
+			break;
+		case H_JNZ_I: case H_JZ_I:  case H_JS_I:  case H_JNS_I:
+		case H_JGT_I: case H_JLT_I: case H_JPE_I: case H_JPO_I:
+			if (taken != 0)
+				Flow(o, (uint32_t)last->imm, &f);
+			if (taken != 1)
+				Flow(o, end, &f);
+			break;
+		case H_CALL_I:
+			// The function can do anything to the registers before it
+			// comes back
+			Flow(o, (uint32_t)last->imm, &f);
+			Forget(&f);
+			Flow(o, end, &f);
+			break;
+		case H_INT:
+			// So can the system call
+			Forget(&f);
+			Flow(o, end, &f);
+			break;
+		default:
+			Flow(o, end, &f);
+			break;
+	}
+}
+
+// Constant and copy propagation, for programs the verifier could follow
+static void PropagateConstants(optimizer_t *o, size_t entry)
+{
+	o->in = Allocate(o->blocks * sizeof(*o->in));
+	o->work = Allocate(o->blocks * sizeof(*o->work));
+	o->queued = Allocate(o->blocks);
+	
+	facts_t f;
+	Forget(&f);
+	Flow(o, entry, &f);
+	while (o->pending)
+	{
+		size_t b = o->work[--o->pending];
+		o->queued[b] = 0;
+		Propagate(o, b);
+	}
+	
+	// Now everything known is known rewrite the blocks the program
+	// can get to with it
+	for (size_t b = 0; b < o->blocks; ++b)
+	{
+		if (!o->in[b].reached)
+			continue;
+		f = o->in[b];
+		for (size_t i = o->start[b]; i < o->start[b + 1]; ++i)
+			o->kind[i] = Step(o, &f, &o->code[i], 1, &o->result[i]);
+	}
+	
+	free(o->in);
+	free(o->work);
+	free(o->queued);
+}
+
+// Leave out the flags of instructions whose flags nothing reads, going
+// backwards through each block
+static void DropFlags(optimizer_t *o)
+{
+	for (size_t b = 0; b < o->blocks; ++b)
+	{
+		int live = 1;
+		for (size_t i = o->start[b + 1]; i-- > o->start[b];)
+		{
+			instruction_t *ins = &o->code[i];
+			
+			if (SetsFlags(ins->handler))
+			{
+				if (!live)
+				{
+					if (o->kind[i] == RESULT_UNCHANGED || ins->handler == H_CMP_RR || ins->handler == H_CMP_RI)
+					{
+						ins->handler = H_NOP;
+						ins->opcode = OP_NOP;
+					}
+					else if (o->kind[i] == RESULT_CONSTANT)
+					{
+						ins->handler = H_LOADI;
+						ins->opcode = OP_LOADI;
+						ins->type = OP_FLAG_IMMEDIATE;
+						ins->imm = o->result[i];
+						o->constants++;
+					}
+					else
+						ins->handler = QuietHandler(ins->handler);
+				}
+				// Whatever set them before this doesn't matter
+				live = 0;
+			}
+			else if (o->kind[i] == RESULT_UNCHANGED)
+			{
+				// A LOADI or LEA of what the register already holds
+				ins->handler = H_NOP;
+				ins->opcode = OP_NOP;
+			}
+			else if (NeedsFlags(ins))
+				live = 1;
+		}
+	}
+}
+
+// Count what there is to count for --opt-stats
+static void Count(const optimizer_t *o, size_t *instructions, size_t *flags)
+{
+	*instructions = *flags = 0;
+	for (size_t i = 0; i < o->len; ++i)
+	{
+		*instructions += o->code[i].handler != H_NOP;
+		*flags += SetsFlags(o->code[i].handler);
+	}
+}
+
+// Optimize a verified program which SplitBlocks() has been through.
+// maxDepth is what the verifier worked out, SIZE_MAX if it couldn't
+// follow the program.
+void OptimizeProgram(const char *name, instruction_t *code, size_t len, size_t entry, size_t maxDepth)
+{
+	if (!len)
+		return;
+	
+	optimizer_t o;
+	memset(&o, 0, sizeof(o));
+	o.code = code;
+	o.len = len;
+	o.start = Allocate((len + 1) * sizeof(*o.start));
+	o.blockOf = Allocate(len * sizeof(*o.blockOf));
+	o.kind = Allocate(len);
+	o.result = Allocate(len * sizeof(*o.result));
+	
+	for (size_t i = 0; i < len; ++i)
+	{
+		if (i == 0 || code[i - 1].left == 1)
+			o.start[o.blocks++] = i;
+		o.blockOf[i] = o.blocks - 1;
+	}
+	o.start[o.blocks] = len;
+	
+	if (reportStats)
+		Count(&o, &o.before, &o.flagsBefore);
+	
+	int follow = maxDepth != SIZE_MAX && entry < len;
+	if (follow)
+		PropagateConstants(&o, entry);
+	DropFlags(&o);
+	
+	if (reportStats)
+	{
+		Count(&o, &o.after, &o.flagsAfter);
+		printf("%s: optimized %zu -> %zu instructions, %zu -> %zu flag updates, "
+		       "%zu constants and %zu copies propagated, %zu branches resolved%s\n",
+			name, o.before, o.after, o.flagsBefore, o.flagsAfter,
+			o.constants, o.copies, o.branches,
+			follow ? "" : " (flags only, the verifier couldn't follow it)");
+	}
+	
+	free(o.start);
+	free(o.blockOf);
+	free(o.kind);
+	free(o.result);
+}
+
+// The host changed the registers, ip or stack of a vm part way through
+// its program, so what the optimizer worked out about it might not be
+// true any more. It carries on with the program as it was decoded.
+void DeoptimizeVM(vm_t *vm)
+{
+#ifndef VM_NO_OPTIMIZE
+	if (!vm->shared || vm->code != vm->shared->code)
+		return;
+	
+	vm->code = PlainCode(vm->shared);
+	// The JIT compiled it in too
+	if (vm->jit)
+	{
+		FreeJIT(vm->jit);
+		vm->jit = CompileJIT(vm);
+	}
+#else
+	(void)vm;
+#endif
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// The embedding API from playvm.h, see there for how it's used. This is
+// only a thin layer over the same vms the scheduler runs, the host just
+// takes the scheduler's place.
+
+#include "vm.h"
+#include "playvm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+static const char *TrapNames[] = {
+	[TRAP_NONE]            = NULL,
+	[TRAP_UNUSED]          = "unused opcode",
+	[TRAP_STACK_OVERFLOW]  = "stack overflow",
+	[TRAP_STACK_UNDERFLOW] = "stack underflow",
+	[TRAP_PAST_END]        = "ran past the end of the program",
+	[TRAP_MEMORY]          = "memory access out of bounds"
+};
+
+playvm_t *PlayVMCreate(const char *name)
+{
+	vm_t *vm = AllocateVM();
+	
+	// Kept with everything else the program allocates
+	size_t len = strlen(name);
+	char *copy = ArenaAlloc(vm->arena, len + 1, 1);
+	memcpy(copy, name, len + 1);
+	vm->name = copy;
+	vm->nameLen = len;
+	
+	// Nothing to run until it's loaded, and no fuel until it's run
+	vm->fuel = 0;
+	return vm;
+}
+
+void PlayVMDestroy(playvm_t *vm)
+{
+	DeallocateVM(vm);
+}
+
+// Copy the program somewhere page aligned, which is what CompileVM()
+// and LoadModule() expect to be given.
+static void *CopyProgram(const void *data, size_t len)
+{
+	void *copy = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (copy == MAP_FAILED)
+	{
+		fprintf(stderr, "failed mapping %zu bytes: %s\n", len, strerror(errno));
+		exit(1);
+	}
+	memcpy(copy, data, len);
+	return copy;
+}
+
+// Ready to run, or left with no program if it didn't load
+static int Loaded(vm_t *vm, int ret)
+{
+	if (ret != 0)
+	{
+		vm->code = NULL;
+		vm->shared = NULL;
+		vm->programLength = 0;
+		vm->ip = 0;
+		return -1;
+	}
+	vm->running = 1;
+	return 0;
+}
+
+int PlayVMLoad(playvm_t *vm, const void *data, size_t len)
+{
+	if (vm->code)
+	{
+		fprintf(stderr, "%s already has a program loaded\n", vm->name);
+		return -1;
+	}
+	if (!len)
+	{
+		fprintf(stderr, "%s: empty program\n", vm->name);
+		return -1;
+	}
+	
+	void *copy = CopyProgram(data, len);
+	
+	// A module keeps its copy for as long as the vm lives. It's just
+	// been copied so checking it as well costs little more.
+	if (IsModule(copy, len))
+	{
+		int ret = LoadModule(vm, copy, len, 1);
+		if (ret != 0)
+			munmap(copy, len);
+		return Loaded(vm, ret);
+	}
+	
+	int ret = CompileVM(vm, copy, len);
+	munmap(copy, len);
+	return Loaded(vm, ret);
+}
+
+int PlayVMLoadAssembly(playvm_t *vm, const char *source, size_t len)
+{
+	if (vm->code)
+	{
+		fprintf(stderr, "%s already has a program loaded\n", vm->name);
+		return -1;
+	}
+	
+	size_t size;
+	void *image = AssembleModule(vm->name, source, len, &size);
+	if (!image)
+		return -1;
+	
+	int ret = LoadModule(vm, image, size, 0);
+	if (ret != 0)
+		munmap(image, size);
+	return Loaded(vm, ret);
+}
+
+int PlayVMEnableJIT(playvm_t *vm)
+{
+	if (!vm->code)
+		return -1;
+	if (!vm->jit)
+		vm->jit = CompileJIT(vm);
+	return vm->jit ? 0 : -1;
+}
+
+int PlayVMSaveSnapshot(playvm_t *vm, const char *path)
+{
+	return SaveSnapshot(vm, path);
+}
+
+int PlayVMRestoreSnapshot(playvm_t *vm, const char *path)
+{
+	return RestoreSnapshot(vm, path);
+}
+
+playvm_t *PlayVMFork(playvm_t *vm)
+{
+	return ForkVM(vm);
+}
+
+static playvm_status_t Status(const vm_t *vm)
+{
+	if (vm->running)
+		return PLAYVM_OUT_OF_FUEL;
+	return vm->trap != TRAP_NONE ? PLAYVM_TRAPPED : PLAYVM_HALTED;
+}
+
+playvm_status_t PlayVMRun(playvm_t *vm, uint64_t budget)
+{
+	// A vm with no program has nothing left to run either
+	if (!vm->running)
+		return Status(vm);
+	
+	vm->fuel = budget > UINT64_MAX - vm->fuel ? UINT64_MAX : vm->fuel + budget;
+	RunVM(vm);
+	return Status(vm);
+}
+
+uint64_t PlayVMRetired(const playvm_t *vm)
+{
+	return vm->retired;
+}
+
+const char *PlayVMTrap(const playvm_t *vm)
+{
+	return TrapNames[vm->trap];
+}
+
+int PlayVMGetRegister(const playvm_t *vm, unsigned reg, int32_t *value)
+{
+	if (reg >= NUM_REGS)
+		return -1;
+	// The interpreter always leaves r4 up to date when it returns
+	*value = vm->regs[reg];
+	return 0;
+}
+
+// Whether the vm has run any of its program yet. Until then the host
+// can set it up however it likes, after that the optimizer's idea of
+// what's in the registers (see optimize.c) doesn't hold any more.
+static int Started(const vm_t *vm)
+{
+	return vm->shared && (vm->retired || vm->ip != vm->shared->entry);
+}
+
+// The verifier's stack bound (see StackVerified()) only holds if the
+// stack pointer and the ip are where the program left them. Once the
+// host has moved the stack down, or the ip somewhere the stack wasn't
+// set up for, the program might pop more than it pushed, so it goes
+// back to checking every push and pop.
+static void StackMoved(vm_t *vm)
+{
+	vm->maxDepth = SIZE_MAX;
+}
+
+int PlayVMSetRegister(playvm_t *vm, unsigned reg, int32_t value)
+{
+	if (reg >= NUM_REGS)
+		return -1;
+	if (Started(vm))
+		DeoptimizeVM(vm);
+	
+	if (reg == 3)
+	{
+		if (value < 0 || value > MAX_STACK)
+			return -1;
+		StackMoved(vm);
+		if ((uint32_t)value > vm->stackHigh)
+			vm->stackHigh = value;
+	}
+	else if (reg == 4)
+	{
+		vm->regs[4] = value & FLAG_MASK;
+		vm->lazyOp = LAZY_NONE;
+		return 0;
+	}
+	
+	vm->regs[reg] = value;
+	return 0;
+}
+
+size_t PlayVMGetIP(const playvm_t *vm)
+{
+	return vm->ip;
+}
+
+int PlayVMFindSymbol(const playvm_t *vm, const char *name, uint32_t *value)
+{
+	const module_symbol_t *sym = FindSymbol(vm, name);
+	if (!sym)
+		return -1;
+	*value = sym->value;
+	return 0;
+}
+
+int PlayVMSetIP(playvm_t *vm, size_t ip)
+{
+	if (!vm->code || ip >= vm->programLength)
+		return -1;
+	if (ip != vm->ip)
+	{
+		// The stack bound was worked out from the entry point, from
+		// anywhere else the program might pop more than it pushed
+		StackMoved(vm);
+		DeoptimizeVM(vm);
+	}
+	
+	vm->ip = ip;
+	// This may be the middle of a basic block which nothing has paid
+	// for, this gets ResumeFuel() to charge for the rest of it.
+	vm->yielded = 1;
+	return 0;
+}
+
+uint8_t *PlayVMMemory(playvm_t *vm, size_t *size)
+{
+	*size = vm->memorySize;
+	return vm->memorySize ? vm->memory : NULL;
+}
+
+size_t PlayVMStackDepth(const playvm_t *vm)
+{
+	// The program can put anything in r3
+	if (vm->regs[3] < 0)
+		return 0;
+	return MIN((size_t)vm->regs[3], (size_t)MAX_STACK);
+}
+
+int PlayVMStackPeek(const playvm_t *vm, size_t index, uint32_t *value)
+{
+	size_t depth = PlayVMStackDepth(vm);
+	if (index >= depth)
+		return -1;
+	*value = vm->opstack[depth - 1 - index];
+	return 0;
+}
+
+int PlayVMStackPush(playvm_t *vm, uint32_t value)
+{
+	if (vm->regs[3] < 0 || vm->regs[3] >= MAX_STACK)
+		return -1;
+	
+	// Pushing only makes room the program doesn't know about, the
+	// verifier's bound still holds.
+	vm->opstack[vm->regs[3]++] = value;
+	if ((uint32_t)vm->regs[3] > vm->stackHigh)
+		vm->stackHigh = vm->regs[3];
+	return 0;
+}
+
+int PlayVMStackPop(playvm_t *vm, uint32_t *value)
+{
+	if (vm->regs[3] <= 0 || vm->regs[3] > MAX_STACK)
+		return -1;
+	
+	StackMoved(vm);
+	if (Started(vm))
+		DeoptimizeVM(vm);
+	*value = vm->opstack[--vm->regs[3]];
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#ifndef PLAYVM_H_
+#define PLAYVM_H_
+
+// The vm as a library, for running programs inside something else
+// instead of launching playvm for every one of them. Link against
+// build/libplayvm.a or build/libplayvm.so and include only this header.
+//
+// A vm is created, given a program and then run a budget of
+// instructions at a time. Between runs the host can look at and change
+// its registers and stack. Nothing here starts threads or keeps any
+// state outside of the vm, so as long as each vm is only used by one
+// thread at a time the host can spread as many as it likes over its own
+// threads.
+//
+//   playvm_t *vm = PlayVMCreate("job");
+//   if (PlayVMLoad(vm, program, size) != 0) ...
+//   while (PlayVMRun(vm, 100000) == PLAYVM_OUT_OF_FUEL)
+//           ... go and do something else for a while ...
+//   PlayVMDestroy(vm);
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+# define PLAYVM_API __attribute__((visibility("default")))
+#else
+# define PLAYVM_API
+#endif
+
+typedef struct vm_s playvm_t;
+
+// Why PlayVMRun() returned
+typedef enum
+{
+	PLAYVM_HALTED,      // the program ran HALT, it's finished
+	PLAYVM_OUT_OF_FUEL, // the budget ran out, run it again to continue
+	PLAYVM_TRAPPED      // it did something it can't go on from, see PlayVMTrap()
+} playvm_status_t;
+
+// Registers, r3 is the stack pointer and r4 the flags
+#define PLAYVM_REGISTERS 5
+
+// A new vm with no program loaded, name is what errors refer to it as
+PLAYVM_API playvm_t *PlayVMCreate(const char *name);
+// Finished with the vm, it can't be used again
+PLAYVM_API void PlayVMDestroy(playvm_t *vm);
+
+// Load a program, either a plain program or a module, from memory. The
+// data is copied so it can be freed straight after. Programs which
+// don't pass the verifier are refused with -1, as is loading a second
+// program into the same vm.
+PLAYVM_API int PlayVMLoad(playvm_t *vm, const void *data, size_t len);
+// Assemble source in the playvm assembly language and load it
+PLAYVM_API int PlayVMLoadAssembly(playvm_t *vm, const char *source, size_t len);
+// Run the program as native code from now on. -1 if there's no JIT
+// for this platform, the vm still works, just interpreted.
+PLAYVM_API int PlayVMEnableJIT(playvm_t *vm);
+
+// Save a vm which can still run to a snapshot file, and carry on from
+// one in a vm which has loaded the same program. Restoring maps the
+// file rather than reading it, so starting lots of vms from one
+// snapshot is cheap. Open files aren't saved, a vm with any can't be.
+PLAYVM_API int PlayVMSaveSnapshot(playvm_t *vm, const char *path);
+PLAYVM_API int PlayVMRestoreSnapshot(playvm_t *vm, const char *path);
+
+// A new vm carrying on from exactly where this one is, which goes its
+// own way from there. The stack and memory are shared copy on write so
+// forking is cheap however much the program has built up. NULL if the
+// vm has no program. Destroy it like any other vm.
+PLAYVM_API playvm_t *PlayVMFork(playvm_t *vm);
+
+// Run for up to budget more instructions, UINT64_MAX to run until it
+// halts or traps. Fuel is paid a whole basic block at a time so a run
+// can stop slightly short of its budget, whatever it didn't use is
+// carried over to the next run.
+PLAYVM_API playvm_status_t PlayVMRun(playvm_t *vm, uint64_t budget);
+// How many instructions the vm has run altogether
+PLAYVM_API uint64_t PlayVMRetired(const playvm_t *vm);
+// What a trapped vm did, NULL if it hasn't trapped
+PLAYVM_API const char *PlayVMTrap(const playvm_t *vm);
+
+// Registers and the instruction pointer. The setters refuse (-1) values
+// which would leave the vm somewhere it can't run from.
+PLAYVM_API int PlayVMGetRegister(const playvm_t *vm, unsigned reg, int32_t *value);
+PLAYVM_API int PlayVMSetRegister(playvm_t *vm, unsigned reg, int32_t value);
+PLAYVM_API size_t PlayVMGetIP(const playvm_t *vm);
+PLAYVM_API int PlayVMSetIP(playvm_t *vm, size_t ip);
+
+// Look up a name in the symbol table of a program loaded as a module or
+// assembly: a label is an instruction (for PlayVMSetIP()) and a .data
+// name an address in linear memory. -1 if there's no such symbol.
+PLAYVM_API int PlayVMFindSymbol(const playvm_t *vm, const char *name, uint32_t *value);
+
+// The stack. Depth is the number of values on it (r3), index 0 is the
+// top. Push and pop fail with -1 when the stack is full or empty.
+PLAYVM_API size_t PlayVMStackDepth(const playvm_t *vm);
+PLAYVM_API int PlayVMStackPeek(const playvm_t *vm, size_t index, uint32_t *value);
+PLAYVM_API int PlayVMStackPush(playvm_t *vm, uint32_t value);
+PLAYVM_API int PlayVMStackPop(playvm_t *vm, uint32_t *value);
+
+// The program's linear memory, NULL if it doesn't use any. It's only
+// valid until the next load and must not be touched while it runs.
+PLAYVM_API uint8_t *PlayVMMemory(playvm_t *vm, size_t *size);
+
+#endif // PLAYVM_H_
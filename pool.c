@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Allocation for vms. Finished vms go back into a pool with their stack
+// and arena instead of being freed, so starting a new one is usually
+// just taking one off the pool. Everything belonging to a program (the
+// JIT tables, the profile) comes out of the vm's arena and goes away
+// again in one step when the vm is recycled. The decoded instructions
+// are shared between vms, see codecache.c
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+// Smallest arena chunk we bother asking the system for
+#define ARENA_CHUNK (64 * 1024)
+
+typedef struct arena_chunk_s
+{
+	struct arena_chunk_s *next;
+	size_t size;
+	size_t used;
+	alignas(max_align_t) unsigned char data[];
+} arena_chunk_t;
+
+// Finished vms waiting to be reused, linked through runNext
+static mtx_t poolLock;
+static once_flag poolOnce = ONCE_FLAG_INIT;
+static vm_t *pool;
+
+static struct
+{
+	_Atomic uint64_t vmsCreated;
+	_Atomic uint64_t vmsReused;
+	_Atomic uint64_t arenaChunks;
+	_Atomic uint64_t arenaBytes;
+	_Atomic uint64_t stackCleared;
+} stats;
+
+static void *Allocate(size_t size)
+{
+	void *ptr = malloc(size);
+	if (!ptr)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", size, strerror(errno));
+		exit(1);
+	}
+	return ptr;
+}
+
+static arena_chunk_t *NewChunk(size_t size)
+{
+	arena_chunk_t *chunk = Allocate(sizeof(arena_chunk_t) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	atomic_fetch_add(&stats.arenaChunks, 1);
+	atomic_fetch_add(&stats.arenaBytes, size);
+	return chunk;
+}
+
+// Get zeroed memory from the arena. align has to be a power of two.
+void *ArenaAlloc(arena_t *arena, size_t size, size_t align)
+{
+	arena_chunk_t *chunk = arena->chunks;
+	
+	// Offsets are aligned relative to data[] which is max_align_t
+	// aligned, bigger alignments need the real address.
+	size_t at = 0;
+	if (chunk)
+	{
+		uintptr_t base = (uintptr_t)chunk->data;
+		at = ((base + chunk->used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+	}
+	
+	if (!chunk || at + size > chunk->size)
+	{
+		size_t want = MAX(size + align, chunk ? chunk->size * 2 : ARENA_CHUNK);
+		chunk = NewChunk(want);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		
+		uintptr_t base = (uintptr_t)chunk->data;
+		at = ((base + align - 1) & ~(uintptr_t)(align - 1)) - base;
+	}
+	
+	chunk->used = at + size;
+	memset(chunk->data + at, 0, size);
+	return chunk->data + at;
+}
+
+// Throw away everything allocated from the arena. If it needed more than
+// one chunk they're replaced by a single one big enough for all of it so
+// the next program like this one doesn't have to grow it again.
+void ArenaReset(arena_t *arena)
+{
+	arena_chunk_t *chunk = arena->chunks;
+	if (!chunk)
+		return;
+	
+	if (chunk->next)
+	{
+		size_t total = 0;
+		for (arena_chunk_t *next; chunk; chunk = next)
+		{
+			next = chunk->next;
+			total += chunk->size;
+			free(chunk);
+		}
+		arena->chunks = NewChunk(total);
+		return;
+	}
+	
+	chunk->used = 0;
+}
+
+void ArenaFree(arena_t *arena)
+{
+	for (arena_chunk_t *chunk = arena->chunks, *next; chunk; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+}
+
+static void InitPool(void)
+{
+	mtx_init(&poolLock, mtx_plain);
+}
+
+// Get a vm ready to load a program into, from the pool if there is one
+vm_t *AllocateVM(void)
+{
+	call_once(&poolOnce, InitPool);
+	
+	mtx_lock(&poolLock);
+	vm_t *vm = pool;
+	if (vm)
+		pool = vm->runNext;
+	mtx_unlock(&poolLock);
+	
+	if (vm)
+	{
+		vm->runNext = NULL;
+		atomic_fetch_add(&stats.vmsReused, 1);
+		return vm;
+	}
+	
+	vm = Allocate(sizeof(vm_t));
+	memset(vm, 0, sizeof(vm_t));
+	// The stack has pages of its own so forks can share them (see fork.c)
+	vm->opstack = mmap(NULL, MAX_STACK * sizeof(*vm->opstack), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (vm->opstack == MAP_FAILED)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", MAX_STACK * sizeof(*vm->opstack), strerror(errno));
+		exit(1);
+	}
+	vm->arena = Allocate(sizeof(arena_t));
+	memset(vm->arena, 0, sizeof(arena_t));
+	// No limit unless someone sets one
+	vm->fuel = UINT64_MAX;
+#ifdef VM_PAIR_PROFILE
+	vm->pairCounts = calloc(H_COUNT * H_COUNT, sizeof(uint64_t));
+#endif
+#ifdef VM_TRACE
+	vm->trace = calloc(1, sizeof(trace_ring_t));
+#endif
+	atomic_fetch_add(&stats.vmsCreated, 1);
+	return vm;
+}
+
+// Put a finished vm back in the pool. Only the part of the stack that
+// was actually pushed to gets cleared and the arena keeps its memory.
+void DeallocateVM(vm_t *vm)
+{
+	FreeJIT(vm->jit);
+	ReleaseCode(vm->shared);
+	ResetMemory(vm);
+	CloseFiles(vm);
+	UnloadModule(vm);
+	ArenaReset(vm->arena);
+	
+	size_t used = MIN((size_t)vm->stackHigh, (size_t)MAX_STACK);
+	if (vm->stackPages)
+	{
+		// A stack shared with forks gets fresh pages instead
+		ReleasePages(&vm->stackPages);
+		if (mmap(vm->opstack, MAX_STACK * sizeof(*vm->opstack), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+		{
+			fprintf(stderr, "failed resetting the stack: %s\n", strerror(errno));
+			exit(1);
+		}
+		used = 0;
+	}
+	memset(vm->opstack, 0, used * sizeof(*vm->opstack));
+	atomic_fetch_add(&stats.stackCleared, used * sizeof(*vm->opstack));
+	
+	// Everything else starts over except for the buffers we keep
+	unsigned *opstack = vm->opstack;
+	arena_t *arena = vm->arena;
+	uint8_t *memory = vm->memory;
+#ifdef VM_PAIR_PROFILE
+	uint64_t *pairCounts = vm->pairCounts;
+	memset(pairCounts, 0, H_COUNT * H_COUNT * sizeof(uint64_t));
+#endif
+#ifdef VM_TRACE
+	trace_ring_t *trace = vm->trace;
+	atomic_store(&trace->head, 0);
+#endif
+	
+	memset(vm, 0, sizeof(vm_t));
+	vm->opstack = opstack;
+	vm->arena = arena;
+	vm->memory = memory;
+	vm->fuel = UINT64_MAX;
+#ifdef VM_PAIR_PROFILE
+	vm->pairCounts = pairCounts;
+#endif
+#ifdef VM_TRACE
+	vm->trace = trace;
+#endif
+	
+	mtx_lock(&poolLock);
+	vm->runNext = pool;
+	pool = vm;
+	mtx_unlock(&poolLock);
+}
+
+void GetAllocStats(alloc_stats_t *out)
+{
+	GetCodeStats(out);
+	out->vmsCreated = atomic_load(&stats.vmsCreated);
+	out->vmsReused = atomic_load(&stats.vmsReused);
+	out->arenaChunks = atomic_load(&stats.arenaChunks);
+	out->arenaBytes = atomic_load(&stats.arenaBytes);
+	out->stackCleared = atomic_load(&stats.stackCleared);
+}
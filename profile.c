@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Execution profiler, built with PROFILE=1 (-DVM_PROFILE). The
+// interpreter counts every dispatch and the cycles until the next one
+// per instruction, and which way every conditional jump went, in
+// counters that belong to the vm so the workers never share any. When a
+// vm is retired its counters are added to those of every other vm that
+// ran the same program, and once everything has finished there's a
+// hot spot report and an annotated disassembly for each program.
+//
+// Superinstructions are counted against their first instruction, the
+// report shows which pair it ran as.
+
+#include "vm.h"
+
+#ifdef VM_PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+// How many instructions the hot spot report lists
+#define HOT_SPOTS 20
+
+static const char *const HandlerNames[H_COUNT] = {
+#define X(name) #name,
+	HANDLERS(X)
+#undef X
+};
+
+// Everything known about one program, from all of the vms that ran it
+typedef struct program_profile_s
+{
+	// The first vm's name, programs are told apart by the hash of their
+	// code and entry point (see codecache.c) rather than by name
+	char *name;
+	uint64_t hash;
+	size_t len;
+	size_t vms;
+	// Copy of the vm's code, that goes away with the vm
+	instruction_t *code;
+	profile_entry_t *entries;
+	struct program_profile_s *next;
+} program_profile_t;
+
+static mtx_t profileLock;
+static once_flag profileOnce = ONCE_FLAG_INIT;
+static program_profile_t *profiles;
+
+static void InitProfiles(void)
+{
+	mtx_init(&profileLock, mtx_plain);
+}
+
+static void *Allocate(size_t size)
+{
+	void *ptr = calloc(1, size);
+	if (!ptr)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", size, strerror(errno));
+		exit(1);
+	}
+	return ptr;
+}
+
+// The handler that was actually dispatched for an instruction
+static uint8_t Dispatched(const instruction_t *ins)
+{
+	uint8_t handler = ins->handler == H_BLOCK ? ins->block : ins->handler;
+	return handler == H_SYNCF ? ins->inner : handler;
+}
+
+static int EndsWith(const char *str, const char *suffix)
+{
+	size_t a = strlen(str), b = strlen(suffix);
+	return a >= b && !strcmp(str + a - b, suffix);
+}
+
+static void Disassemble(const instruction_t *ins, char *buf, size_t size)
+{
+	uint8_t handler = BaseHandler(ins);
+	const char *name = HandlerNames[handler];
+	
+	if (handler >= H_LOAD8_R && handler <= H_STORE32_I && EndsWith(name, "_R"))
+		snprintf(buf, size, "%s r%d, [r%d + %" PRId32 "]", name, ins->r0, ins->r1, ins->imm);
+	else if (handler >= H_LOAD8_R && handler <= H_STORE32_I)
+		snprintf(buf, size, "%s r%d, [%" PRId32 "]", name, ins->r0, ins->imm);
+	else if (handler == H_LEA_R)
+		snprintf(buf, size, "%s r%d, r%d + %" PRId32, name, ins->r0, ins->r1, ins->imm);
+	else if (handler == H_LEA_I)
+		snprintf(buf, size, "%s r%d, %" PRId32, name, ins->r0, ins->imm);
+	else if (EndsWith(name, "_RR"))
+		snprintf(buf, size, "%s r%d, r%d", name, ins->r0, ins->r1);
+	else if (EndsWith(name, "_RI") || handler == H_LOADI)
+		snprintf(buf, size, "%s r%d, #%" PRId32, name, ins->r0, ins->imm);
+	else if (EndsWith(name, "_R") || handler == H_INC || handler == H_DEC ||
+	         handler == H_POP || handler == H_PRNT)
+		snprintf(buf, size, "%s r%d", name, ins->r0);
+	else if (EndsWith(name, "_I"))
+		snprintf(buf, size, "%s %" PRId32, name, ins->imm);
+	else
+		snprintf(buf, size, "%s", name);
+}
+
+// Add a vm's counters to its program's
+void MergeProfile(const vm_t *vm)
+{
+	if (!vm->profile)
+		return;
+	
+	call_once(&profileOnce, InitProfiles);
+	mtx_lock(&profileLock);
+	
+	program_profile_t *p = profiles;
+	for (; p; p = p->next)
+		if (p->hash == vm->shared->hash && p->len == vm->programLength)
+			break;
+	
+	if (!p)
+	{
+		p = Allocate(sizeof(program_profile_t));
+		p->name = strdup(vm->name);
+		p->hash = vm->shared->hash;
+		p->len = vm->programLength;
+		p->code = Allocate((p->len + 1) * sizeof(instruction_t));
+		memcpy(p->code, vm->code, (p->len + 1) * sizeof(instruction_t));
+		p->entries = Allocate((p->len + 1) * sizeof(profile_entry_t));
+		p->next = profiles;
+		profiles = p;
+	}
+	
+	for (size_t i = 0; i <= p->len; ++i)
+	{
+		p->entries[i].count += vm->profile[i].count;
+		p->entries[i].cycles += vm->profile[i].cycles;
+		p->entries[i].taken += vm->profile[i].taken;
+		p->entries[i].notTaken += vm->profile[i].notTaken;
+	}
+	p->vms++;
+	
+	mtx_unlock(&profileLock);
+}
+
+static void ReportProgram(const program_profile_t *p)
+{
+	uint64_t count = 0, cycles = 0;
+	for (size_t i = 0; i <= p->len; ++i)
+	{
+		count += p->entries[i].count;
+		cycles += p->entries[i].cycles;
+	}
+	
+	fprintf(stderr, "\nProfile of %s (%zu vm%s): %" PRIu64 " dispatches, %" PRIu64 " cycles\n",
+		p->name, p->vms, p->vms == 1 ? "" : "s", count, cycles);
+	if (!count)
+		return;
+	
+	char text[64];
+	
+	// Just pick the hottest one at a time, there aren't many to show.
+	fprintf(stderr, "\nHot spots:\n");
+	fprintf(stderr, "%8s %14s %16s %7s %10s  %s\n", "ip", "count", "cycles", "cycles", "cyc/exec", "instruction");
+	char *shown = Allocate(p->len + 1);
+	for (int n = 0; n < HOT_SPOTS; ++n)
+	{
+		size_t best = SIZE_MAX;
+		for (size_t i = 0; i <= p->len; ++i)
+			if (!shown[i] && p->entries[i].count &&
+			    (best == SIZE_MAX || p->entries[i].cycles > p->entries[best].cycles))
+				best = i;
+		if (best == SIZE_MAX)
+			break;
+		shown[best] = 1;
+		
+		const profile_entry_t *e = &p->entries[best];
+		Disassemble(&p->code[best], text, sizeof(text));
+		fprintf(stderr, "%8zu %14" PRIu64 " %16" PRIu64 " %6.2f%% %10.1f  %s\n", best, e->count, e->cycles,
+			cycles ? 100.0 * e->cycles / cycles : 0.0, (double)e->cycles / e->count, text);
+	}
+	free(shown);
+	
+	// The same again per handler, which is what tuning the
+	// interpreter itself is about
+	uint64_t handlerCount[H_COUNT] = { 0 }, handlerCycles[H_COUNT] = { 0 };
+	for (size_t i = 0; i <= p->len; ++i)
+	{
+		uint8_t handler = Dispatched(&p->code[i]);
+		handlerCount[handler] += p->entries[i].count;
+		handlerCycles[handler] += p->entries[i].cycles;
+	}
+	
+	fprintf(stderr, "\nHandlers:\n");
+	fprintf(stderr, "%-16s %14s %16s %7s %10s\n", "handler", "count", "cycles", "cycles", "cyc/exec");
+	for (;;)
+	{
+		int best = -1;
+		for (int h = 0; h < H_COUNT; ++h)
+			if (handlerCount[h] && (best == -1 || handlerCycles[h] > handlerCycles[best]))
+				best = h;
+		if (best == -1)
+			break;
+		fprintf(stderr, "%-16s %14" PRIu64 " %16" PRIu64 " %6.2f%% %10.1f\n", HandlerNames[best],
+			handlerCount[best], handlerCycles[best], cycles ? 100.0 * handlerCycles[best] / cycles : 0.0,
+			(double)handlerCycles[best] / handlerCount[best]);
+		handlerCount[best] = 0;
+	}
+	
+	fprintf(stderr, "\nDisassembly:\n");
+	fprintf(stderr, "%8s %14s %16s %25s  %s\n", "ip", "count", "cycles", "taken/not taken", "instruction");
+	for (size_t i = 0; i < p->len; ++i)
+	{
+		const profile_entry_t *e = &p->entries[i];
+		char branch[32] = "";
+		if (e->taken || e->notTaken)
+			snprintf(branch, sizeof(branch), "%" PRIu64 "/%" PRIu64, e->taken, e->notTaken);
+		
+		Disassemble(&p->code[i], text, sizeof(text));
+		uint8_t handler = Dispatched(&p->code[i]);
+		if (handler != BaseHandler(&p->code[i]))
+			fprintf(stderr, "%8zu %14" PRIu64 " %16" PRIu64 " %25s  %-24s [runs as %s]\n", i, e->count, e->cycles,
+				branch, text, HandlerNames[handler]);
+		else
+			fprintf(stderr, "%8zu %14" PRIu64 " %16" PRIu64 " %25s  %s\n", i, e->count, e->cycles, branch, text);
+	}
+}
+
+// Print everything that was merged, once all of the vms are done
+void ReportProfiles(void)
+{
+	call_once(&profileOnce, InitProfiles);
+	mtx_lock(&profileLock);
+	
+	for (program_profile_t *p = profiles; p; p = p->next)
+		ReportProgram(p);
+	
+	mtx_unlock(&profileLock);
+}
+
+#endif // VM_PROFILE
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// The registry of every live vm. Each vm gets a slot and a handle made
+// of the slot number and the slot's generation, so a handle to a vm that
+// has gone away is simply not found any more rather than pointing at
+// whatever got the slot next. Registering and unregistering are O(1)
+// and lock-free, free slots are kept on a tagged Treiber stack.
+//
+// A vm is only deallocated once nobody is using it: the registry holds
+// one reference while the vm is registered and LookupVM() takes another
+// which ReleaseVM() drops, whoever drops the last one frees it.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+// Slots are allocated a chunk at a time and never move
+#define CHUNK_BITS  10
+#define CHUNK_SLOTS (1 << CHUNK_BITS)
+#define MAX_CHUNKS  1024
+
+// Slot state: generation in the top 32 bits, then the alive bit and the
+// reference count at the bottom.
+#define STATE_ALIVE   (UINT64_C(1) << 31)
+#define STATE_REFS    (STATE_ALIVE - 1)
+#define STATE_GEN(s)  ((uint32_t)((s) >> 32))
+
+typedef struct slot_s
+{
+	_Atomic uint64_t state;
+	_Atomic(vm_t*) vm;
+	// Next free slot + 1 while this one is on the free list
+	_Atomic uint32_t nextFree;
+} slot_t;
+
+static _Atomic(slot_t*) chunks[MAX_CHUNKS];
+// Slots handed out so far, anything below this has a chunk
+static _Atomic uint32_t used;
+// Top of the free list, (tag << 32) | (slot + 1). The tag changes on
+// every push so a pop can't be fooled by a slot that was popped and
+// pushed back in the meantime.
+static _Atomic uint64_t freeList;
+static _Atomic size_t live;
+
+static slot_t *Slot(uint32_t index)
+{
+	return &atomic_load(&chunks[index >> CHUNK_BITS])[index & (CHUNK_SLOTS - 1)];
+}
+
+static vm_handle_t MakeHandle(uint32_t index, uint32_t gen)
+{
+	return ((uint64_t)gen << 32) | index;
+}
+
+static void PushFree(uint32_t index)
+{
+	uint64_t head = atomic_load(&freeList), next;
+	do
+	{
+		atomic_store_explicit(&Slot(index)->nextFree, (uint32_t)head, memory_order_relaxed);
+		next = ((((head >> 32) + 1) & UINT32_MAX) << 32) | (index + 1);
+	} while (!atomic_compare_exchange_weak(&freeList, &head, next));
+}
+
+// Returns the slot number + 1 or 0 when there aren't any free slots
+static uint32_t PopFree(void)
+{
+	uint64_t head = atomic_load(&freeList), next;
+	do
+	{
+		if (!(uint32_t)head)
+			return 0;
+		uint32_t after = atomic_load_explicit(&Slot((uint32_t)head - 1)->nextFree, memory_order_relaxed);
+		next = (head & ~(uint64_t)UINT32_MAX) | after;
+	} while (!atomic_compare_exchange_weak(&freeList, &head, next));
+	
+	return (uint32_t)head;
+}
+
+static uint32_t NewSlot(void)
+{
+	uint32_t index = atomic_fetch_add(&used, 1);
+	if (index >= (uint32_t)MAX_CHUNKS * CHUNK_SLOTS)
+	{
+		fprintf(stderr, "Too many vms, the registry only has room for %d\n", MAX_CHUNKS * CHUNK_SLOTS);
+		exit(1);
+	}
+	
+	// Whoever gets here first for a chunk allocates it
+	_Atomic(slot_t*) *chunk = &chunks[index >> CHUNK_BITS];
+	if (!atomic_load(chunk))
+	{
+		slot_t *fresh = calloc(CHUNK_SLOTS, sizeof(slot_t)), *expected = NULL;
+		if (!fresh)
+		{
+			fprintf(stderr, "failed allocating %zu bytes: %s\n", CHUNK_SLOTS * sizeof(slot_t), strerror(errno));
+			exit(1);
+		}
+		if (!atomic_compare_exchange_strong(chunk, &expected, fresh))
+			free(fresh);
+	}
+	
+	return index;
+}
+
+// The last reference to the vm is gone, free it and its slot
+static void Reclaim(uint32_t index, slot_t *slot, uint64_t state)
+{
+	vm_t *vm = atomic_exchange(&slot->vm, NULL);
+	// Bumping the generation makes every old handle stale
+	atomic_store(&slot->state, (uint64_t)(STATE_GEN(state) + 1) << 32);
+	atomic_fetch_sub(&live, 1);
+	PushFree(index);
+	DeallocateVM(vm);
+}
+
+// Add a vm to the registry and get its handle
+vm_handle_t RegisterVM(vm_t *vm)
+{
+	uint32_t index = PopFree();
+	if (index)
+		index--;
+	else
+		index = NewSlot();
+	
+	slot_t *slot = Slot(index);
+	uint32_t gen = STATE_GEN(atomic_load(&slot->state));
+	// Generation 0 is never used so a zeroed handle is never valid
+	if (!gen)
+		gen = 1;
+	
+	atomic_store(&slot->vm, vm);
+	atomic_store(&slot->state, ((uint64_t)gen << 32) | STATE_ALIVE | 1);
+	atomic_fetch_add(&live, 1);
+	
+	vm->handle = MakeHandle(index, gen);
+	return vm->handle;
+}
+
+// Get the vm a handle refers to, or NULL if it has been unregistered.
+// The vm stays allocated until it's given back with ReleaseVM().
+vm_t *LookupVM(vm_handle_t handle)
+{
+	uint32_t index = (uint32_t)handle, gen = STATE_GEN(handle);
+	if (index >= atomic_load(&used) || !atomic_load(&chunks[index >> CHUNK_BITS]))
+		return NULL;
+	
+	slot_t *slot = Slot(index);
+	uint64_t state = atomic_load(&slot->state);
+	do
+	{
+		if (STATE_GEN(state) != gen || !(state & STATE_ALIVE))
+			return NULL;
+	} while (!atomic_compare_exchange_weak(&slot->state, &state, state + 1));
+	
+	return atomic_load(&slot->vm);
+}
+
+void ReleaseVM(vm_handle_t handle)
+{
+	uint32_t index = (uint32_t)handle;
+	slot_t *slot = Slot(index);
+	uint64_t state = atomic_fetch_sub(&slot->state, 1);
+	
+	if ((state & STATE_REFS) == 1 && !(state & STATE_ALIVE))
+		Reclaim(index, slot, state);
+}
+
+// Take a vm out of the registry. Its handle stops working straight away
+// but the vm is only freed once the last LookupVM() user releases it.
+void UnregisterVM(vm_handle_t handle)
+{
+	slot_t *slot = Slot((uint32_t)handle);
+	uint64_t state = atomic_load(&slot->state);
+	do
+	{
+		if (STATE_GEN(state) != STATE_GEN(handle) || !(state & STATE_ALIVE))
+			return;
+	} while (!atomic_compare_exchange_weak(&slot->state, &state, state & ~STATE_ALIVE));
+	
+	// Drop the registry's own reference
+	ReleaseVM(handle);
+}
+
+// Number of vms registered and not yet freed
+size_t LiveVMs(void)
+{
+	return atomic_load(&live);
+}
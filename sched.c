@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// An M:N scheduler. A fixed pool of worker threads (one per core unless
+// asked otherwise) runs all of the vms. Every worker has its own run
+// queue and runs the vm at the front of it for a quantum of instructions
+// using the fuel metering, then puts it on the back again if it still
+// has work to do. Workers that run out of vms steal from the others.
+// Switching vms is just returning from interpret() so there are no OS
+// context switches no matter how many programs are running. A vm making
+// a system call is parked with the I/O threads (see io.c) and goes back
+// on a run queue once it's done, so programs waiting on I/O never hold
+// up a worker.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+typedef struct worker_s
+{
+	// Run queue, linked through vm_t::runNext
+	mtx_t lock;
+	vm_t *head, *tail;
+	
+	thrd_t thread;
+	size_t id;
+	struct scheduler_s *sched;
+} worker_t;
+
+typedef struct scheduler_s
+{
+	worker_t *workers;
+	size_t nworkers;
+	
+	// Instructions a vm gets to run before the next one has a go
+	uint64_t quantum;
+	
+	// vms which haven't been retired yet, the workers quit at 0. That
+	// includes the ones waiting on I/O.
+	_Atomic size_t live;
+	// Which worker gets the next vm scheduled
+	size_t next;
+	// and the next one back from I/O
+	_Atomic size_t woken;
+} scheduler_t;
+
+static void PushVM(worker_t *w, vm_t *vm)
+{
+	vm->runNext = NULL;
+	mtx_lock(&w->lock);
+	if (w->tail)
+		w->tail->runNext = vm;
+	else
+		w->head = vm;
+	w->tail = vm;
+	mtx_unlock(&w->lock);
+}
+
+static vm_t *PopVM(worker_t *w)
+{
+	mtx_lock(&w->lock);
+	vm_t *vm = w->head;
+	if (vm)
+	{
+		w->head = vm->runNext;
+		if (!w->head)
+			w->tail = NULL;
+	}
+	mtx_unlock(&w->lock);
+	return vm;
+}
+
+// Take a vm off someone else's queue. Their queues are only tried, not
+// waited on, anyone holding a lock is busy and we just try the next one.
+static vm_t *StealVM(worker_t *self)
+{
+	scheduler_t *s = self->sched;
+	
+	for (size_t i = 1; i < s->nworkers; ++i)
+	{
+		worker_t *victim = &s->workers[(self->id + i) % s->nworkers];
+		
+		if (mtx_trylock(&victim->lock) != thrd_success)
+			continue;
+		
+		vm_t *vm = victim->head;
+		if (vm)
+		{
+			victim->head = vm->runNext;
+			if (!victim->head)
+				victim->tail = NULL;
+		}
+		mtx_unlock(&victim->lock);
+		
+		if (vm)
+			return vm;
+	}
+	
+	return NULL;
+}
+
+// Run a vm for one quantum. The vm's fuel is the whole budget it has
+// left so it's swapped for the quantum while running and whatever was
+// used comes off the budget afterwards. Returns 1 if the vm only stopped
+// because the quantum ran out.
+static int RunQuantum(vm_t *vm, uint64_t quantum)
+{
+	uint64_t budget = vm->fuel;
+	uint64_t slice = MIN(budget, quantum);
+	
+	// A block which is longer than the quantum still has to be able to run
+	if (vm->yielded)
+		slice = MIN(budget, MAX(slice, vm->code[MIN(vm->ip, vm->programLength)].left));
+	
+	vm->fuel = slice;
+	RunUntilSyscall(vm);
+	vm->fuel = budget - (slice - vm->fuel);
+	
+	return vm->running && vm->yielded && slice < budget;
+}
+
+// A vm's system call is done, the I/O thread puts it back on a queue
+static void Woken(vm_t *vm, void *arg)
+{
+	scheduler_t *s = arg;
+	PushVM(&s->workers[atomic_fetch_add(&s->woken, 1) % s->nworkers], vm);
+}
+
+static void WorkerThread(void *ptr)
+{
+	worker_t *self = ptr;
+	scheduler_t *s = self->sched;
+	
+	// How long to wait when there's nothing to run or steal
+	const xtime idle = { 0, 100000 };
+	
+	for (;;)
+	{
+		vm_t *vm = PopVM(self);
+		if (!vm)
+			vm = StealVM(self);
+		
+		if (!vm)
+		{
+			if (atomic_load(&s->live) == 0)
+				break;
+			thrd_sleep(&idle);
+			continue;
+		}
+		
+		if (RunQuantum(vm, s->quantum))
+			PushVM(self, vm);
+		else if (vm->waiting)
+			SubmitIO(vm, Woken, s);
+		else
+		{
+			RetireVM(vm);
+			atomic_fetch_sub(&s->live, 1);
+		}
+	}
+	
+	thrd_exit(0);
+}
+
+// Create a scheduler with the given number of workers, 0 means one per
+// core. Nothing runs until RunScheduler().
+scheduler_t *CreateScheduler(size_t workers, uint64_t quantum)
+{
+	if (!workers)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cores > 0 ? (size_t)cores : 1;
+	}
+	
+	scheduler_t *s = calloc(1, sizeof(scheduler_t));
+	if (!s || !(s->workers = calloc(workers, sizeof(worker_t))))
+	{
+		fprintf(stderr, "failed allocating the scheduler: %s\n", strerror(errno));
+		exit(1);
+	}
+	
+	s->nworkers = workers;
+	s->quantum = quantum ? quantum : 1;
+	atomic_init(&s->live, 0);
+	atomic_init(&s->woken, 0);
+	
+	for (size_t i = 0; i < workers; ++i)
+	{
+		s->workers[i].id = i;
+		s->workers[i].sched = s;
+		mtx_init(&s->workers[i].lock, mtx_plain);
+	}
+	
+	return s;
+}
+
+// Hand a loaded vm to the scheduler, they're spread over the workers
+// round robin and get moved around by stealing later.
+void Schedule(scheduler_t *s, vm_t *vm)
+{
+	atomic_fetch_add(&s->live, 1);
+	PushVM(&s->workers[s->next++ % s->nworkers], vm);
+}
+
+// Start the workers and wait until every scheduled vm has been retired.
+void RunScheduler(scheduler_t *s)
+{
+	printf("Running programs on %zu worker threads\n", s->nworkers);
+	
+	size_t started = 0;
+	for (size_t i = 0; i < s->nworkers; ++i)
+	{
+		if (thrd_create(&s->workers[i].thread, WorkerThread, &s->workers[i]) != thrd_success)
+		{
+			fprintf(stderr, "Failed to start worker thread %zu!\n", i);
+			break;
+		}
+		started++;
+	}
+	
+	// Without any workers at all just run everything right here,
+	// system calls included.
+	if (!started)
+	{
+		worker_t *w = &s->workers[0];
+		for (vm_t *vm; (vm = PopVM(w)) || (vm = StealVM(w));)
+		{
+			while (RunQuantum(vm, s->quantum) || vm->waiting)
+				if (vm->waiting)
+					Syscall(vm);
+			RetireVM(vm);
+			atomic_fetch_sub(&s->live, 1);
+		}
+		return;
+	}
+	
+	for (size_t i = 0; i < started; ++i)
+	{
+		int res = 0;
+		thrd_join(s->workers[i].thread, &res);
+	}
+}
+
+void DestroyScheduler(scheduler_t *s)
+{
+	for (size_t i = 0; i < s->nworkers; ++i)
+		mtx_destroy(&s->workers[i].lock);
+	free(s->workers);
+	free(s);
+}
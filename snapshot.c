@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Saving and restoring vms, see snapshot.h for the file layout. Only a
+// vm which can still run is worth saving. Files the program has open
+// can't be saved, nor can anything the host is keeping track of for
+// the vm, so those are up to whoever restores it.
+
+#include "vm.h"
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Write all of len or fail
+static int WriteAll(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	while (len)
+	{
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+// Save the vm to path. It's written next to it and renamed into place
+// so nothing ever sees half a snapshot.
+int SaveSnapshot(vm_t *vm, const char *path)
+{
+	if (!vm->running || !vm->shared)
+	{
+		fprintf(stderr, "%s: only a vm which can still run can be saved\n", vm->name);
+		return -1;
+	}
+	for (int fd = 3; fd < VM_FILES; ++fd)
+	{
+		if (vm->files[fd])
+		{
+			fprintf(stderr, "%s: has files open, they can't be saved\n", vm->name);
+			return -1;
+		}
+	}
+	
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	// The program can put anything in r3
+	uint32_t depth = vm->regs[3] < 0 ? 0 : (uint32_t)MIN(vm->regs[3], MAX_STACK);
+	
+	snapshot_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.flags = vm->waiting ? SNAPSHOT_WAITING : 0;
+	h.headerSize = sizeof(h);
+	h.pageSize = (uint32_t)page;
+	h.program = vm->shared->hash;
+	h.programLength = vm->programLength;
+	MaterializeFlags(vm);
+	memcpy(h.regs, vm->regs, sizeof(vm->regs));
+	h.ip = vm->ip;
+	h.retired = vm->retired;
+	h.syscall = vm->syscall;
+	h.stackDepth = depth;
+	h.stackOffset = sizeof(h);
+	h.memoryOffset = (h.stackOffset + (uint64_t)depth * sizeof(*vm->opstack) + page - 1) & ~(page - 1);
+	h.memorySize = vm->memorySize;
+	
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: failed saving to %s: %s\n", vm->name, tmp, strerror(errno));
+		return -1;
+	}
+	
+	// The gap up to the memory is left as a hole
+	if (WriteAll(fd, &h, sizeof(h)) != 0 ||
+	    WriteAll(fd, vm->opstack, depth * sizeof(*vm->opstack)) != 0 ||
+	    lseek(fd, (off_t)h.memoryOffset, SEEK_SET) < 0 ||
+	    WriteAll(fd, vm->memory, h.memorySize) != 0 ||
+	    ftruncate(fd, (off_t)(h.memoryOffset + h.memorySize)) != 0)
+	{
+		fprintf(stderr, "%s: failed saving to %s: %s\n", vm->name, tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	if (close(fd) != 0)
+	{
+		fprintf(stderr, "%s: failed saving to %s: %s\n", vm->name, tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	
+	if (rename(tmp, path) != 0)
+	{
+		fprintf(stderr, "%s: failed saving to %s: %s\n", vm->name, path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+// Carry on from the snapshot at path. The vm has to have loaded the
+// program the snapshot was taken of already.
+int RestoreSnapshot(vm_t *vm, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: failed opening snapshot %s: %s\n", vm->name, path, strerror(errno));
+		return -1;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(snapshot_header_t))
+	{
+		fprintf(stderr, "%s: %s isn't a snapshot\n", vm->name, path);
+		close(fd);
+		return -1;
+	}
+	
+	size_t len = (size_t)st.st_size;
+	const unsigned char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: failed mapping snapshot %s: %s\n", vm->name, path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	const snapshot_header_t *h = (const snapshot_header_t*)data;
+	int ret = -1;
+	
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) || h->version != SNAPSHOT_VERSION)
+	{
+		fprintf(stderr, "%s: %s isn't a snapshot this version can restore\n", vm->name, path);
+		goto out;
+	}
+	if (!vm->shared || h->program != vm->shared->hash || h->programLength != vm->programLength)
+	{
+		fprintf(stderr, "%s: %s is a snapshot of a different program\n", vm->name, path);
+		goto out;
+	}
+	if (h->headerSize < sizeof(snapshot_header_t) || h->ip > vm->programLength ||
+	    h->stackDepth > MAX_STACK ||
+	    h->stackOffset > len || h->stackDepth * sizeof(*vm->opstack) > len - h->stackOffset ||
+	    h->stackOffset % sizeof(*vm->opstack) ||
+	    h->memorySize != vm->memorySize || h->memoryOffset > len || h->memorySize > len - h->memoryOffset)
+	{
+		fprintf(stderr, "%s: corrupt snapshot %s\n", vm->name, path);
+		goto out;
+	}
+	
+	// The memory is mapped over the vm's own when it's page aligned,
+	// it always is unless the snapshot came from a machine with bigger
+	// pages. Forks of the vm share the mapping too (see fork.c) and
+	// ResetMemory() maps fresh pages over it again.
+	if (h->memorySize)
+	{
+#ifdef VM_MEMORY_GUARD
+		if (h->memoryOffset % (uint64_t)sysconf(_SC_PAGESIZE) == 0)
+		{
+			if (ShareFileMemory(vm, fd, h->memoryOffset) != 0)
+			{
+				fprintf(stderr, "%s: failed mapping snapshot memory: %s\n", vm->name, strerror(errno));
+				goto out;
+			}
+		}
+		else
+#endif
+			memcpy(vm->memory, data + h->memoryOffset, h->memorySize);
+	}
+	
+	memcpy(vm->opstack, data + h->stackOffset, h->stackDepth * sizeof(*vm->opstack));
+	vm->stackHigh = MAX(vm->stackHigh, h->stackDepth);
+	// SaveSnapshot() materialized the flags, r4 is taken as it was, bits
+	// the program keeps next to them included
+	memcpy(vm->regs, h->regs, sizeof(vm->regs));
+	vm->lazyOp = LAZY_NONE;
+	vm->ip = h->ip;
+	vm->retired = h->retired;
+	vm->syscall = h->syscall;
+	vm->waiting = !!(h->flags & SNAPSHOT_WAITING);
+	vm->trap = TRAP_NONE;
+	vm->running = 1;
+	// The ip can be anywhere in a block, this gets ResumeFuel() to pay
+	// for the rest of it.
+	vm->yielded = 1;
+	// Nothing says the stack in the file is one the program could have
+	// got to, so it's checked from here on. The same goes for the
+	// registers and the optimized code.
+	vm->maxDepth = SIZE_MAX;
+	DeoptimizeVM(vm);
+	ret = 0;
+	
+out:
+	munmap((void*)data, len);
+	close(fd);
+	return ret;
+}
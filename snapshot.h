@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+// Snapshot files. A snapshot is a vm stopped part way through its
+// program, saved so any number of vms can carry on from there without
+// running the start of the program again. The program itself isn't in
+// the file, only its hash (see code_t), restoring needs the vm to have
+// loaded the same program first.
+//
+//   snapshot_header_t
+//   stack    stackDepth 4 byte values, the bottom of the stack first
+//   memory   memorySize bytes of linear memory, page aligned
+//
+// Nothing is parsed when restoring: the header and stack are used out
+// of a mapping of the file and the memory is mapped copy on write
+// straight into the vm's linear memory, so vms restored from the same
+// snapshot share its pages until they write to them.
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC   "PVMSNAPS"
+#define SNAPSHOT_VERSION 1
+
+// The vm was waiting on a system call, it's made again when restored
+#define SNAPSHOT_WAITING (1u << 0)
+
+typedef struct snapshot_header_s
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t headerSize;
+	uint32_t pageSize;
+	// What the vm was running
+	uint64_t program;
+	uint64_t programLength;
+	
+	// Registers with the flags in r4 up to date
+	int32_t regs[8];
+	uint64_t ip;
+	uint64_t retired;
+	int32_t syscall;
+	uint32_t stackDepth;
+	
+	uint64_t stackOffset;
+	uint64_t memoryOffset;
+	uint64_t memorySize;
+} snapshot_header_t;
+
+#endif // SNAPSHOT_H_
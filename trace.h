@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+// Execution tracing. Build with -DVM_TRACE (make TRACE=1) and every
+// instruction the interpreter fetches is written as a fixed-size binary
+// record into a ring buffer owned by its vm. Nothing is formatted while
+// the program runs, the ring is written out to <program>.trace when the
+// vm finishes and playvm-tracedump turns that into text. Without
+// VM_TRACE the trace points compile to nothing.
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Number of records each vm keeps, has to be a power of two. Once it's
+// full the oldest records are overwritten.
+#ifndef VM_TRACE_RECORDS
+# define VM_TRACE_RECORDS (1 << 16)
+#endif
+
+#define TRACE_MAGIC   "PVMTRACE"
+#define TRACE_VERSION 1
+
+// One fetched instruction
+typedef struct trace_record_s
+{
+	uint32_t ip;
+	uint16_t opcode;
+	// The handler it was dispatched to (see HANDLERS in vm.h), without
+	// the BLOCK wrapper so fused and SYNCF handlers still show up
+	uint8_t handler;
+	uint8_t type;
+	uint8_t r0;
+	uint8_t r1;
+	uint8_t r2;
+	uint8_t pad;
+	int32_t imm;
+	// r4 as it was before the instruction ran
+	int32_t flags;
+} trace_record_t;
+
+// Start of a .trace file, followed by the records oldest first.
+typedef struct trace_header_s
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	// Records ever written, anything past the ones in the file
+	// was overwritten before the ring was saved.
+	uint64_t total;
+	uint64_t count;
+} trace_header_t;
+
+// Only the vm's own thread writes to its ring, head is published with
+// release ordering so anyone else can read the records behind it
+// without taking a lock.
+typedef struct trace_ring_s
+{
+	_Atomic uint64_t head;
+	trace_record_t records[VM_TRACE_RECORDS];
+} trace_ring_t;
+
+static inline void TraceRecord(trace_ring_t *ring, const trace_record_t *rec)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	ring->records[head & (VM_TRACE_RECORDS - 1)] = *rec;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#ifdef VM_TRACE
+// Record the instruction ins at ip in the vm's ring
+# define TRACE(vm, at, ins) do { \
+	trace_record_t rec_ = { \
+		.ip = (uint32_t)(at), .opcode = (ins)->opcode, \
+		.handler = (ins)->handler == H_BLOCK ? (ins)->block : (ins)->handler, \
+		.type = (ins)->type, .r0 = (ins)->r0, .r1 = (ins)->r1, .r2 = (ins)->r2, \
+		.imm = (ins)->imm, .flags = ((vm)->regs[4] & ~FLAG_MASK) | ReadFlags((vm), FLAG_MASK) \
+	}; \
+	TraceRecord((vm)->trace, &rec_); \
+} while(0)
+#else
+# define TRACE(vm, at, ins) do { } while(0)
+#endif
+
+#endif // TRACE_H_
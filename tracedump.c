@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Turns the binary .trace files written by a traced build (make TRACE=1)
+// back into readable text, one line per instruction.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char *const HandlerNames[H_COUNT] = {
+#define X(name) #name,
+	HANDLERS(X)
+#undef X
+};
+
+static const char *OpcodeName(uint16_t opcode)
+{
+	switch(opcode)
+	{
+		case OP_UNUSED: return "UNUSED";
+		case OP_NOP:    return "NOP";
+		case OP_ADD:    return "ADD";
+		case OP_SUB:    return "SUB";
+		case OP_MUL:    return "MUL";
+		case OP_DIV:    return "DIV";
+		case OP_XOR:    return "XOR";
+		case OP_OR:     return "OR";
+		case OP_NOT:    return "NOT";
+		case OP_AND:    return "AND";
+		case OP_SHR:    return "SHR";
+		case OP_SHL:    return "SHL";
+		case OP_INC:    return "INC";
+		case OP_DEC:    return "DEC";
+		case OP_MOV:    return "MOV";
+		case OP_CMP:    return "CMP";
+		case OP_CALL:   return "CALL";
+		case OP_RET:    return "RET";
+		case OP_PUSH:   return "PUSH";
+		case OP_POP:    return "POP";
+		case OP_LEA:    return "LEA";
+		case OP_JMP:    return "JMP";
+		case OP_JNZ:    return "JNZ";
+		case OP_JZ:     return "JZ";
+		case OP_JS:     return "JS";
+		case OP_JNS:    return "JNS";
+		case OP_JGT:    return "JGT";
+		case OP_JLT:    return "JLT";
+		case OP_JPE:    return "JPE";
+		case OP_JPO:    return "JPO";
+		case OP_HALT:   return "HALT";
+		case OP_INT:    return "INT";
+		case OP_LOADI:  return "LOADI";
+		case OP_PUSHF:  return "PUSHF";
+		case OP_POPF:   return "POPF";
+		case OP_LOAD8:  return "LOAD8";
+		case OP_LOAD16: return "LOAD16";
+		case OP_LOAD32: return "LOAD32";
+		case OP_STORE8: return "STORE8";
+		case OP_STORE16: return "STORE16";
+		case OP_STORE32: return "STORE32";
+		case OP_DMP:    return "DMP";
+		case OP_PRNT:   return "PRNT";
+		default:        return "???";
+	}
+}
+
+static void PrintRecord(const trace_record_t *rec)
+{
+	char flags[6] = "-----";
+	const char letters[] = "CZOSP";
+	for (int i = 0; i < 5; ++i)
+		if (rec->flags & (1 << i))
+			flags[i] = letters[i];
+	
+	printf("%8" PRIu32 "  %-6s r%u, ", rec->ip, OpcodeName(rec->opcode), rec->r0);
+	if (rec->type == OP_FLAG_IMMEDIATE)
+		printf("#%-6" PRId32, rec->imm);
+	else
+		printf("r%-6u", rec->r1);
+	printf(" [%s] %s\n", flags, rec->handler < H_COUNT ? HandlerNames[rec->handler] : "?");
+}
+
+int DumpTrace(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		perror(path);
+		return 1;
+	}
+	
+	trace_header_t header;
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.version != TRACE_VERSION ||
+	    header.recordSize != sizeof(trace_record_t))
+	{
+		fprintf(stderr, "%s is not a trace file from this version of the vm\n", path);
+		fclose(f);
+		return 1;
+	}
+	
+	printf("%s: %" PRIu64 " instructions traced", path, header.total);
+	if (header.total > header.count)
+		printf(", the first %" PRIu64 " were overwritten", header.total - header.count);
+	printf("\n");
+	
+	trace_record_t rec;
+	for (uint64_t i = 0; i < header.count && fread(&rec, sizeof(rec), 1, f) == 1; ++i)
+		PrintRecord(&rec);
+	
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "USAGE: %s program.trace ...\n", argv[0]);
+		return 1;
+	}
+	
+	int failed = 0;
+	for (int i = 1; i < argc; ++i)
+		failed |= DumpTrace(argv[i]);
+	return failed;
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+// Load-time bytecode verifier. Every program is checked once when it's
+// compiled so the interpreter doesn't have to keep checking the same
+// things on every instruction it runs:
+//
+//  - every opcode has to be one we know about
+//  - every register an instruction actually uses has to exist, the
+//    operand fields are 4 bits wide but there are only NUM_REGS
+//  - every immediate jump or call has to land inside the program
+//
+// On top of that it tries to work out how deep the stack can get. That
+// only works for programs which leave r3 to PUSH/POP/CALL/RET and don't
+// make computed jumps, and where every function (CALL target) returns
+// with the stack as it found it. For those the interpreter drops its
+// stack checks too, anything else keeps them.
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Function depths while they're being worked out
+#define DEPTH_UNKNOWN    (-1)
+#define DEPTH_VISITING   (-2)
+#define DEPTH_UNBOUNDED  (-3)
+
+// A CALL found walking a function, with how deep the stack was there
+typedef struct
+{
+	size_t callee;
+	int32_t depth;
+} call_t;
+
+// A function waiting on the functions it calls
+typedef struct
+{
+	size_t entry;
+	int64_t deepest;
+	call_t *calls;
+	size_t callCount, next;
+} frame_t;
+
+typedef struct
+{
+	const instruction_t *code;
+	size_t len;
+	// How deep each CALL target takes the stack, including what it
+	// calls, or one of the DEPTH_ values above
+	int64_t *functions;
+	// Used by one function walk at a time, only what a walk visited
+	// gets reset afterwards
+	int32_t *depth;
+	size_t *work;
+	// Functions being worked out, each one waiting on the last
+	frame_t *frames;
+	size_t frameCount, frameCap;
+} verifier_t;
+
+// Which of the register fields the handler reads or writes
+static int UsesR0(uint8_t handler)
+{
+	switch(handler)
+	{
+		case H_UNUSED: case H_NOP: case H_HALT: case H_UNIMPL:
+		case H_DMP: case H_UNKNOWN: case H_END: case H_INT:
+		case H_CALL_I: case H_RET: case H_PUSH_I: case H_PUSHF: case H_POPF:
+		case H_JMP_I: case H_JNZ_I: case H_JZ_I: case H_JS_I:
+		case H_JNS_I: case H_JGT_I: case H_JLT_I: case H_JPE_I: case H_JPO_I:
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+static int UsesR1(uint8_t handler)
+{
+	switch(handler)
+	{
+		case H_ADD_RR: case H_SUB_RR: case H_MUL_RR: case H_DIV_RR:
+		case H_XOR_RR: case H_OR_RR:  case H_AND_RR: case H_SHL_RR:
+		case H_SHR_RR: case H_NOT_RR: case H_MOV_RR: case H_CMP_RR:
+		case H_LEA_R:  case H_LOAD8_R: case H_LOAD16_R: case H_LOAD32_R:
+		case H_STORE8_R: case H_STORE16_R: case H_STORE32_R:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Instructions which write r0 (as opposed to just reading it)
+static int WritesR0(uint8_t handler)
+{
+	switch(handler)
+	{
+		case H_LOADI: case H_INC: case H_DEC: case H_POP:
+		case H_ADD_RR: case H_ADD_RI: case H_SUB_RR: case H_SUB_RI:
+		case H_MUL_RR: case H_MUL_RI: case H_DIV_RR: case H_DIV_RI:
+		case H_XOR_RR: case H_XOR_RI: case H_OR_RR:  case H_OR_RI:
+		case H_AND_RR: case H_AND_RI: case H_SHL_RR: case H_SHL_RI:
+		case H_SHR_RR: case H_SHR_RI: case H_NOT_RR: case H_NOT_RI:
+		case H_MOV_RR: case H_MOV_RI:
+		case H_LEA_R:  case H_LEA_I:
+		case H_LOAD8_R: case H_LOAD8_I: case H_LOAD16_R: case H_LOAD16_I:
+		case H_LOAD32_R: case H_LOAD32_I:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Immediate jumps and calls, which can be checked now
+static int JumpsImmediate(uint8_t handler)
+{
+	switch(handler)
+	{
+		case H_CALL_I: case H_JMP_I: case H_JNZ_I: case H_JZ_I: case H_JS_I:
+		case H_JNS_I: case H_JGT_I: case H_JLT_I: case H_JPE_I: case H_JPO_I:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Computed jumps, which can go anywhere
+static int JumpsIndirect(uint8_t handler)
+{
+	switch(handler)
+	{
+		case H_CALL_R: case H_JMP_R: case H_JNZ_R: case H_JZ_R: case H_JS_R:
+		case H_JNS_R: case H_JGT_R: case H_JLT_R: case H_JPE_R: case H_JPO_R:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Make room for one more of something in a growable array
+#define GROW(arr, count, cap) do { \
+	if ((count) == (cap)) \
+	{ \
+		size_t ncap_ = (cap) ? (cap) * 2 : 16; \
+		void *narr_ = realloc((arr), ncap_ * sizeof(*(arr))); \
+		if (!narr_) \
+		{ \
+			fprintf(stderr, "failed allocating %zu bytes: %s\n", ncap_ * sizeof(*(arr)), strerror(errno)); \
+			exit(1); \
+		} \
+		(arr) = narr_; \
+		(cap) = ncap_; \
+	} \
+} while(0)
+
+// Walk everything reachable from entry keeping track of the stack depth
+// relative to where it was on entry. Every instruction has to be reached
+// with the same depth every time and RET has to find the stack exactly
+// as the CALL left it, so it pops the return address the CALL pushed.
+// Sets f->deepest to the deepest the function's own pushes take the
+// stack and collects its CALLs in f->calls, the callees are worked out
+// afterwards. Returns 0 or DEPTH_UNBOUNDED.
+static int64_t WalkFunction(verifier_t *v, frame_t *f, int main)
+{
+	const instruction_t *code = v->code;
+	int32_t *depth = v->depth;
+	size_t *work = v->work, visited = 0, callCap = 0;
+	int64_t result = 0;
+	
+	f->deepest = 0;
+	f->calls = NULL;
+	f->callCount = f->next = 0;
+	
+	// Fall through or jump to ip with the stack d deep. Running off the
+	// end of the program ends up on the END sentinel which stops it.
+	// work holds everything visited so far, in the order it's walked.
+#define VISIT(to, d) do { \
+	size_t to_ = (to); \
+	int32_t d_ = (d); \
+	if (to_ >= v->len) \
+		break; \
+	if (depth[to_] == -1) \
+	{ \
+		depth[to_] = d_; \
+		work[visited++] = to_; \
+	} \
+	else if (depth[to_] != d_) \
+		goto unbounded; \
+} while(0)
+	
+	VISIT(f->entry, 0);
+	for (size_t next = 0; next < visited; ++next)
+	{
+		size_t ip = work[next];
+		const instruction_t *ins = &code[ip];
+		uint8_t handler = BaseHandler(ins);
+		int32_t d = depth[ip];
+		
+		if (JumpsIndirect(handler) || (WritesR0(handler) && ins->r0 == 3))
+			goto unbounded;
+		
+		switch(handler)
+		{
+			case H_HALT: case H_UNUSED:
+				break;
+			case H_PUSH_R: case H_PUSH_I: case H_PUSHF:
+				if (d + 1 > MAX_STACK)
+					goto unbounded;
+				f->deepest = MAX(f->deepest, d + 1);
+				VISIT(ip + 1, d + 1);
+				break;
+			case H_POP: case H_POPF:
+				if (d == 0)
+					goto unbounded;
+				VISIT(ip + 1, d - 1);
+				break;
+			case H_CALL_I:
+				GROW(f->calls, f->callCount, callCap);
+				f->calls[f->callCount++] = (call_t){ (uint32_t)ins->imm, d };
+				VISIT(ip + 1, d);
+				break;
+			case H_RET:
+				if (main || d != 0)
+					goto unbounded;
+				break;
+			case H_JMP_I:
+				VISIT(ins->imm, d);
+				break;
+			default:
+				if (JumpsImmediate(handler))
+					VISIT(ins->imm, d);
+				VISIT(ip + 1, d);
+				break;
+		}
+	}
+#undef VISIT
+	goto done;
+	
+unbounded:
+	result = DEPTH_UNBOUNDED;
+done:
+	for (size_t i = 0; i < visited; ++i)
+		depth[work[i]] = -1;
+	return result;
+}
+
+// Start working out the function at entry. If it can't be bounded by
+// itself it's finished straight away, otherwise it waits on its calls.
+static void EnterFunction(verifier_t *v, size_t entry, int main)
+{
+	GROW(v->frames, v->frameCount, v->frameCap);
+	frame_t *f = &v->frames[v->frameCount];
+	f->entry = entry;
+	v->functions[entry] = DEPTH_VISITING;
+	
+	if (WalkFunction(v, f, main) == DEPTH_UNBOUNDED)
+	{
+		free(f->calls);
+		v->functions[entry] = DEPTH_UNBOUNDED;
+		return;
+	}
+	v->frameCount++;
+}
+
+// How deep the function at entry takes the stack. Rather than recursing
+// for every level of calls the functions still being worked out are
+// kept on v->frames, a caller carries on once its callee is finished.
+static int64_t FunctionDepth(verifier_t *v, size_t entry, int main)
+{
+	EnterFunction(v, entry, main);
+	
+	while (v->frameCount)
+	{
+		frame_t *f = &v->frames[v->frameCount - 1];
+		int64_t deepest = f->deepest;
+		
+		if (f->next < f->callCount)
+		{
+			const call_t *call = &f->calls[f->next];
+			int64_t callee = v->functions[call->callee];
+			
+			if (callee == DEPTH_UNKNOWN)
+			{
+				EnterFunction(v, call->callee, 0);
+				continue;
+			}
+			
+			// DEPTH_VISITING is recursion
+			if (callee < 0 || call->depth + 1 + callee > MAX_STACK)
+				deepest = DEPTH_UNBOUNDED;
+			else
+			{
+				f->deepest = MAX(f->deepest, call->depth + 1 + callee);
+				f->next++;
+				continue;
+			}
+		}
+		
+		v->functions[f->entry] = deepest;
+		free(f->calls);
+		v->frameCount--;
+	}
+	
+	return v->functions[entry];
+}
+
+// Check a freshly decoded program, before any of the later passes have
+// rewritten it. Returns -1 and says why if the program can't be run.
+// maxDepth is set to how deep the stack can get when it's started at
+// entry, or SIZE_MAX if that can't be known before running it.
+int VerifyProgram(const char *name, const instruction_t *code, size_t len, size_t entry, size_t *maxDepth)
+{
+	*maxDepth = SIZE_MAX;
+	
+	for (size_t ip = 0; ip < len; ++ip)
+	{
+		const instruction_t *ins = &code[ip];
+		uint8_t handler = BaseHandler(ins);
+		
+		if (handler == H_UNKNOWN)
+		{
+			fprintf(stderr, "%s: instruction %zu: unknown opcode 0x%x\n", name, ip, ins->opcode);
+			return -1;
+		}
+		if ((UsesR0(handler) && ins->r0 >= NUM_REGS) || (UsesR1(handler) && ins->r1 >= NUM_REGS))
+		{
+			fprintf(stderr, "%s: instruction %zu: no such register r%d\n", name, ip,
+			        ins->r0 >= NUM_REGS ? ins->r0 : ins->r1);
+			return -1;
+		}
+		if (JumpsImmediate(handler) && (size_t)(uint32_t)ins->imm >= len)
+		{
+			fprintf(stderr, "%s: instruction %zu: jump to %u is outside of the program\n", name, ip,
+			        (uint32_t)ins->imm);
+			return -1;
+		}
+	}
+	
+	if (entry >= len)
+	{
+		*maxDepth = 0;
+		return 0;
+	}
+	
+	verifier_t v = { code, len, malloc(len * sizeof(*v.functions)), malloc(len * sizeof(*v.depth)),
+	                 malloc(len * sizeof(*v.work)), NULL, 0, 0 };
+	if (!v.functions || !v.depth || !v.work)
+	{
+		fprintf(stderr, "failed allocating %zu bytes: %s\n", len * sizeof(*v.functions), strerror(errno));
+		exit(1);
+	}
+	for (size_t i = 0; i < len; ++i)
+	{
+		v.functions[i] = DEPTH_UNKNOWN;
+		v.depth[i] = -1;
+	}
+	
+	int64_t deepest = FunctionDepth(&v, entry, 1);
+	if (deepest >= 0)
+		*maxDepth = deepest;
+	
+	free(v.functions);
+	free(v.depth);
+	free(v.work);
+	free(v.frames);
+	return 0;
+}
+
+// Whether the vm can run without checking the stack. The verifier's
+// bound is relative to wherever r3 was when the program started, it's
+// not touched by anything else after that.
+int StackVerified(const vm_t *vm)
+{
+	return vm->maxDepth <= MAX_STACK && vm->regs[3] >= 0 &&
+		(uint64_t)vm->regs[3] + vm->maxDepth <= MAX_STACK;
+}
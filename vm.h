@@ -0,0 +1,683 @@
+/*
+ * Copyright (c) 2014, Justin Crawford <Justasic@gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#ifndef VM_H_
+#define VM_H_
+
+// Needed for the bullshit license issues - Justasic
+#define _POSIX_C_SOURCE 200809L 
+#define __USE_XOPEN2K8 1
+#define __USE_XOPEN2K 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <setjmp.h>
+#ifndef __STDC_NO_THREADS__
+# include <threads.h>
+#else
+// Use our local hack-around version
+# include "threads.h"
+#endif
+#include "trace.h"
+#include "module.h"
+#if defined(VM_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+# include <x86intrin.h>
+#elif defined(VM_PROFILE)
+# include <time.h>
+#endif
+
+// Our registers
+//
+// r0 - general register
+// r1 - general register
+// r2 - general register
+// r3 - stack pointer register
+// r4 - flags register
+#define NUM_REGS 5
+
+// Our max stack size
+#define MAX_STACK (1 << 16)
+
+// Linear memory for programs which don't say how much they want, see
+// memory.c. Only programs using LOAD/STORE or INT get any at all.
+#define DEFAULT_MEMORY (64 * 1024)
+
+// Files a program can have open at once, including stdin/out/err
+#define VM_FILES 16
+
+// Threads making system calls for the scheduler's vms, see io.c
+#define IO_THREADS 4
+
+// With a 64 bit address space the whole 32 bit guest address space is
+// reserved for every vm so accesses never need a bounds check, the
+// guard pages catch anything outside the program's memory. Otherwise
+// every access is checked.
+#if SIZE_MAX > UINT32_MAX
+# define VM_MEMORY_GUARD 1
+#endif
+
+// How many vms RunBatch() runs in lockstep (see batch.c), one register
+// of them should fit a vector register.
+#ifndef BATCH_LANES
+# if defined(__AVX2__)
+#  define BATCH_LANES 8
+# else
+#  define BATCH_LANES 4
+# endif
+#endif
+
+// Some flag functions
+#define SETFLAGS(var, flags)   (var |= (flags))
+#define UNSETFLAGS(var, flags) (var &= ~(flags))
+
+// Other macros
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+// The decoded instruction. CompileVM unpacks the whole program into
+// a flat array of these once at load time so interpret() never has to
+// touch the raw program_t words (or the allocator) while running.
+typedef struct instruction_s
+{
+	// The opcode that was decoded
+	uint16_t opcode;
+	// The type of the operands (whether it's a register or an immediate constant value)
+	uint8_t type;
+	// The specialized handler interpret() dispatches to (see HANDLERS below)
+	uint8_t handler;
+	// The real handler when handler is a wrapper like SYNCF
+	uint8_t inner;
+	// The handler a BLOCK runs once it has charged for the block
+	uint8_t block;
+	// Instructions from here to the end of the basic block
+	uint16_t left;
+	// operands (decoded)
+	uint8_t r0;
+	uint8_t r1;
+	uint8_t r2;
+	// immediate value
+	int32_t imm;
+} instruction_t;
+
+// This is just a struct to use in the struct below
+// it corrects the instruction pointer
+//
+// Normally operands is type << 16 | r0 << 12 | r1 << 8 | r2 << 4 and an
+// 8 bit immediate in the low byte, overlapping r2. Anything bigger uses
+// the wide form: OP_WIDE is set in opcode, the type and registers move
+// up into its top half (type << 24 | r0 << 20 | r1 << 16) and operands
+// is the whole 32 bit immediate. It's still one instruction per word
+// pair so ips don't change. See EncodeInstruction()
+typedef struct program_s
+{
+	int32_t opcode;
+	int32_t operands;
+} program_t;
+
+#define OP_WIDE (1 << 30)
+// Immediates the normal encoding can hold
+#define NARROW_IMMEDIATE(imm) ((imm) >= 0 && (imm) <= 0xFF)
+
+// A decoded program, shared read-only by every vm running the same
+// program from the same entry point, see codecache.c
+typedef struct code_s
+{
+	// length instructions and the END sentinel
+	const instruction_t *code;
+	size_t length;
+	size_t entry;
+	// The verifier's stack bound, see verify.c
+	size_t maxDepth;
+	// Whether it has any LOAD/STORE and needs linear memory
+	int memory;
+	// Hash of the program and entry, what snapshots know it by
+	uint64_t hash;
+} code_t;
+
+// Bump allocator everything belonging to one program comes from, see pool.c
+typedef struct arena_s
+{
+	struct arena_chunk_s *chunks;
+} arena_t;
+
+// What the vm pool has had to get from the system
+typedef struct alloc_stats_s
+{
+	uint64_t vmsCreated;   // vms (and their stacks) allocated
+	uint64_t vmsReused;    // vms handed out again from the pool
+	uint64_t arenaChunks;  // arena chunks allocated
+	uint64_t arenaBytes;   // total size of those chunks
+	uint64_t stackCleared; // bytes of stack cleared recycling vms
+	uint64_t programsDecoded; // programs decoded and verified
+	uint64_t programsShared;  // loads which found the program already decoded
+} alloc_stats_t;
+
+// Stable reference to a registered vm, see registry.c. 0 is never valid.
+typedef uint64_t vm_handle_t;
+
+// vm struct to allow for multiple programs
+// to run at the same time on the same inter-
+// preter. Multiplexing!
+typedef struct vm_s
+{
+        // See the define above
+	int32_t regs[NUM_REGS];
+
+	// Lazily evaluated flags. Rather than working out r4 after every
+	// ALU op we remember what the last flag setting op was and only
+	// compute the flags when something actually looks at them. When
+	// lazyOp is LAZY_NONE regs[4] is up to date.
+	uint8_t lazyOp;
+	int32_t lazyResult;
+	int32_t lazyA;
+	int32_t lazyB;
+
+        // Our stack -- quite large so we
+        // can hold a lot of things in it.
+        // Size should be 1 << 16
+        unsigned *opstack;
+	// One past the highest stack slot ever pushed to, only that
+	// much needs clearing when the vm is recycled.
+	uint32_t stackHigh;
+	// How deep the program can take the stack, SIZE_MAX if the
+	// verifier couldn't tell (see verify.c)
+	size_t maxDepth;
+
+        // Our instruction pointer
+        unsigned long ip;
+
+        // The length of the program loaded
+        size_t programLength;
+
+        // The program, decoded into a flat array of
+        // programLength instructions. Shared with every other vm
+        // running the same program so it's never written to.
+	const instruction_t *code;
+	const code_t *shared;
+	// Where code and anything else for the program is allocated from
+	arena_t *arena;
+	// The module file the program was loaded from, mapped for as long
+	// as the vm lives. NULL for plain programs. See module.c
+	const module_header_t *module;
+	size_t moduleSize;
+	
+	// Check whether the program is running
+	unsigned char running;
+	// Why it stopped if it didn't halt, see TRAP_ below
+	unsigned char trap;
+	// Stopped at a system call which has to be made before it can go
+	// on, which one it is. See io.c
+	unsigned char waiting;
+	int32_t syscall;
+	
+	// Host fd + 1 for each guest fd it has open, 0 if it isn't
+	int files[VM_FILES];
+	// Who to tell once the system call is done, see SubmitIO()
+	void (*ioDone)(struct vm_s *vm, void *arg);
+	void *ioArg;
+	
+	// Linear memory, guest address 0 is at memory and memorySize bytes
+	// from there can be used. See memory.c
+	uint8_t *memory;
+	uint64_t memorySize;
+	// Which pages of the stack and memory are shared with forks of the
+	// vm, NULL if they aren't. See fork.c
+	struct pages_s *stackPages, *memoryPages;
+	// Where the last memory access was made, a fault stops the vm there
+	size_t accessIp;
+	uint64_t accessFuel;
+
+	// Instruction budget. Fuel is charged a whole basic block at a
+	// time when the block is entered, if there isn't enough left for
+	// the block the vm stops in front of it with yielded set and can
+	// be continued once it's been given more.
+	uint64_t fuel;
+	uint64_t retired;
+	unsigned char yielded;
+	
+	// The name of the program
+	const char *name;
+	size_t nameLen;
+	
+	// The next vm in the scheduler run queue this vm is on
+	struct vm_s *runNext;
+	
+	// Our handle in the registry
+	vm_handle_t handle;
+
+#ifdef VM_PAIR_PROFILE
+	// How often each handler ran straight after another one,
+	// indexed [previous * H_COUNT + current]
+	uint64_t *pairCounts;
+#endif
+
+#ifdef VM_TRACE
+	// Every instruction fetched, see trace.h
+	trace_ring_t *trace;
+#endif
+
+#ifdef VM_PROFILE
+	// What every instruction of the program cost, programLength + 1 of
+	// them (the last is the END sentinel), see profile.c
+	struct profile_entry_s *profile;
+#endif
+
+	// Native code for the program when running with --jit
+	struct jit_s *jit;
+} vm_t;
+
+// All the mnemonics
+enum 
+{
+        // Basic mnemonics
+        OP_UNUSED = 0x000, // Unused -- throw error if used because program is likely corrupt.
+        OP_NOP    = 0x001, // No-operation opcode
+        OP_ADD    = 0x002, // add two numbers together
+        OP_SUB    = 0x003, // subtract two numbers
+        OP_MUL    = 0x004, // Multiply two numbers
+        OP_DIV    = 0x005, // divide two numbers
+        
+        // Bitwise operators
+        OP_XOR    = 0x006, // bitwise exclusive or
+        OP_OR     = 0x007, // bitwise or
+        OP_NOT    = 0x008, // bitwise not
+        OP_AND    = 0x009, // bitwise and
+        OP_SHR    = 0x00A, // bitshift right
+        OP_SHL    = 0x00B, // bitshift left
+
+        OP_INC    = 0x00C, // increment register
+        OP_DEC    = 0x00D, // decrement register
+
+        // Stack operators
+        OP_MOV    = 0x00E, // Move values from register to register
+        OP_CMP    = 0x00F, // Compare two registers
+        OP_CALL   = 0x010, // Call a function
+        OP_RET    = 0x011, // Return from a function call
+        OP_PUSH   = 0x012, // Push a value to the stack
+        OP_POP    = 0x013, // Pop a value from the stack
+        OP_LEA    = 0x014, // Load effective address
+
+        // Jumps
+        OP_JMP    = 0x015, // Jump always
+        OP_JNZ    = 0x016, // Jump if not zero
+        OP_JZ     = 0x017, // Jump if zero
+        OP_JS     = 0x018, // Jump if sign
+	OP_JNS    = 0x019, // Jump if not sign
+        OP_JGT    = 0x01A, // Jump if greater than
+        OP_JLT    = 0x01B, // Jump if less than
+	OP_JPE    = 0x01C, // Jump if parity even
+	OP_JPO    = 0x01D, // Jump if parity odd
+
+        // Program control
+        OP_HALT   = 0x01E, // Halt the application
+        OP_INT    = 0x01F, // Interrupt -- used for syscalls
+	OP_LOADI  = 0x020, // Load an imm value
+	OP_PUSHF  = 0x021, // Push flags to stack
+	OP_POPF   = 0x022, // Pop flags from stack
+
+	// Linear memory, the address is a register plus an offset or just
+	// a constant. Narrow loads are zero extended.
+	OP_LOAD8   = 0x023, // Load a byte
+	OP_LOAD16  = 0x024, // Load 2 bytes
+	OP_LOAD32  = 0x025, // Load 4 bytes
+	OP_STORE8  = 0x026, // Store the low byte of a register
+	OP_STORE16 = 0x027, // Store the low 2 bytes of a register
+	OP_STORE32 = 0x028, // Store a register
+
+        // Debug
+        OP_DMP    = 0xA00, // Dump all registers to terminal
+        OP_PRNT   = 0xA01 // Dump specific register to the terminal
+};
+
+// All flags
+enum
+{
+	FLAG_CARRY    = (1 << 0), // If an arithmatic carry operation occured
+	FLAG_ZERO     = (1 << 1), // If the operation resulted in a zero result
+	FLAG_OVERFLOW = (1 << 2), // If the operation overflowed the integer
+	FLAG_SIGN     = (1 << 3), // If the operation used a signed integer that is negative
+	FLAG_PARITY   = (1 << 4)  // see http://en.wikipedia.org/wiki/Parity_flag
+};
+
+#define FLAG_MASK (FLAG_CARRY | FLAG_ZERO | FLAG_OVERFLOW | FLAG_SIGN | FLAG_PARITY)
+
+// Signed greater than (not zero and sign == overflow) and
+// signed less than (sign != overflow) conditions
+#define JGT_TAKEN(f) (!((f) & FLAG_ZERO) && !((f) & FLAG_SIGN) == !((f) & FLAG_OVERFLOW))
+#define JLT_TAKEN(f) (!((f) & FLAG_SIGN) != !((f) & FLAG_OVERFLOW))
+
+// What stopped a program which didn't halt by itself
+enum
+{
+	TRAP_NONE,
+	TRAP_UNUSED,          // ran an OP_UNUSED
+	TRAP_STACK_OVERFLOW,  // pushed past MAX_STACK
+	TRAP_STACK_UNDERFLOW, // popped an empty stack
+	TRAP_PAST_END,        // ran off the end of the program
+	TRAP_MEMORY           // accessed memory outside of its linear memory
+};
+
+// System calls, INT #n with the arguments in r0-r2. The result comes
+// back in r0, a negative errno value if the call failed. See io.c
+enum
+{
+	SYS_OPEN,  // r0 = path address, r1 = OPEN_ mode, returns the fd
+	SYS_CLOSE, // r0 = fd
+	SYS_READ,  // r0 = fd, r1 = buffer address, r2 = length, returns the bytes read
+	SYS_WRITE  // r0 = fd, r1 = buffer address, r2 = length, returns the bytes written
+};
+
+// How SYS_OPEN opens a file, writing creates it if it doesn't exist
+enum
+{
+	OPEN_READ,
+	OPEN_WRITE,  // truncated
+	OPEN_APPEND
+};
+
+// The kind of operation the lazy flags were recorded for
+enum
+{
+	LAZY_NONE,  // regs[4] already holds the flags
+	LAZY_LOGIC, // carry and overflow are always clear
+	LAZY_ADD,   // result = a + b
+	LAZY_SUB,   // result = a - b
+	LAZY_MUL    // result = a * b
+};
+
+// used to tell whether the opcode is to use
+// the constant value (imm) or the registers.
+enum 
+{
+	OP_FLAG_UNKNOWN,
+	OP_FLAG_IMMEDIATE,
+	OP_FLAG_REGISTER
+};
+
+// The handlers interpret() actually dispatches on. Every opcode which
+// takes either a register or an immediate operand is split at load time
+// into a register form (_RR/_R) and an immediate form (_RI/_I) so the
+// handlers never have to check the operand type while running.
+#define HANDLERS(X) \
+	X(UNUSED)  X(NOP)     X(HALT)    X(LOADI)   \
+	X(ADD_RR)  X(ADD_RI)  X(SUB_RR)  X(SUB_RI)  \
+	X(MUL_RR)  X(MUL_RI)  X(DIV_RR)  X(DIV_RI)  \
+	X(XOR_RR)  X(XOR_RI)  X(OR_RR)   X(OR_RI)   \
+	X(AND_RR)  X(AND_RI)  X(SHL_RR)  X(SHL_RI)  \
+	X(SHR_RR)  X(SHR_RI)  X(NOT_RR)  X(NOT_RI)  \
+	X(MOV_RR)  X(MOV_RI)  X(CMP_RR)  X(CMP_RI)  \
+	X(INC)     X(DEC)                           \
+	X(CALL_R)  X(CALL_I)  X(RET)               \
+	X(PUSH_R)  X(PUSH_I)  X(PUSHF)   X(POP)     \
+	X(POPF)    X(SYNCF)    X(BLOCK)             \
+	X(JMP_R)   X(JMP_I)   X(JNZ_R)   X(JNZ_I)   \
+	X(JZ_R)    X(JZ_I)    X(JS_R)    X(JS_I)    \
+	X(JNS_R)   X(JNS_I)   X(JGT_R)   X(JGT_I)   \
+	X(JLT_R)   X(JLT_I)   X(JPE_R)   X(JPE_I)   \
+	X(JPO_R)   X(JPO_I)                         \
+	X(LEA_R)   X(LEA_I)                         \
+	X(LOAD8_R)  X(LOAD8_I)  X(LOAD16_R)  X(LOAD16_I)  \
+	X(LOAD32_R) X(LOAD32_I) X(STORE8_R)  X(STORE8_I)  \
+	X(STORE16_R) X(STORE16_I) X(STORE32_R) X(STORE32_I) \
+	X(UNIMPL)  X(PRNT)    X(DMP)     X(UNKNOWN) \
+	X(INT)     X(END)                           \
+	/* Superinstructions (see FuseInstructions) */ \
+	X(CMP_RR_JZ)  X(CMP_RI_JZ)  X(CMP_RR_JNZ) X(CMP_RI_JNZ) \
+	X(CMP_RR_JLT) X(CMP_RI_JLT) X(CMP_RR_JGT) X(CMP_RI_JGT) \
+	X(INC_JZ)     X(INC_JNZ)    X(DEC_JZ)     X(DEC_JNZ)    \
+	X(LOADI_ADD_RR) X(LOADI_SUB_RR) \
+	/* Flag updates nothing reads (see optimize.c) */ \
+	X(ADD_RR_NF) X(ADD_RI_NF) X(SUB_RR_NF) X(SUB_RI_NF) \
+	X(MUL_RR_NF) X(MUL_RI_NF) X(DIV_RR_NF) X(DIV_RI_NF) \
+	X(XOR_RR_NF) X(XOR_RI_NF) X(OR_RR_NF)  X(OR_RI_NF)  \
+	X(AND_RR_NF) X(AND_RI_NF) X(SHL_RR_NF) X(SHL_RI_NF) \
+	X(SHR_RR_NF) X(SHR_RI_NF) X(NOT_RR_NF) X(NOT_RI_NF) \
+	X(MOV_RR_NF) X(MOV_RI_NF) X(INC_NF)    X(DEC_NF)
+
+enum
+{
+#define X(name) H_##name,
+	HANDLERS(X)
+#undef X
+	H_COUNT
+};
+
+static inline int has_even_parity(uint32_t x)
+{
+#ifdef __GNUC__
+	// A single popcnt instruction on anything that has one
+	return !(__builtin_popcount(x) & 1);
+#else
+	uint32_t count = 0;
+	
+	for(uint32_t i = 0; i < (sizeof(uint32_t) * CHAR_BIT); i++)
+		if(x & (1 << i))
+			count++;
+	
+	return !(count % 2);
+#endif
+}
+
+// Work out the flags in mask for an operation of kind op (LAZY_*).
+// This is always inlined with a constant mask so only the flags
+// actually asked for get computed.
+static inline int32_t FlagsFor(uint8_t op, int32_t res, int32_t a, int32_t b, int32_t mask)
+{
+	int32_t flags = 0;
+	
+	if ((mask & FLAG_ZERO) && res == 0)
+		SETFLAGS(flags, FLAG_ZERO);
+	if ((mask & FLAG_SIGN) && res < 0)
+		SETFLAGS(flags, FLAG_SIGN);
+	if ((mask & FLAG_PARITY) && has_even_parity(res))
+		SETFLAGS(flags, FLAG_PARITY);
+	
+	if (mask & (FLAG_CARRY | FLAG_OVERFLOW))
+	{
+		switch(op)
+		{
+			case LAZY_ADD:
+				// unsigned wrap around and signed overflow
+				if ((uint32_t)res < (uint32_t)a)
+					SETFLAGS(flags, FLAG_CARRY);
+				if (((a ^ res) & (b ^ res)) < 0)
+					SETFLAGS(flags, FLAG_OVERFLOW);
+				break;
+			case LAZY_SUB:
+				// unsigned borrow and signed overflow
+				if ((uint32_t)a < (uint32_t)b)
+					SETFLAGS(flags, FLAG_CARRY);
+				if (((a ^ b) & (a ^ res)) < 0)
+					SETFLAGS(flags, FLAG_OVERFLOW);
+				break;
+			case LAZY_MUL:
+				// the full product didn't fit in 32 bits
+				if ((int64_t)a * b != res)
+					SETFLAGS(flags, FLAG_CARRY | FLAG_OVERFLOW);
+				break;
+			default:
+				break;
+		}
+	}
+	
+	return flags & mask;
+}
+
+// The flags in mask from the last recorded operation
+static inline int32_t ComputeFlags(const vm_t *vm, int32_t mask)
+{
+	return FlagsFor(vm->lazyOp, vm->lazyResult, vm->lazyA, vm->lazyB, mask);
+}
+
+// Get the flags in mask without writing them back to r4.
+static inline int32_t ReadFlags(const vm_t *vm, int32_t mask)
+{
+	if (vm->lazyOp == LAZY_NONE)
+		return vm->regs[4] & mask;
+	return ComputeFlags(vm, mask);
+}
+
+// Write any pending lazy flags back into r4.
+static inline void MaterializeFlags(vm_t *vm)
+{
+	if (vm->lazyOp == LAZY_NONE)
+		return;
+	
+	vm->regs[4] = (vm->regs[4] & ~FLAG_MASK) | ComputeFlags(vm, FLAG_MASK);
+	vm->lazyOp = LAZY_NONE;
+}
+
+#ifdef VM_PROFILE
+typedef struct profile_entry_s
+{
+	// Times the instruction was dispatched and the cycles from then
+	// until the next dispatch
+	uint64_t count;
+	uint64_t cycles;
+	// Conditional jumps only
+	uint64_t taken;
+	uint64_t notTaken;
+} profile_entry_t;
+
+// Cycle counter for the profiler, nanoseconds where there's no rdtsc
+static inline uint64_t ProfileClock(void)
+{
+# if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+# else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+# endif
+}
+#endif
+
+// main2.c
+int DecodeProgram(const char *name, const char *data, size_t instructions, size_t entry, instruction_t *code, size_t *maxDepth, int optimize);
+int CompileVM(vm_t *vm, const char *data, size_t len);
+int LoadProgram(vm_t *vm, const char *path);
+void interpret(vm_t *vm);
+void InterpretOne(vm_t *vm);
+void DecodeInstruction(instruction_t *ins, const program_t *pr);
+void EncodeInstruction(program_t *pr, uint16_t opcode, uint8_t type, uint8_t r0, uint8_t r1, int32_t imm);
+uint8_t BaseHandler(const instruction_t *ins);
+uint8_t QuietHandler(uint8_t handler);
+int ChargeFuel(vm_t *vm, size_t ip);
+int ResumeFuel(vm_t *vm);
+void RunUntilSyscall(vm_t *vm);
+void RunVM(vm_t *vm);
+void RetireVM(vm_t *vm);
+
+// jit.c
+struct jit_s *CompileJIT(const vm_t *vm);
+void FreeJIT(struct jit_s *jit);
+void RunJIT(vm_t *vm);
+
+// memory.c
+int UsesMemory(const instruction_t *code, size_t len);
+int ReserveMemory(vm_t *vm, uint64_t size);
+int SetupMemory(vm_t *vm);
+void ResetMemory(vm_t *vm);
+#ifdef VM_MEMORY_GUARD
+sigjmp_buf *GuardMemory(vm_t *vm);
+void UnguardMemory(void);
+#endif
+
+// io.c
+void Syscall(vm_t *vm);
+void CloseFiles(vm_t *vm);
+void SetIOThreads(size_t threads);
+void SubmitIO(vm_t *vm, void (*done)(vm_t *vm, void *arg), void *arg);
+
+// fork.c
+vm_t *ForkVM(vm_t *parent);
+int ShareFileMemory(vm_t *vm, int fd, uint64_t offset);
+void ReleasePages(struct pages_s **pages);
+
+// optimize.c
+void OptimizeProgram(const char *name, instruction_t *code, size_t len, size_t entry, size_t maxDepth);
+void DeoptimizeVM(vm_t *vm);
+void SetOptimizerStats(int on);
+
+// snapshot.c
+int SaveSnapshot(vm_t *vm, const char *path);
+int RestoreSnapshot(vm_t *vm, const char *path);
+
+// codecache.c
+const code_t *AcquireCode(const char *name, const char *data, size_t len, size_t entry);
+const code_t *RetainCode(const code_t *code);
+const instruction_t *PlainCode(const code_t *code);
+void ReleaseCode(const code_t *code);
+void GetCodeStats(alloc_stats_t *out);
+
+// pool.c
+vm_t *AllocateVM(void);
+void DeallocateVM(vm_t *vm);
+void *ArenaAlloc(arena_t *arena, size_t size, size_t align);
+void ArenaReset(arena_t *arena);
+void ArenaFree(arena_t *arena);
+void GetAllocStats(alloc_stats_t *out);
+
+// registry.c
+vm_handle_t RegisterVM(vm_t *vm);
+vm_t *LookupVM(vm_handle_t handle);
+void ReleaseVM(vm_handle_t handle);
+void UnregisterVM(vm_handle_t handle);
+size_t LiveVMs(void);
+
+// verify.c
+int VerifyProgram(const char *name, const instruction_t *code, size_t len, size_t entry, size_t *maxDepth);
+int StackVerified(const vm_t *vm);
+
+// module.c
+uint32_t ModuleChecksum(const void *data, size_t len);
+int IsModule(const void *data, size_t len);
+int LoadModule(vm_t *vm, const void *data, size_t len, int checksum);
+void UnloadModule(vm_t *vm);
+const void *ModuleData(const vm_t *vm, size_t *size);
+const module_symbol_t *FindSymbol(const vm_t *vm, const char *name);
+
+// asm.c
+void *AssembleModule(const char *name, const char *source, size_t len, size_t *size);
+int LoadAssembly(vm_t *vm, const char *path);
+
+// profile.c
+#ifdef VM_PROFILE
+void MergeProfile(const vm_t *vm);
+void ReportProfiles(void);
+#endif
+
+// batch.c
+void RunBatch(vm_t *const *vms, size_t count);
+
+// sched.c
+struct scheduler_s *CreateScheduler(size_t workers, uint64_t quantum);
+void Schedule(struct scheduler_s *s, vm_t *vm);
+void RunScheduler(struct scheduler_s *s);
+void DestroyScheduler(struct scheduler_s *s);
+
+#endif // VM_H_